@@ -0,0 +1,29 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+using UnrealBuildTool;
+
+public class FogOfWarMass : ModuleRules
+{
+	public FogOfWarMass(ReadOnlyTargetRules Target) : base(Target)
+	{
+		PCHUsage = ModuleRules.PCHUsageMode.UseExplicitOrSharedPCHs;
+
+		PublicDependencyModuleNames.AddRange(
+			new string[]
+			{
+				"Core",
+				"FogOfWar",
+				"MassEntity",
+			}
+			);
+
+		PrivateDependencyModuleNames.AddRange(
+			new string[]
+			{
+				"CoreUObject",
+				"Engine",
+				"MassCommon",
+			}
+			);
+	}
+}
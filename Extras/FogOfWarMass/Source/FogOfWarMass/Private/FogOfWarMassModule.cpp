@@ -0,0 +1,5 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+#include "Modules/ModuleManager.h"
+
+IMPLEMENT_MODULE(FDefaultModuleImpl, FogOfWarMass)
@@ -0,0 +1,204 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+
+#include "MassFogOfWarProcessors.h"
+
+#include "FogOfWar.h"
+#include "MassFogOfWarFragments.h"
+#include "MassCommonFragments.h"
+#include "MassExecutionContext.h"
+#include "Utils/ManagerComponent.h"
+#include "Utils/ManagerStatics.h"
+#include "Kismet/GameplayStatics.h"
+
+DECLARE_STATS_GROUP(TEXT("FogOfWarMass"), STATGROUP_FogOfWarMass, STATCAT_Advanced);
+
+namespace
+{
+	// nullptr until FogOfWar is activated
+	AFogOfWar* ResolveFogOfWar(const UWorld* World)
+	{
+		if (!World || !UGameplayStatics::GetGameState(World))
+		{
+			return nullptr;
+		}
+		return UManagerStatics::GetGameManager(World)->Resolve<AFogOfWar>();
+	}
+
+	struct FMovedVisionEntity
+	{
+		FMassVisionFragment* Vision;
+
+		FVector Location;
+
+		bool bSightRadiusChanged;
+	};
+}
+
+UMassVisionProcessor::UMassVisionProcessor()
+	: EntityQuery(*this)
+{
+	ExecutionFlags = static_cast<int32>(EProcessorExecutionFlags::All);
+	ProcessingPhase = EMassProcessingPhase::PostPhysics;
+	// FogOfWar is not thread safe, so the gathered changes are applied on the game thread
+	bRequiresGameThreadExecution = true;
+}
+
+void UMassVisionProcessor::ConfigureQueries()
+{
+	EntityQuery.AddRequirement<FTransformFragment>(EMassFragmentAccess::ReadOnly);
+	EntityQuery.AddRequirement<FMassVisionFragment>(EMassFragmentAccess::ReadWrite);
+}
+
+void UMassVisionProcessor::Execute(FMassEntityManager& EntityManager, FMassExecutionContext& Context)
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("MassVisionProcessor"), STAT_FogOfWarMassVisionProcessor, STATGROUP_FogOfWarMass);
+
+	AFogOfWar* FogOfWar = ResolveFogOfWar(EntityManager.GetWorld());
+	if (!FogOfWar)
+	{
+		return;
+	}
+
+	// the static entities are filtered out in parallel, only the moved ones reach the game thread part
+	TArray<FMovedVisionEntity> MovedEntities;
+	FCriticalSection MovedEntitiesCriticalSection;
+	{
+		DECLARE_SCOPE_CYCLE_COUNTER(TEXT("MassVisionProcessor: gather"), STAT_FogOfWarMassVisionProcessorGather, STATGROUP_FogOfWarMass);
+		EntityQuery.ParallelForEachEntityChunk(EntityManager, Context, [&](FMassExecutionContext& ChunkContext)
+			{
+				const TConstArrayView<FTransformFragment> Transforms = ChunkContext.GetFragmentView<FTransformFragment>();
+				const TArrayView<FMassVisionFragment> Visions = ChunkContext.GetMutableFragmentView<FMassVisionFragment>();
+
+				TArray<FMovedVisionEntity, TInlineAllocator<64>> ChunkMovedEntities;
+				for (int EntityIndex = 0; EntityIndex < ChunkContext.GetNumEntities(); EntityIndex++)
+				{
+					FMassVisionFragment& Vision = Visions[EntityIndex];
+
+					// the vision unit was removed or FogOfWar was replaced, so the entity is added again
+					if (Vision.FogOfWar != FogOfWar || !FogOfWar->IsVisionUnitValid(Vision.Handle))
+					{
+						Vision.Handle.Reset();
+						Vision.FogOfWar = FogOfWar;
+						Vision.CachedTileGlobalIndex = INDEX_NONE;
+					}
+
+					const FVector Location = Transforms[EntityIndex].GetTransform().GetLocation();
+					const int TileGlobalIndex = FogOfWar->GetTileGlobalIndexWithHysteresis(Location, Vision.CachedTileGlobalIndex);
+					const bool bSightRadiusChanged = Vision.SightRadius != Vision.AppliedSightRadius || Vision.MaxSightRadius != Vision.AppliedMaxSightRadius;
+					if (Vision.Handle.IsSet() && TileGlobalIndex == Vision.CachedTileGlobalIndex && !bSightRadiusChanged)
+					{
+						continue;
+					}
+					Vision.CachedTileGlobalIndex = TileGlobalIndex;
+					Vision.AppliedSightRadius = Vision.SightRadius;
+					Vision.AppliedMaxSightRadius = Vision.MaxSightRadius;
+
+					ChunkMovedEntities.Add({ &Vision, Location, bSightRadiusChanged });
+				}
+
+				if (!ChunkMovedEntities.IsEmpty())
+				{
+					FScopeLock Lock(&MovedEntitiesCriticalSection);
+					MovedEntities.Append(ChunkMovedEntities);
+				}
+			});
+	}
+
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("MassVisionProcessor: apply"), STAT_FogOfWarMassVisionProcessorApply, STATGROUP_FogOfWarMass);
+	for (const FMovedVisionEntity& MovedEntity : MovedEntities)
+	{
+		FMassVisionFragment& Vision = *MovedEntity.Vision;
+		if (!Vision.Handle.IsSet())
+		{
+			Vision.Handle = FogOfWar->AddVisionUnit(MovedEntity.Location, Vision.SightRadius, Vision.MaxSightRadius);
+			continue;
+		}
+
+		FogOfWar->SetVisionUnitLocation(Vision.Handle, MovedEntity.Location);
+		if (MovedEntity.bSightRadiusChanged)
+		{
+			FogOfWar->SetVisionUnitSightRadius(Vision.Handle, Vision.SightRadius, Vision.MaxSightRadius);
+		}
+	}
+}
+
+UMassVisionDeinitializer::UMassVisionDeinitializer()
+	: EntityQuery(*this)
+{
+	ObservedType = FMassVisionFragment::StaticStruct();
+	Operation = EMassObservedOperation::Remove;
+	ExecutionFlags = static_cast<int32>(EProcessorExecutionFlags::All);
+	bRequiresGameThreadExecution = true;
+}
+
+void UMassVisionDeinitializer::ConfigureQueries()
+{
+	EntityQuery.AddRequirement<FMassVisionFragment>(EMassFragmentAccess::ReadWrite);
+}
+
+void UMassVisionDeinitializer::Execute(FMassEntityManager& EntityManager, FMassExecutionContext& Context)
+{
+	AFogOfWar* FogOfWar = ResolveFogOfWar(EntityManager.GetWorld());
+	if (!FogOfWar)
+	{
+		return;
+	}
+
+	EntityQuery.ForEachEntityChunk(EntityManager, Context, [FogOfWar](FMassExecutionContext& ChunkContext)
+		{
+			const TArrayView<FMassVisionFragment> Visions = ChunkContext.GetMutableFragmentView<FMassVisionFragment>();
+			for (FMassVisionFragment& Vision : Visions)
+			{
+				if (Vision.FogOfWar == FogOfWar && FogOfWar->IsVisionUnitValid(Vision.Handle))
+				{
+					FogOfWar->RemoveVisionUnit(Vision.Handle);
+				}
+				Vision.Handle.Reset();
+				Vision.FogOfWar.Reset();
+			}
+		});
+}
+
+UMassVisibleProcessor::UMassVisibleProcessor()
+	: EntityQuery(*this)
+{
+	ExecutionFlags = static_cast<int32>(EProcessorExecutionFlags::All);
+	ProcessingPhase = EMassProcessingPhase::PostPhysics;
+	ExecutionOrder.ExecuteAfter.Add(UMassVisionProcessor::StaticClass()->GetFName());
+	// FogOfWar is resolved on the game thread, the chunks are still processed in parallel
+	bRequiresGameThreadExecution = true;
+}
+
+void UMassVisibleProcessor::ConfigureQueries()
+{
+	EntityQuery.AddRequirement<FTransformFragment>(EMassFragmentAccess::ReadOnly);
+	EntityQuery.AddRequirement<FMassVisibleFragment>(EMassFragmentAccess::ReadWrite);
+}
+
+void UMassVisibleProcessor::Execute(FMassEntityManager& EntityManager, FMassExecutionContext& Context)
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("MassVisibleProcessor"), STAT_FogOfWarMassVisibleProcessor, STATGROUP_FogOfWarMass);
+
+	const AFogOfWar* FogOfWar = ResolveFogOfWar(EntityManager.GetWorld());
+	const TSharedPtr<const FFogOfWarVisibilitySnapshot, ESPMode::ThreadSafe> Snapshot = FogOfWar ? FogOfWar->AcquireVisibilitySnapshot() : nullptr;
+	if (!Snapshot)
+	{
+		return;
+	}
+
+	// the snapshot is immutable, so the workers never see the grid in the middle of an update
+	EntityQuery.ParallelForEachEntityChunk(EntityManager, Context, [&Snapshot](FMassExecutionContext& ChunkContext)
+		{
+			const TConstArrayView<FTransformFragment> Transforms = ChunkContext.GetFragmentView<FTransformFragment>();
+			const TArrayView<FMassVisibleFragment> Visibles = ChunkContext.GetMutableFragmentView<FMassVisibleFragment>();
+
+			for (int EntityIndex = 0; EntityIndex < ChunkContext.GetNumEntities(); EntityIndex++)
+			{
+				FMassVisibleFragment& Visible = Visibles[EntityIndex];
+				const bool bNewIsVisible = Snapshot->IsLocationVisible(Transforms[EntityIndex].GetTransform().GetLocation());
+				Visible.bChanged = Visible.bIsVisible != bNewIsVisible;
+				Visible.bIsVisible = bNewIsVisible;
+			}
+		});
+}
@@ -0,0 +1,51 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "MassEntityTypes.h"
+#include "VisionUnitHandle.h"
+#include "MassFogOfWarFragments.generated.h"
+
+class AFogOfWar;
+
+// Mass counterpart of VisionComponent. The entity must also have FTransformFragment.
+USTRUCT()
+struct FOGOFWARMASS_API FMassVisionFragment : public FMassFragment
+{
+	GENERATED_BODY()
+
+	UPROPERTY(EditAnywhere, meta = (ClampMin = 0.0f, UIMin = 0.0f))
+	float SightRadius = 1000.0f;
+
+	// The memory is reserved for this sight radius, so changing SightRadius up to this value is cheap. Zero means that no additional memory is reserved.
+	UPROPERTY(EditAnywhere, meta = (ClampMin = 0.0f, UIMin = 0.0f))
+	float MaxSightRadius = 0.0f;
+
+	// everything below is maintained by the processors
+
+	FVisionUnitHandle Handle;
+
+	// the instance the handle belongs to. the handle is meaningless in another one, even if its slot happens to be alive there
+	TWeakObjectPtr<AFogOfWar> FogOfWar;
+
+	// the tile FogOfWar was notified about last time
+	int CachedTileGlobalIndex = INDEX_NONE;
+
+	// the sight radii FogOfWar was notified about last time
+	float AppliedSightRadius = 0.0f;
+
+	float AppliedMaxSightRadius = 0.0f;
+};
+
+// Mass counterpart of VisibleComponent. The entity must also have FTransformFragment.
+USTRUCT()
+struct FOGOFWARMASS_API FMassVisibleFragment : public FMassFragment
+{
+	GENERATED_BODY()
+
+	bool bIsVisible = true;
+
+	// set for one update when bIsVisible changes, so the representation processors don't have to track the previous value
+	bool bChanged = false;
+};
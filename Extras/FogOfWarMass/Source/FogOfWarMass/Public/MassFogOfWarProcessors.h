@@ -0,0 +1,63 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "MassProcessor.h"
+#include "MassObserverProcessor.h"
+#include "MassFogOfWarProcessors.generated.h"
+
+// Finds the vision entities that changed the tile or the sight radius in parallel chunks and pushes them to FogOfWar on the game thread.
+// The entities are registered lazily, so it's fine to spawn them before FogOfWar is activated.
+UCLASS()
+class FOGOFWARMASS_API UMassVisionProcessor : public UMassProcessor
+{
+	GENERATED_BODY()
+
+public:
+	UMassVisionProcessor();
+
+protected:
+	virtual void ConfigureQueries() override;
+
+	virtual void Execute(FMassEntityManager& EntityManager, FMassExecutionContext& Context) override;
+
+protected:
+	FMassEntityQuery EntityQuery;
+};
+
+// Removes the vision unit from FogOfWar when FMassVisionFragment is removed or the entity is destroyed.
+UCLASS()
+class FOGOFWARMASS_API UMassVisionDeinitializer : public UMassObserverProcessor
+{
+	GENERATED_BODY()
+
+public:
+	UMassVisionDeinitializer();
+
+protected:
+	virtual void ConfigureQueries() override;
+
+	virtual void Execute(FMassEntityManager& EntityManager, FMassExecutionContext& Context) override;
+
+protected:
+	FMassEntityQuery EntityQuery;
+};
+
+// Writes the visibility of the entity's location into FMassVisibleFragment in parallel chunks, reading the published visibility snapshot.
+UCLASS()
+class FOGOFWARMASS_API UMassVisibleProcessor : public UMassProcessor
+{
+	GENERATED_BODY()
+
+public:
+	UMassVisibleProcessor();
+
+protected:
+	virtual void ConfigureQueries() override;
+
+	virtual void Execute(FMassEntityManager& EntityManager, FMassExecutionContext& Context) override;
+
+protected:
+	FMassEntityQuery EntityQuery;
+};
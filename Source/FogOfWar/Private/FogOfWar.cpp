@@ -3,17 +3,99 @@
 
 #include "FogOfWar.h"
 
+#include "FogOfWarStats.h"
 #include "VisionComponent.h"
+#include "Async/ParallelFor.h"
 #include "Components/BrushComponent.h"
 #include "Components/PostProcessComponent.h"
+#include "Engine/LevelBounds.h"
 #include "Kismet/KismetRenderingLibrary.h"
+#include "Misc/App.h"
 #include "Utils/ManagerComponent.h"
 #include "Utils/ManagerStatics.h"
 #include "Utils/Macros.h"
 
 DEFINE_LOG_CATEGORY(LogFogOfWar);
 
-DECLARE_STATS_GROUP(TEXT("FogOfWar"), STATGROUP_FogOfWar, STATCAT_Advanced);
+namespace
+{
+	// splitmix64 finalizer, so the checksum of a grid doesn't collide with the checksum of the same grid shifted by a tile
+	FORCEINLINE_DEBUGGABLE uint64 GetTileChecksumHash(int GlobalIndex)
+	{
+		uint64 Hash = static_cast<uint64>(GlobalIndex) + 0x9E3779B97F4A7C15ull;
+		Hash = (Hash ^ (Hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+		Hash = (Hash ^ (Hash >> 27)) * 0x94D049BB133111EBull;
+		return Hash ^ (Hash >> 31);
+	}
+
+	// the CPU smooth visibility rows, 4 tiles per instruction and a scalar tail
+
+	// Accumulated = lerp(Accumulated, Snapshot, Absorption), then CutOff is Accumulated with the values below MinimalVisibility zeroed
+	void InterpolateAndCutOffRow(float* Accumulated, const float* Snapshot, float* CutOff, int Num, float Absorption, float MinimalVisibility)
+	{
+		const VectorRegister4Float AbsorptionVector = VectorSetFloat1(Absorption);
+		const VectorRegister4Float MinimalVisibilityVector = VectorSetFloat1(MinimalVisibility);
+		int Index = 0;
+		for (; Index + 4 <= Num; Index += 4)
+		{
+			const VectorRegister4Float Previous = VectorLoad(Accumulated + Index);
+			const VectorRegister4Float Value = VectorMultiplyAdd(VectorSubtract(VectorLoad(Snapshot + Index), Previous), AbsorptionVector, Previous);
+			VectorStore(Value, Accumulated + Index);
+			VectorStore(VectorSelect(VectorCompareGE(Value, MinimalVisibilityVector), Value, VectorZeroFloat()), CutOff + Index);
+		}
+		for (; Index < Num; Index++)
+		{
+			const float Value = FMath::Lerp(Accumulated[Index], Snapshot[Index], Absorption);
+			Accumulated[Index] = Value;
+			CutOff[Index] = Value >= MinimalVisibility ? Value : 0.0f;
+		}
+	}
+
+	// [1 2 1] / 4 along the row, the edge tiles are repeated
+	void FilterRow(const float* Source, float* Destination, int Num)
+	{
+		const auto FilterTile = [Source, Num](int Index)
+		{
+			return 0.25f * Source[FMath::Max(Index - 1, 0)] + 0.5f * Source[Index] + 0.25f * Source[FMath::Min(Index + 1, Num - 1)];
+		};
+
+		if (Num == 0)
+		{
+			return;
+		}
+		Destination[0] = FilterTile(0);
+
+		const VectorRegister4Float Quarter = VectorSetFloat1(0.25f);
+		const VectorRegister4Float Half = VectorSetFloat1(0.5f);
+		int Index = 1;
+		for (; Index + 4 < Num; Index += 4)
+		{
+			const VectorRegister4Float Sides = VectorAdd(VectorLoad(Source + Index - 1), VectorLoad(Source + Index + 1));
+			VectorStore(VectorMultiplyAdd(Sides, Quarter, VectorMultiply(VectorLoad(Source + Index), Half)), Destination + Index);
+		}
+		for (; Index < Num; Index++)
+		{
+			Destination[Index] = FilterTile(Index);
+		}
+	}
+
+	// [1 2 1] / 4 across the rows
+	void FilterRows(const float* Above, const float* Row, const float* Below, float* Destination, int Num)
+	{
+		const VectorRegister4Float Quarter = VectorSetFloat1(0.25f);
+		const VectorRegister4Float Half = VectorSetFloat1(0.5f);
+		int Index = 0;
+		for (; Index + 4 <= Num; Index += 4)
+		{
+			const VectorRegister4Float Sides = VectorAdd(VectorLoad(Above + Index), VectorLoad(Below + Index));
+			VectorStore(VectorMultiplyAdd(Sides, Quarter, VectorMultiply(VectorLoad(Row + Index), Half)), Destination + Index);
+		}
+		for (; Index < Num; Index++)
+		{
+			Destination[Index] = 0.25f * (Above[Index] + Below[Index]) + 0.5f * Row[Index];
+		}
+	}
+}
 
 namespace Names
 {
@@ -41,45 +123,153 @@ AFogOfWar::AFogOfWar()
 
 void AFogOfWar::RegisterVisionComponent(UVisionComponent* VisionComponent)
 {
-	if (RegisteredVisions.Contains(VisionComponent))
+	if (IsVisionUnitValid(VisionComponent->GetVisionUnitHandle()))
 	{
 		return;
 	}
-	RegisteredVisions.Add(VisionComponent, CreateVisionUnitDataFromVisionComponent(VisionComponent));
+	PendingVisionComponents.Add(VisionComponent);
+}
 
-#if WITH_EDITORONLY_DATA
-	RegisteredVisionsNum = RegisteredVisions.Num();
-	TotalRegisteredVisionsCacheTilesNum += RegisteredVisions[VisionComponent].LocalAreaTilesCachedStates.Num();
-#endif
+void AFogOfWar::UnregisterVisionComponent(UVisionComponent* VisionComponent)
+{
+	// spawned and destroyed in the same frame, so it was never added
+	if (PendingVisionComponents.RemoveSwap(VisionComponent, false) > 0)
+	{
+		return;
+	}
 
-	UE_LOG(LogFogOfWar, Log, TEXT("Registered %s with FogOfWar"), *VisionComponent->GetOwner()->GetName());
+	const int VisionUnitIndex = GetVisionUnitIndex(VisionComponent->GetVisionUnitHandle());
+	if (!ensure(VisionUnitIndex != INDEX_NONE && VisionUnitComponents[VisionUnitIndex] == VisionComponent))
+	{
+		return;
+	}
+	// the component may be gone by the time the removal is applied
+	VisionUnitComponents[VisionUnitIndex] = nullptr;
+	PendingUnregisteredVisionUnitHandles.Add(VisionComponent->GetVisionUnitHandle());
 }
 
-void AFogOfWar::UnregisterVisionComponent(UVisionComponent* VisionComponent)
+void AFogOfWar::UpdateVisionComponentSightRadius(UVisionComponent* VisionComponent)
 {
-	if (!ensure(RegisteredVisions.Contains(VisionComponent)))
+	const int VisionUnitIndex = GetVisionUnitIndex(VisionComponent->GetVisionUnitHandle());
+	if (VisionUnitIndex == INDEX_NONE)
 	{
+		// not registered yet, the sight radius will be picked up on registration
 		return;
 	}
-	ResetCachedVisibilities(RegisteredVisions[VisionComponent]);
+	VisionUnitLocations[VisionUnitIndex] = VisionComponent->GetOwner()->GetActorLocation();
+	if (MovementTrace)
+	{
+		MovementTrace->MoveUnit(VisionComponent->GetVisionUnitHandle(), VisionUnitLocations[VisionUnitIndex]);
+	}
+	SetVisionUnitSightRadius(VisionComponent->GetVisionUnitHandle(), VisionComponent->GetSightRadius(), VisionComponent->GetMaxSightRadius());
+}
 
-#if WITH_EDITORONLY_DATA
-	TotalRegisteredVisionsCacheTilesNum -= RegisteredVisions[VisionComponent].LocalAreaTilesCachedStates.Num();
-#endif
+FVisionUnitHandle AFogOfWar::AddVisionUnit(FVector Location, float SightRadius, float MaxSightRadius)
+{
+	return AddVisionUnitInternal(Location, SightRadius, MaxSightRadius, nullptr);
+}
+
+void AFogOfWar::RemoveVisionUnit(FVisionUnitHandle Handle)
+{
+	const int VisionUnitIndex = GetVisionUnitIndex(Handle);
+	if (!ensure(VisionUnitIndex != INDEX_NONE))
+	{
+		return;
+	}
+	RemoveVisionUnitInternal(VisionUnitIndex);
+}
 
-	RegisteredVisions.Remove(VisionComponent);
+FVisionUnitHandle AFogOfWar::AddTimedVisionUnit(FVector Location, float SightRadius, float Lifetime)
+{
+	const FVisionUnitHandle Handle = AddVisionUnitInternal(Location, SightRadius, 0.0f, nullptr);
+	if (Lifetime > 0.0f)
+	{
+		TimedVisionUnits.HeapPush({ GetWorld()->GetTimeSeconds() + Lifetime, Handle });
+	}
+	return Handle;
+}
 
-#if WITH_EDITORONLY_DATA
-	RegisteredVisionsNum = RegisteredVisions.Num();
-#endif
+TArray<FVisionUnitHandle> AFogOfWar::AddVisionUnits(const TArray<FVector>& Locations, float SightRadius, float MaxSightRadius)
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("AddVisionUnits"), STAT_FogOfWarAddVisionUnits, STATGROUP_FogOfWar);
+
+	ReserveVisionUnits(Locations.Num());
+
+	TArray<FVisionUnitHandle> Handles;
+	Handles.Reserve(Locations.Num());
+	for (const FVector& Location : Locations)
+	{
+		Handles.Add(AddVisionUnitInternal(Location, SightRadius, MaxSightRadius, nullptr));
+	}
+	return Handles;
+}
+
+void AFogOfWar::RemoveVisionUnits(const TArray<FVisionUnitHandle>& Handles)
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("RemoveVisionUnits"), STAT_FogOfWarRemoveVisionUnits, STATGROUP_FogOfWar);
+
+	for (const FVisionUnitHandle Handle : Handles)
+	{
+		const int VisionUnitIndex = GetVisionUnitIndex(Handle);
+		if (!ensure(VisionUnitIndex != INDEX_NONE))
+		{
+			continue;
+		}
+		ReleaseVisionUnit(VisionUnitIndex);
+	}
+
+	CompactVisionUnits();
+}
+
+void AFogOfWar::SetVisionUnitLocation(FVisionUnitHandle Handle, FVector Location)
+{
+	const int VisionUnitIndex = GetVisionUnitIndex(Handle);
+	if (!ensure(VisionUnitIndex != INDEX_NONE))
+	{
+		return;
+	}
+	VisionUnitLocations[VisionUnitIndex] = Location;
+	if (MovementTrace)
+	{
+		MovementTrace->MoveUnit(Handle, Location);
+	}
+
+	const int CachedOriginGlobalIndex = VisionUnitCachedOriginGlobalIndexes[VisionUnitIndex];
+	if (GetTileGlobalIndexWithHysteresis(Location, CachedOriginGlobalIndex) != CachedOriginGlobalIndex)
+	{
+		MarkVisionUnitDirty(VisionUnitIndex);
+	}
+}
+
+void AFogOfWar::SetVisionUnitSightRadius(FVisionUnitHandle Handle, float SightRadius, float MaxSightRadius)
+{
+	const int VisionUnitIndex = GetVisionUnitIndex(Handle);
+	if (!ensure(VisionUnitIndex != INDEX_NONE))
+	{
+		return;
+	}
+
+	if (MovementTrace)
+	{
+		MovementTrace->SetUnitSightRadius(Handle, SightRadius, MaxSightRadius);
+	}
+
+	ReleaseVisionResult(VisionUnitIndex);
+	ForgetRecentVisionResults(VisionUnits[VisionUnitIndex]);
+	InitializeVisionUnitSightRadius(VisionUnits[VisionUnitIndex], SightRadius, MaxSightRadius);
+	// not waiting for the next update not to leave the area unrevealed for a while
+	UpdateVisibilities(VisionUnitIndex);
+}
 
-	UE_LOG(LogFogOfWar, Log, TEXT("Unregistered %s from FogOfWar"), *VisionComponent->GetOwner()->GetName());
+bool AFogOfWar::IsVisionUnitValid(FVisionUnitHandle Handle) const
+{
+	return GetVisionUnitIndex(Handle) != INDEX_NONE;
 }
 
 bool AFogOfWar::IsLocationVisible(FVector WorldLocation)
 {
 	FIntVector2 TileIJ = ConvertWorldLocationToTileIJ(FVector2D(WorldLocation));
-	if (!IsGlobalIJValid(TileIJ))
+	if (!IsGlobalIJValid(TileIJ) || !IsTileResident(TileIJ))
 	{
 		return false;
 	}
@@ -89,11 +279,221 @@ bool AFogOfWar::IsLocationVisible(FVector WorldLocation)
 	return bIsVisible;
 }
 
+int AFogOfWar::GetTileGlobalIndex(const FVector& WorldLocation) const
+{
+	const FIntVector2 TileIJ = ConvertWorldLocationToTileIJ(FVector2D(WorldLocation));
+	return IsGlobalIJValid(TileIJ) ? GetGlobalIndex(TileIJ) : INDEX_NONE;
+}
+
+int AFogOfWar::GetTileGlobalIndexWithHysteresis(const FVector& WorldLocation, int CurrentTileGlobalIndex) const
+{
+	if (VisionUnitTileHysteresis <= 0.0f || CurrentTileGlobalIndex == INDEX_NONE)
+	{
+		return GetTileGlobalIndex(WorldLocation);
+	}
+
+	const FIntVector2 CurrentTileIJ = GetTileIJ(CurrentTileGlobalIndex);
+	bool bIsWithinHysteresis;
+	if (bDeterministicMode)
+	{
+		// whole units like ConvertWorldLocationToTileIJ, the hysteresis is already whole here
+		const int64 IntTileSize = static_cast<int64>(TileSize);
+		const int64 IntHysteresis = static_cast<int64>(VisionUnitTileHysteresis);
+		const int64 OffsetX = FMath::RoundToInt64(WorldLocation.X) - FMath::RoundToInt64(GridBottomLeftWorldLocation.X) - CurrentTileIJ.X * IntTileSize;
+		const int64 OffsetY = FMath::RoundToInt64(WorldLocation.Y) - FMath::RoundToInt64(GridBottomLeftWorldLocation.Y) - CurrentTileIJ.Y * IntTileSize;
+		bIsWithinHysteresis = OffsetX >= -IntHysteresis && OffsetX < IntTileSize + IntHysteresis && OffsetY >= -IntHysteresis && OffsetY < IntTileSize + IntHysteresis;
+	}
+	else
+	{
+		const FVector2f Offset = ConvertWorldSpaceLocationToGridSpace(FVector2D(WorldLocation)) - FVector2f(CurrentTileIJ.X, CurrentTileIJ.Y);
+		const float GridSpaceHysteresis = VisionUnitTileHysteresis / TileSize;
+		bIsWithinHysteresis = Offset.X >= -GridSpaceHysteresis && Offset.X < 1.0f + GridSpaceHysteresis && Offset.Y >= -GridSpaceHysteresis && Offset.Y < 1.0f + GridSpaceHysteresis;
+	}
+
+	return bIsWithinHysteresis ? CurrentTileGlobalIndex : GetTileGlobalIndex(WorldLocation);
+}
+
+int AFogOfWar::GetVisibleTilesNumInBox(FBox2D WorldBox) const
+{
+	return CountVisibleTilesInBox(WorldBox, false);
+}
+
+bool AFogOfWar::IsAnyTileVisibleInBox(FBox2D WorldBox) const
+{
+	return CountVisibleTilesInBox(WorldBox, true) > 0;
+}
+
+bool AFogOfWar::HasLineOfSight(FVector From, FVector To) const
+{
+	const FIntVector2 FromIJ = ConvertWorldLocationToTileIJ(FVector2D(From));
+	const FIntVector2 ToIJ = ConvertWorldLocationToTileIJ(FVector2D(To));
+	if (TileChunks.IsEmpty() || !IsGlobalIJValid(FromIJ) || !IsGlobalIJValid(ToIJ))
+	{
+		return false;
+	}
+
+	return !IsRayBlocked(bDeterministicMode ? FMath::RoundToFloat(From.Z) : From.Z, FromIJ, ToIJ);
+}
+
+void AFogOfWar::HasLineOfSightBatch(TConstArrayView<FFogOfWarLineOfSightQuery> Queries, TArrayView<bool> OutResults) const
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("HasLineOfSightBatch"), STAT_FogOfWarHasLineOfSightBatch, STATGROUP_FogOfWar);
+
+	check(Queries.Num() == OutResults.Num());
+
+	// a single ray is too cheap to be worth a task of its own
+	constexpr int QueriesPerTask = 256;
+	const int TasksNum = FMath::DivideAndRoundUp(Queries.Num(), QueriesPerTask);
+	ParallelFor(TasksNum, [&](int TaskIndex)
+		{
+			const int EndIndex = FMath::Min((TaskIndex + 1) * QueriesPerTask, Queries.Num());
+			for (int QueryIndex = TaskIndex * QueriesPerTask; QueryIndex < EndIndex; QueryIndex++)
+			{
+				OutResults[QueryIndex] = HasLineOfSight(Queries[QueryIndex].From, Queries[QueryIndex].To);
+			}
+		});
+}
+
+void AFogOfWar::StartVisibilityRecording()
+{
+	if (!ensure(bActivated))
+	{
+		return;
+	}
+
+	TArray<uint8> InitialVisionData;
+	InitialVisionData.SetNumUninitialized(GridResolution.X * GridResolution.Y);
+	GatherVisionData(InitialVisionData);
+	VisibilityRecording = MakeShared<FFogOfWarRecording>(GridResolution, RecordingTicksPerKeyframe, InitialVisionData);
+	RecordingFlippedTileGlobalIndexes.Reset();
+}
+
+TSharedPtr<FFogOfWarRecording> AFogOfWar::StopVisibilityRecording()
+{
+	if (VisibilityRecording)
+	{
+		VisibilityRecording->Finalize();
+		UE_LOG(LogFogOfWar, Log, TEXT("Recorded %d ticks of visibility into %lld bytes"), VisibilityRecording->GetTicksNum(), VisibilityRecording->GetCompressedSize());
+	}
+	RecordingFlippedTileGlobalIndexes.Empty();
+	return MoveTemp(VisibilityRecording);
+}
+
+void AFogOfWar::StartMovementTraceRecording()
+{
+	if (!ensure(bActivated))
+	{
+		return;
+	}
+
+	FFogOfWarMovementTrace::FGridSettings GridSettings;
+	GridSettings.BottomLeftWorldLocation = GridBottomLeftWorldLocation;
+	GridSettings.Resolution = GridResolution;
+	GridSettings.TileSize = TileSize;
+	GridSettings.VisionBlockingDeltaHeightThreshold = VisionBlockingDeltaHeightThreshold;
+	GridSettings.VisionSharingHeightBandSize = VisionSharingHeightBandSize;
+	GridSettings.bDeterministicMode = bDeterministicMode;
+	MovementTrace = MakeShared<FFogOfWarMovementTrace>(GridSettings);
+
+	for (int VisionUnitIndex = 0; VisionUnitIndex < VisionUnits.Num(); VisionUnitIndex++)
+	{
+		const FVisionUnitData& VisionUnitData = VisionUnits[VisionUnitIndex];
+		const int SlotIndex = VisionUnitSlotIndexes[VisionUnitIndex];
+		FVisionUnitHandle Handle;
+		Handle.SlotIndex = SlotIndex;
+		Handle.Generation = VisionUnitSlots[SlotIndex].Generation;
+		// the reserved radius only affects the memory, so the exact one isn't kept
+		const float SightRadius = VisionUnitData.GridSpaceRadius * TileSize;
+		MovementTrace->AddUnit(Handle, VisionUnitLocations[VisionUnitIndex], SightRadius, SightRadius);
+	}
+}
+
+TSharedPtr<FFogOfWarMovementTrace> AFogOfWar::StopMovementTraceRecording()
+{
+	if (MovementTrace)
+	{
+		MovementTrace->Finalize();
+		UE_LOG(LogFogOfWar, Log, TEXT("Recorded %d ticks of vision unit movement into %lld bytes"), MovementTrace->GetTicksNum(), MovementTrace->GetCompressedSize());
+	}
+	return MoveTemp(MovementTrace);
+}
+
+void AFogOfWar::StartVisibilityPlayback(TSharedRef<const FFogOfWarRecording> Recording)
+{
+	if (!ensure(bActivated && !bHeadless))
+	{
+		return;
+	}
+	if (!ensureMsgf(Recording->GetGridResolution() == GridResolution, TEXT("The recording was made for another grid")))
+	{
+		return;
+	}
+
+	VisibilityPlayer = MakeUnique<FFogOfWarRecordingPlayer>(Recording);
+	VisibilityPlayer->Seek(INDEX_NONE, TextureDataBuffer);
+	bVisibilityPlaybackPaused = false;
+	bGridVisibilityChanged = true;
+}
+
+void AFogOfWar::SeekVisibilityPlayback(int Tick)
+{
+	if (!ensure(VisibilityPlayer))
+	{
+		return;
+	}
+
+	if (VisibilityPlayer->Seek(Tick, TextureDataBuffer))
+	{
+		bGridVisibilityChanged = true;
+	}
+}
+
+void AFogOfWar::SetVisibilityPlaybackPaused(bool bPaused)
+{
+	bVisibilityPlaybackPaused = bPaused;
+}
+
+int AFogOfWar::GetVisibilityPlaybackTick() const
+{
+	return VisibilityPlayer ? VisibilityPlayer->GetCurrentTick() : INDEX_NONE;
+}
+
+void AFogOfWar::StopVisibilityPlayback()
+{
+	VisibilityPlayer.Reset();
+	// the live grid goes back to the snapshot
+	bGridVisibilityChanged = true;
+}
+
 UTexture* AFogOfWar::GetFinalVisibilityTexture()
 {
+	if (SmoothVisibilityTexture)
+	{
+		return SmoothVisibilityTexture;
+	}
 	return Cast<UTexture>(FinalVisibilityTextureRenderTarget);
 }
 
+float AFogOfWar::GetSmoothVisibility(FVector WorldLocation) const
+{
+	if (SmoothVisibility.IsEmpty())
+	{
+		return 0.0f;
+	}
+
+	// the values are at the tile centers, the texture sampler filters the same way
+	const FVector2f GridLocation = ConvertWorldSpaceLocationToGridSpace(FVector2D(WorldLocation)) - FVector2f(0.5f, 0.5f);
+	const FIntVector2 BottomLeftIJ = ConvertGridLocationToTileIJ(GridLocation);
+	const float AlphaX = FMath::Clamp(GridLocation.X - BottomLeftIJ.X, 0.0f, 1.0f);
+	const float AlphaY = FMath::Clamp(GridLocation.Y - BottomLeftIJ.Y, 0.0f, 1.0f);
+	const int X0 = FMath::Clamp(BottomLeftIJ.X, 0, GridResolution.X - 1);
+	const int X1 = FMath::Clamp(BottomLeftIJ.X + 1, 0, GridResolution.X - 1);
+	const int Y0 = FMath::Clamp(BottomLeftIJ.Y, 0, GridResolution.Y - 1);
+	const int Y1 = FMath::Clamp(BottomLeftIJ.Y + 1, 0, GridResolution.Y - 1);
+	const auto GetValue = [this](int X, int Y) { return SmoothVisibility[X * GridResolution.Y + Y]; };
+	return FMath::BiLerp(GetValue(X0, Y0), GetValue(X1, Y0), GetValue(X0, Y1), GetValue(X1, Y1), AlphaX, AlphaY);
+}
+
 void AFogOfWar::SetCommonMIDParameters(UMaterialInstanceDynamic* MID)
 {
 	MID->SetTextureParameterValue(Names::FOW_FinalVisibilityTexture, GetFinalVisibilityTexture());
@@ -110,37 +510,117 @@ void AFogOfWar::Activate()
 	}
 	bActivated = true;
 
+	InitializeSimulation();
+
+	if (!bHeadless)
+	{
+		InitializeRenderPipeline();
+	}
+	else
+	{
+		UE_LOG(LogFogOfWar, Log, TEXT("FogOfWar is running in the headless mode, the render pipeline is disabled"));
+	}
+
+	auto GameManager = UManagerStatics::GetGameManager(this);
+	GameManager->Register<ThisClass>(this);
+	PrimaryActorTick.SetTickFunctionEnable(true);
+}
+
+void AFogOfWar::InitializeSimulation()
+{
 	checkf(IsValid(GridVolume), TEXT("Volume was not set for the FogOfWar Volume"));
 	check(TileSize > 0);
 
+	if (bDeterministicMode)
+	{
+		// everything the visibility depends on is made integer, so no float rounding differences can creep in
+		TileSize = FMath::Max(FMath::RoundToFloat(TileSize), 1.0f);
+		VisionBlockingDeltaHeightThreshold = FMath::RoundToFloat(VisionBlockingDeltaHeightThreshold);
+		VisionSharingHeightBandSize = FMath::RoundToFloat(VisionSharingHeightBandSize);
+		VisionUnitTileHysteresis = FMath::RoundToFloat(VisionUnitTileHysteresis);
+	}
+
 	Initialize();
 
 	checkf(GridResolution.X + GridResolution.Y <= 10000, TEXT("Grid resolution is too big (possible int32 overflow when calculating square distance)"));
 
-	const int GridTilesNum = GridResolution.X * GridResolution.Y;
-	Tiles.SetNum(GridTilesNum);
-	TextureDataBuffer.SetNum(GridTilesNum);
+	// dedicated servers and -nullrhi can't render anything, so there's no point in running the render pipeline there
+	bHeadless = bForceHeadless || !FApp::CanEverRender();
 
-	for (int I = 0; I < GridResolution.X; I++)
+	TileChunks.SetNum(ChunkResolution.X * ChunkResolution.Y);
+	VisibleTilesBits.SetNumZeroed(BitUtils::GetWordsNum(GridResolution.X * GridResolution.Y));
+	Heightmap = FFogOfWarHeightmap::FindOrCreate(
+		{ GridVolume, TileSize, HeightScanCollisionChannel, bDeterministicMode },
+		TileChunks.Num(),
+		1 << (TileChunkSizeLog2 * 2));
+	Heightmap->OnTilesRetraced.AddUObject(this, &AFogOfWar::OnHeightmapTilesRetraced);
+	InitializeVisibilityPyramid();
+
+	if (bCalculateSmoothVisibilityOnCPU)
+	{
+		const int TilesNum = GridResolution.X * GridResolution.Y;
+		SmoothVisibilitySnapshot.SetNumZeroed(TilesNum);
+		SmoothVisibilityAccumulated.SetNumZeroed(TilesNum);
+		SmoothVisibilityRowsFiltered.SetNumZeroed(TilesNum);
+		SmoothVisibility.SetNumZeroed(TilesNum);
+	}
+
+	if (bStreamingAwareGrid)
+	{
+		FWorldDelegates::LevelAddedToWorld.AddUObject(this, &AFogOfWar::OnLevelAddedToWorld);
+		FWorldDelegates::LevelRemovedFromWorld.AddUObject(this, &AFogOfWar::OnLevelRemovedFromWorld);
+
+		for (ULevel* Level : GetWorld()->GetLevels())
+		{
+			// the chunks already resident in the shared heightmap were traced with these levels in place
+			if (Level->bIsVisible)
+			{
+				AddResidentLevel(Level, false);
+			}
+		}
+	}
+	else
 	{
-		for (int J = 0; J < GridResolution.Y; J++)
+		for (int ChunkIndex = 0; ChunkIndex < TileChunks.Num(); ChunkIndex++)
 		{
-			FTile& Tile = GetGlobalTile({ I, J });
-			CalculateTileHeight(Tile, { I,J });
+			TileChunks[ChunkIndex].ResidencyCounter++;
+			LoadTileChunk(ChunkIndex);
 		}
 	}
 
+	// the readers always get a snapshot after the activation, even if nothing is visible yet
+	PublishVisibilitySnapshot();
+}
+
+void AFogOfWar::InitializeRenderPipeline()
+{
+	TextureDataBuffer.SetNum(GridResolution.X * GridResolution.Y);
+
 #if WITH_EDITORONLY_DATA
-	HeightmapTexture = CreateSnapshotTexture();
+	HeightmapTexture = CreateSnapshotTexture(GridResolution);
 	HeightmapTexture->Filter = TF_Nearest;
 	WriteHeightmapDataToTexture(HeightmapTexture);
 #endif
 
-	SnapshotTexture = CreateSnapshotTexture();
+	SnapshotTexture = CreateSnapshotTexture(GridResolution);
+
+	if (bCreateMinimapTexture && !VisibilityPyramid.IsEmpty())
+	{
+		MinimapPyramidLevel = FMath::Clamp(MinimapPyramidLevel, 1, VisibilityPyramid.Num());
+		const FIntVector2 MinimapResolution = VisibilityPyramid[MinimapPyramidLevel - 1].Resolution;
+		MinimapTexture = CreateSnapshotTexture(MinimapResolution);
+		MinimapDataBuffer.SetNum(MinimapResolution.X * MinimapResolution.Y);
+	}
 	VisibilityTextureRenderTarget = CreateRenderTarget();
 	PreFinalVisibilityTextureRenderTarget = CreateRenderTarget();
 	FinalVisibilityTextureRenderTarget = CreateRenderTarget();
 
+	if (bCalculateSmoothVisibilityOnCPU && bUploadSmoothVisibility)
+	{
+		SmoothVisibilityTexture = CreateSnapshotTexture(GridResolution);
+		SmoothVisibilityUploadBuffer.SetNum(GridResolution.X * GridResolution.Y);
+	}
+
 	InterpolationMID = UMaterialInstanceDynamic::Create(InterpolationMaterial, this);
 	InterpolationMID->SetTextureParameterValue(Names::FOW_AccumulatedMask, VisibilityTextureRenderTarget);
 	InterpolationMID->SetTextureParameterValue(Names::FOW_NewSnapshot, SnapshotTexture);
@@ -158,10 +638,6 @@ void AFogOfWar::Activate()
 	PostProcessingMID->SetScalarParameterValue(Names::FOW_NotVisibleRegionBrightness, NotVisibleRegionBrightness);
 
 	PostProcess->AddOrUpdateBlendable(PostProcessingMID);
-
-	auto GameManager = UManagerStatics::GetGameManager(this);
-	GameManager->Register<ThisClass>(this);
-	PrimaryActorTick.SetTickFunctionEnable(true);
 }
 
 void AFogOfWar::BeginPlay()
@@ -174,6 +650,35 @@ void AFogOfWar::BeginPlay()
 	}
 }
 
+void AFogOfWar::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	FWorldDelegates::LevelAddedToWorld.RemoveAll(this);
+	FWorldDelegates::LevelRemovedFromWorld.RemoveAll(this);
+
+	Super::EndPlay(EndPlayReason);
+}
+
+void AFogOfWar::BeginDestroy()
+{
+	// the vision units may still be removed during EndPlay of the other actors, so the tiles are kept until now
+	// the shared heightmap outlives this instance if somebody else still uses it
+	if (Heightmap)
+	{
+		Heightmap->OnTilesRetraced.RemoveAll(this);
+		for (int ChunkIndex = 0; ChunkIndex < TileChunks.Num(); ChunkIndex++)
+		{
+			if (TileChunks[ChunkIndex].IsResident())
+			{
+				Heightmap->ReleaseChunk(ChunkIndex);
+			}
+		}
+		Heightmap.Reset();
+	}
+	TileChunks.Empty();
+
+	Super::BeginDestroy();
+}
+
 #if WITH_EDITOR
 void AFogOfWar::RefreshVolumeInEditor()
 {
@@ -194,6 +699,7 @@ bool AFogOfWar::CanEditChange(const FProperty* InProperty) const
 
 	if (PropertyName == GET_MEMBER_NAME_CHECKED(AFogOfWar, TileSize) ||
 		PropertyName == GET_MEMBER_NAME_CHECKED(AFogOfWar, GridVolume) ||
+		PropertyName == GET_MEMBER_NAME_CHECKED(AFogOfWar, bForceHeadless) ||
 		PropertyName == GET_MEMBER_NAME_CHECKED(AFogOfWar, InterpolationMaterial) ||
 		PropertyName == GET_MEMBER_NAME_CHECKED(AFogOfWar, AfterInterpolationMaterial) ||
 		PropertyName == GET_MEMBER_NAME_CHECKED(AFogOfWar, SuperSamplingMaterial) ||
@@ -218,6 +724,8 @@ void AFogOfWar::PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEve
 			if (IsValid(AfterInterpolationMID))
 			{
 				AfterInterpolationMID->SetScalarParameterValue(Names::FOW_MinimalVisibility, MinimalVisibility);
+				// the cutoff pass has to be redone even if the fog has converged
+				SnapshotRemainingDifference = 1.0f;
 			}
 			return;
 		}
@@ -234,15 +742,27 @@ void AFogOfWar::PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEve
 		if (PropertyName == GET_MEMBER_NAME_CHECKED(AFogOfWar, ApproximateSecondsToAbsorbNewSnapshot))
 		{
 			bFirstTick = true;
+			SnapshotRemainingDifference = 1.0f;
 			return;
 		}
 
 		if (PropertyName == GET_MEMBER_NAME_CHECKED(AFogOfWar, VisionBlockingDeltaHeightThreshold))
 		{
-			for (auto& [key, value] : RegisteredVisions)
+			// only the dirty vision units are updated, so every one of them has to be marked, including the stationary ones
+			for (int VisionUnitIndex = 0; VisionUnitIndex < VisionUnits.Num(); VisionUnitIndex++)
 			{
-				ResetCachedVisibilities(value);
+				ReleaseVisionResult(VisionUnitIndex);
+				ForgetRecentVisionResults(VisionUnits[VisionUnitIndex]);
+				MarkVisionUnitDirty(VisionUnitIndex);
+
+				if (UVisionComponent* VisionComponent = VisionUnitComponents[VisionUnitIndex])
+				{
+					VisionComponent->CachedTileGlobalIndex = INDEX_NONE;
+				}
 			}
+
+			// the threshold is not a part of the result key, so no result calculated with the old one may survive
+			ensure(VisionResults.IsEmpty());
 			return;
 		}
 	}
@@ -265,51 +785,360 @@ void AFogOfWar::Tick(float DeltaSeconds)
 
 	Super::Tick(DeltaSeconds);
 
-	for (auto& [VisionComponent, VisionUnitData] : RegisteredVisions)
+	ApplyPendingVisionComponents();
+	ExpireTimedVisionUnits();
+
+	// visibility only depends on the current locations, so there's no need to catch up with several simulation steps at once
+	bool bSimulationStep = true;
+	if (SimulationRate > 0.0f)
+	{
+		const float SimulationStepSeconds = 1.0f / SimulationRate;
+		SimulationTimeAccumulator += DeltaSeconds;
+		bSimulationStep = bFirstTick || SimulationTimeAccumulator >= SimulationStepSeconds;
+		if (bSimulationStep)
+		{
+			SimulationTimeAccumulator = FMath::Fmod(SimulationTimeAccumulator, SimulationStepSeconds);
+		}
+	}
+
+	if (bSimulationStep)
+	{
+		if (VisibilityPlayer)
+		{
+			// the dirty vision units stay in the list until the playback is stopped
+			if (!bVisibilityPlaybackPaused && VisibilityPlayer->StepForward(TextureDataBuffer))
+			{
+				bGridVisibilityChanged = true;
+			}
+		}
+		else
+		{
+			UpdateVisionUnits();
+		}
+
+		if (VisibilityRecording)
+		{
+			VisibilityRecording->AddTick(RecordingFlippedTileGlobalIndexes);
+			RecordingFlippedTileGlobalIndexes.Reset();
+		}
+
+		if (bVisibilitySnapshotDirty)
+		{
+			PublishVisibilitySnapshot();
+		}
+
+		if (MovementTrace)
+		{
+			MovementTrace->EndTick();
+		}
+	}
+
+	if (bCalculateSmoothVisibilityOnCPU)
+	{
+		UpdateSmoothVisibility(DeltaSeconds, bSimulationStep);
+	}
+
+	if (!bHeadless)
+	{
+		UpdateRenderPipeline(DeltaSeconds, bSimulationStep);
+	}
+
+	bFirstTick = false;
+}
+
+TSharedPtr<const FFogOfWarVisibilitySnapshot, ESPMode::ThreadSafe> AFogOfWar::AcquireVisibilitySnapshot() const
+{
+	FReadScopeLock Lock(VisibilitySnapshotLock);
+	return PublishedVisibilitySnapshot;
+}
+
+void AFogOfWar::PublishVisibilitySnapshot()
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("PublishVisibilitySnapshot"), STAT_FogOfWarPublishVisibilitySnapshot, STATGROUP_FogOfWar);
+
+	// nobody can get a new reference to the retired snapshot, so once it's unique it's safe to overwrite
+	TSharedPtr<FFogOfWarVisibilitySnapshot, ESPMode::ThreadSafe> Snapshot;
+	if (RetiredVisibilitySnapshot.IsValid() && RetiredVisibilitySnapshot.IsUnique())
+	{
+		Snapshot = MoveTemp(RetiredVisibilitySnapshot);
+	}
+	else
+	{
+		Snapshot = MakeShared<FFogOfWarVisibilitySnapshot, ESPMode::ThreadSafe>();
+	}
+	RetiredVisibilitySnapshot.Reset();
+
+	Snapshot->Version = PublishedVisibilitySnapshot.IsValid() ? PublishedVisibilitySnapshot->Version + 1 : 0;
+	Snapshot->GridResolution = GridResolution;
+	Snapshot->GridBottomLeftWorldLocation = GridBottomLeftWorldLocation;
+	Snapshot->TileSize = TileSize;
+	Snapshot->bDeterministicMode = bDeterministicMode;
+	Snapshot->VisibleTilesBits = VisibleTilesBits;
+
+	{
+		FWriteScopeLock Lock(VisibilitySnapshotLock);
+		Swap(PublishedVisibilitySnapshot, Snapshot);
+	}
+	RetiredVisibilitySnapshot = MoveTemp(Snapshot);
+	bVisibilitySnapshotDirty = false;
+}
+
+void AFogOfWar::ApplyPendingVisionComponents()
+{
+	if (PendingVisionComponents.IsEmpty() && PendingUnregisteredVisionUnitHandles.IsEmpty())
+	{
+		return;
+	}
+
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("ApplyPendingVisionComponents"), STAT_FogOfWarApplyPendingVisionComponents, STATGROUP_FogOfWar);
+
+	// the removals go first, so the additions reuse the freed slots
+	if (!PendingUnregisteredVisionUnitHandles.IsEmpty())
+	{
+		UE_LOG(LogFogOfWar, Log, TEXT("Unregistered %d vision components from FogOfWar"), PendingUnregisteredVisionUnitHandles.Num());
+
+		RemoveVisionUnits(PendingUnregisteredVisionUnitHandles);
+		PendingUnregisteredVisionUnitHandles.Reset();
+	}
+
+	if (!PendingVisionComponents.IsEmpty())
 	{
-		FVector3d OwnerActorLocation = VisionComponent->GetOwner()->GetActorLocation();
-		FIntVector2 GridIJ = ConvertWorldLocationToTileIJ(FVector2D(OwnerActorLocation));
-		int GridIndex = GetGlobalIndex(GridIJ);
+		UE_LOG(LogFogOfWar, Log, TEXT("Registered %d vision components with FogOfWar"), PendingVisionComponents.Num());
+
+		ReserveVisionUnits(PendingVisionComponents.Num());
+		for (UVisionComponent* VisionComponent : PendingVisionComponents)
+		{
+			const FVector Location = VisionComponent->GetOwner()->GetActorLocation();
+			VisionComponent->VisionUnitHandle = AddVisionUnitInternal(Location, VisionComponent->GetSightRadius(), VisionComponent->GetMaxSightRadius(), VisionComponent);
+			VisionComponent->CachedTileGlobalIndex = GetTileGlobalIndex(Location);
+		}
+		PendingVisionComponents.Reset();
+	}
+}
+
+void AFogOfWar::ReserveVisionUnits(int AddedNum)
+{
+	const int NewNum = VisionUnits.Num() + AddedNum;
+	VisionUnits.Reserve(NewNum);
+	VisionUnitLocations.Reserve(NewNum);
+	VisionUnitCachedOriginGlobalIndexes.Reserve(NewNum);
+	VisionUnitComponents.Reserve(NewNum);
+	VisionUnitSlotIndexes.Reserve(NewNum);
+	VisionUnitDirtyFlags.Reserve(NewNum);
+	DirtyVisionUnitSlotIndexes.Reserve(DirtyVisionUnitSlotIndexes.Num() + AddedNum);
+}
+
+void AFogOfWar::ExpireTimedVisionUnits()
+{
+	const double CurrentTime = GetWorld()->GetTimeSeconds();
+	if (TimedVisionUnits.IsEmpty() || TimedVisionUnits.HeapTop().ExpirationTime > CurrentTime)
+	{
+		return;
+	}
+
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("ExpireTimedVisionUnits"), STAT_FogOfWarExpireTimedVisionUnits, STATGROUP_FogOfWar);
+
+	while (!TimedVisionUnits.IsEmpty() && TimedVisionUnits.HeapTop().ExpirationTime <= CurrentTime)
+	{
+		FTimedVisionUnit TimedVisionUnit;
+		TimedVisionUnits.HeapPop(TimedVisionUnit, false);
+		if (IsVisionUnitValid(TimedVisionUnit.Handle))
+		{
+			ExpiredVisionUnitHandles.Add(TimedVisionUnit.Handle);
+		}
+	}
+
+	// a flare volley expires together, so it's a single compaction
+	RemoveVisionUnits(ExpiredVisionUnitHandles);
+	ExpiredVisionUnitHandles.Reset();
+}
+
+void AFogOfWar::UpdateVisionUnits()
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("UpdateVisionUnits"), STAT_FogOfWarUpdateVisionUnits, STATGROUP_FogOfWar);
 
 #if WITH_EDITORONLY_DATA
-		if (!bDebugStressTestIgnoreCache)
+	if (bDebugStressTestIgnoreCache)
+	{
+		for (int VisionUnitIndex = 0; VisionUnitIndex < VisionUnits.Num(); VisionUnitIndex++)
+		{
+			MarkVisionUnitDirty(VisionUnitIndex);
+		}
+	}
 #endif
-			if (VisionUnitData.HasCachedData() && VisionUnitData.CachedOriginGlobalIndex == GridIndex)
+
+	int WarmUpsBudget = MaxVisionUnitWarmUpsPerTick > 0 ? MaxVisionUnitWarmUpsPerTick : MAX_int32;
+
+	// the static vision units are never visited here
+	for (const int SlotIndex : DirtyVisionUnitSlotIndexes)
+	{
+		// the vision unit could have been removed or already updated after it was pushed
+		const int VisionUnitIndex = VisionUnitSlots[SlotIndex].VisionUnitIndex;
+		if (VisionUnitIndex == INDEX_NONE || !VisionUnitDirtyFlags[VisionUnitIndex])
+		{
+			continue;
+		}
+
+		// nothing to share the vision with is likely for a new vision unit, so it's the full raycasting
+		if (!VisionUnits[VisionUnitIndex].HasCachedData())
+		{
+			if (WarmUpsBudget == 0)
 			{
-				// the actor didn't change the tile. skipping...
+				DeferredDirtyVisionUnitSlotIndexes.Add(SlotIndex);
 				continue;
 			}
+			WarmUpsBudget--;
+		}
 
-		UpdateVisibilities(OwnerActorLocation, VisionUnitData);
+		UpdateVisibilities(VisionUnitIndex);
 	}
+	// the deferred ones go first next time
+	Swap(DirtyVisionUnitSlotIndexes, DeferredDirtyVisionUnitSlotIndexes);
+	DeferredDirtyVisionUnitSlotIndexes.Reset();
+}
 
+void AFogOfWar::UpdateRenderPipeline(float DeltaSeconds, bool bUpdateSnapshot)
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Pipeline"), STAT_FogOfWarPipeline, STATGROUP_FogOfWar);
+	if (bUpdateSnapshot && (bGridVisibilityChanged || bFirstTick))
 	{
-		DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Pipeline"), STAT_FogOfWarPipeline, STATGROUP_FogOfWar);
+		// step 1: creating a snapshot texture from the newest vision data
+		DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Pipeline: step 1"), STAT_FogOfWarPipelineStep1, STATGROUP_FogOfWar);
+		WriteVisionDataToTexture(SnapshotTexture);
+		if (MinimapTexture && !VisibilityPlayer)
 		{
-			// step 1: creating a snapshot texture from the newest vision data
-			DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Pipeline: step 1"), STAT_FogOfWarPipelineStep1, STATGROUP_FogOfWar);
-			WriteVisionDataToTexture(SnapshotTexture);
-		}
-		{
-			// step 2: interpolating the snapshot with the previous visibility texture (to avoid flickering)
-			DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Pipeline: step 2"), STAT_FogOfWarPipelineStep2, STATGROUP_FogOfWar);
-			const float NewSnapshotAbsorption = bFirstTick ? 1.0f : FMath::Min(DeltaSeconds / ApproximateSecondsToAbsorbNewSnapshot, 1.0f);
-			InterpolationMID->SetScalarParameterValue(Names::FOW_NewSnapshotAbsorption, NewSnapshotAbsorption);
-			UKismetRenderingLibrary::DrawMaterialToRenderTarget(this, VisibilityTextureRenderTarget, InterpolationMID);
+			WriteMinimapDataToTexture(MinimapTexture);
 		}
+
+		bGridVisibilityChanged = false;
+		SnapshotRemainingDifference = 1.0f;
+	}
+
+	// the render targets are 8-bit, so when the accumulated mask is this close to the snapshot, the passes below won't change anything
+	constexpr float ConvergedSnapshotRemainingDifference = 0.5f / 0xFF;
+	if (SnapshotRemainingDifference < ConvergedSnapshotRemainingDifference)
+	{
+		return;
+	}
+
+	// the CPU pipeline already uploaded the final texture
+	if (SmoothVisibilityTexture)
+	{
+		return;
+	}
+
+	{
+		// step 2: interpolating the snapshot with the previous visibility texture (to avoid flickering)
+		DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Pipeline: step 2"), STAT_FogOfWarPipelineStep2, STATGROUP_FogOfWar);
+		const float NewSnapshotAbsorption = bFirstTick ? 1.0f : FMath::Min(DeltaSeconds / ApproximateSecondsToAbsorbNewSnapshot, 1.0f);
+		InterpolationMID->SetScalarParameterValue(Names::FOW_NewSnapshotAbsorption, NewSnapshotAbsorption);
+		UKismetRenderingLibrary::DrawMaterialToRenderTarget(this, VisibilityTextureRenderTarget, InterpolationMID);
+		SnapshotRemainingDifference *= 1.0f - NewSnapshotAbsorption;
+	}
+	{
+		// step 3: cutting off the minimal visibility
+		DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Pipeline: step 3"), STAT_FogOfWarPipelineStep3, STATGROUP_FogOfWar);
+		UKismetRenderingLibrary::DrawMaterialToRenderTarget(this, PreFinalVisibilityTextureRenderTarget, AfterInterpolationMID);
+	}
+	{
+		// step 4: super sampling
+		DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Pipeline: step 4"), STAT_FogOfWarPipelineStep4, STATGROUP_FogOfWar);
+		UKismetRenderingLibrary::DrawMaterialToRenderTarget(this, FinalVisibilityTextureRenderTarget, SuperSamplingMID);
+	}
+}
+
+void AFogOfWar::UpdateSmoothVisibility(float DeltaSeconds, bool bUpdateSnapshot)
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("SmoothVisibility"), STAT_FogOfWarSmoothVisibility, STATGROUP_FogOfWar);
+
+	if (bUpdateSnapshot)
+	{
+		// step 1: expanding the newest vision data to floats
+		if (VisibilityPlayer)
 		{
-			// step 3: cutting off the minimal visibility
-			DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Pipeline: step 3"), STAT_FogOfWarPipelineStep3, STATGROUP_FogOfWar);
-			UKismetRenderingLibrary::DrawMaterialToRenderTarget(this, PreFinalVisibilityTextureRenderTarget, AfterInterpolationMID);
+			if (bGridVisibilityChanged || bFirstTick)
+			{
+				for (int GlobalIndex = 0; GlobalIndex < SmoothVisibilitySnapshot.Num(); GlobalIndex++)
+				{
+					SmoothVisibilitySnapshot[GlobalIndex] = TextureDataBuffer[GlobalIndex] / 255.0f;
+				}
+				// the live snapshot is expanded again after the playback
+				SmoothVisibilitySnapshotVersion = INDEX_NONE;
+				SmoothVisibilityRemainingDifference = 1.0f;
+			}
 		}
+		else if (PublishedVisibilitySnapshot && PublishedVisibilitySnapshot->GetVersion() != SmoothVisibilitySnapshotVersion)
 		{
-			// step 4: super sampling
-			DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Pipeline: step 4"), STAT_FogOfWarPipelineStep4, STATGROUP_FogOfWar);
-			UKismetRenderingLibrary::DrawMaterialToRenderTarget(this, FinalVisibilityTextureRenderTarget, SuperSamplingMID);
+			const TArray<uint64>& Bits = PublishedVisibilitySnapshot->VisibleTilesBits;
+			const int TilesNum = SmoothVisibilitySnapshot.Num();
+			ParallelFor(Bits.Num(), [&](int WordIndex)
+				{
+					const uint64 Word = Bits[WordIndex];
+					const int EndGlobalIndex = FMath::Min((WordIndex + 1) * BitUtils::WordBitsNum, TilesNum);
+					for (int GlobalIndex = WordIndex * BitUtils::WordBitsNum; GlobalIndex < EndGlobalIndex; GlobalIndex++)
+					{
+						SmoothVisibilitySnapshot[GlobalIndex] = (Word >> (GlobalIndex % BitUtils::WordBitsNum)) & 1 ? 1.0f : 0.0f;
+					}
+				});
+			SmoothVisibilitySnapshotVersion = PublishedVisibilitySnapshot->GetVersion();
+			SmoothVisibilityRemainingDifference = 1.0f;
 		}
 	}
 
-	bFirstTick = false;
+	// same as the render targets, nothing would change in 8 bits
+	constexpr float ConvergedRemainingDifference = 0.5f / 0xFF;
+	if (SmoothVisibilityRemainingDifference < ConvergedRemainingDifference)
+	{
+		return;
+	}
+
+	const float NewSnapshotAbsorption = bFirstTick ? 1.0f : FMath::Min(DeltaSeconds / ApproximateSecondsToAbsorbNewSnapshot, 1.0f);
+	SmoothVisibilityRemainingDifference *= 1.0f - NewSnapshotAbsorption;
+
+	// the rows are the tiles with the same X, contiguous in the global index order
+	const int RowLength = GridResolution.Y;
+	{
+		// steps 2 and 3, then the horizontal half of step 4. SmoothVisibility holds the cut off values until the vertical half overwrites it
+		DECLARE_SCOPE_CYCLE_COUNTER(TEXT("SmoothVisibility: rows"), STAT_FogOfWarSmoothVisibilityRows, STATGROUP_FogOfWar);
+		ParallelFor(GridResolution.X, [&](int X)
+			{
+				const int RowStart = X * RowLength;
+				InterpolateAndCutOffRow(&SmoothVisibilityAccumulated[RowStart], &SmoothVisibilitySnapshot[RowStart], &SmoothVisibility[RowStart],
+					RowLength, NewSnapshotAbsorption, MinimalVisibility);
+				FilterRow(&SmoothVisibility[RowStart], &SmoothVisibilityRowsFiltered[RowStart], RowLength);
+			});
+	}
+	{
+		// the vertical half of step 4
+		DECLARE_SCOPE_CYCLE_COUNTER(TEXT("SmoothVisibility: columns"), STAT_FogOfWarSmoothVisibilityColumns, STATGROUP_FogOfWar);
+		ParallelFor(GridResolution.X, [&](int X)
+			{
+				const float* RowsFiltered = SmoothVisibilityRowsFiltered.GetData();
+				FilterRows(
+					RowsFiltered + FMath::Max(X - 1, 0) * RowLength,
+					RowsFiltered + X * RowLength,
+					RowsFiltered + FMath::Min(X + 1, GridResolution.X - 1) * RowLength,
+					&SmoothVisibility[X * RowLength],
+					RowLength);
+
+				if (!SmoothVisibilityUploadBuffer.IsEmpty())
+				{
+					for (int GlobalIndex = X * RowLength; GlobalIndex < (X + 1) * RowLength; GlobalIndex++)
+					{
+						SmoothVisibilityUploadBuffer[GlobalIndex] = FMath::RoundToInt(SmoothVisibility[GlobalIndex] * 0xFF);
+					}
+				}
+			});
+	}
+
+	if (SmoothVisibilityTexture)
+	{
+		DECLARE_SCOPE_CYCLE_COUNTER(TEXT("SmoothVisibility: upload"), STAT_FogOfWarSmoothVisibilityUpload, STATGROUP_FogOfWar);
+		void* TextureData = SmoothVisibilityTexture->GetPlatformData()->Mips[0].BulkData.Lock(LOCK_READ_WRITE);
+		FMemory::Memcpy(TextureData, SmoothVisibilityUploadBuffer.GetData(), sizeof(SmoothVisibilityUploadBuffer[0]) * SmoothVisibilityUploadBuffer.Num());
+		SmoothVisibilityTexture->GetPlatformData()->Mips[0].BulkData.Unlock();
+		SmoothVisibilityTexture->UpdateResource();
+	}
 }
 
 void AFogOfWar::Initialize()
@@ -319,6 +1148,7 @@ void AFogOfWar::Initialize()
 		GridSize = FVector2D::Zero();
 		GridBottomLeftWorldLocation = FVector2D::Zero();
 		GridResolution = {};
+		ChunkResolution = {};
 
 		return;
 	}
@@ -326,50 +1156,660 @@ void AFogOfWar::Initialize()
 	UBrushComponent* VolumeBrush = GridVolume->GetBrushComponent();
 	FBoxSphereBounds Bounds = VolumeBrush->CalcBounds(VolumeBrush->GetComponentTransform());
 
-	GridSize = {
-		Bounds.BoxExtent.X * 2,
-		Bounds.BoxExtent.Y * 2
-	};
-	GridBottomLeftWorldLocation = {
-		Bounds.Origin.X - GridSize.X / 2,
-		Bounds.Origin.Y - GridSize.Y / 2
-	};
+	InitializeGrid(
+		{ Bounds.Origin.X - Bounds.BoxExtent.X, Bounds.Origin.Y - Bounds.BoxExtent.Y },
+		{ Bounds.BoxExtent.X * 2, Bounds.BoxExtent.Y * 2 });
+}
+
+void AFogOfWar::InitializeGrid(const FVector2D& BottomLeftWorldLocation, const FVector2D& Size)
+{
+	GridSize = Size;
+	GridBottomLeftWorldLocation = BottomLeftWorldLocation;
 	GridResolution = {
 		FMath::CeilToInt32(GridSize.X / TileSize),
 		FMath::CeilToInt32(GridSize.Y / TileSize)
 	};
+	ChunkResolution = {
+		(GridResolution.X + (1 << TileChunkSizeLog2) - 1) >> TileChunkSizeLog2,
+		(GridResolution.Y + (1 << TileChunkSizeLog2) - 1) >> TileChunkSizeLog2
+	};
+}
+
+void AFogOfWar::AddResidentArea(const FBox& WorldBounds)
+{
+	UpdateAreaResidency(WorldBounds, 1);
+}
+
+void AFogOfWar::RemoveResidentArea(const FBox& WorldBounds)
+{
+	UpdateAreaResidency(WorldBounds, -1);
+}
+
+void AFogOfWar::OnLevelAddedToWorld(ULevel* Level, UWorld* World)
+{
+	if (World != GetWorld() || !Level)
+	{
+		return;
+	}
+
+	AddResidentLevel(Level, true);
+}
+
+void AFogOfWar::AddResidentLevel(ULevel* Level, bool bRetraceResidentChunks)
+{
+	if (ResidentLevelBounds.Contains(Level))
+	{
+		return;
+	}
+
+	const FBox LevelBounds = ALevelBounds::CalculateLevelBounds(Level);
+	if (!LevelBounds.IsValid)
+	{
+		return;
+	}
+
+	// the chunks that are already resident were traced without the level, the ones loaded below are traced with it
+	if (bRetraceResidentChunks)
+	{
+		RetraceLevelArea(Level, LevelBounds, true);
+	}
+
+	ResidentLevelBounds.Add(Level, LevelBounds);
+	AddResidentArea(LevelBounds);
+}
+
+void AFogOfWar::OnLevelRemovedFromWorld(ULevel* Level, UWorld* World)
+{
+	// the level is null when the whole world is being torn down
+	if (World != GetWorld() || !Level)
+	{
+		return;
+	}
+
+	FBox LevelBounds;
+	if (ResidentLevelBounds.RemoveAndCopyValue(Level, LevelBounds))
+	{
+		// the chunks that are still resident (because of the neighbouring levels or the other instances) were traced with the level
+		RemoveResidentArea(LevelBounds);
+		RetraceLevelArea(Level, LevelBounds, false);
+	}
+}
+
+void AFogOfWar::RetraceLevelArea(const ULevel* Level, const FBox& LevelBounds, bool bLevelAdded)
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("RetraceLevelArea"), STAT_FogOfWarRetraceLevelArea, STATGROUP_FogOfWar);
+
+	// the other instances sharing the heightmap get the same event, somebody already did the work
+	if (TileChunks.IsEmpty() || !Heightmap->ClaimLevelStreamingEvent(Level, bLevelAdded))
+	{
+		return;
+	}
+
+	const FIntVector2 MinIJ = ConvertWorldLocationToTileIJ(FVector2D(LevelBounds.Min));
+	const FIntVector2 MaxIJ = ConvertWorldLocationToTileIJ(FVector2D(LevelBounds.Max));
+	const FIntVector2 ClampedMinIJ = { FMath::Max(MinIJ.X, 0), FMath::Max(MinIJ.Y, 0) };
+	const FIntVector2 ClampedMaxIJ = { FMath::Min(MaxIJ.X, GridResolution.X - 1), FMath::Min(MaxIJ.Y, GridResolution.Y - 1) };
+	if (ClampedMinIJ.X > ClampedMaxIJ.X || ClampedMinIJ.Y > ClampedMaxIJ.Y)
+	{
+		return;
+	}
+
+	bool bRetracedAnything = false;
+	for (int ChunkI = ClampedMinIJ.X >> TileChunkSizeLog2; ChunkI <= ClampedMaxIJ.X >> TileChunkSizeLog2; ChunkI++)
+	{
+		for (int ChunkJ = ClampedMinIJ.Y >> TileChunkSizeLog2; ChunkJ <= ClampedMaxIJ.Y >> TileChunkSizeLog2; ChunkJ++)
+		{
+			// not necessarily resident in this instance
+			const int ChunkIndex = ChunkI * ChunkResolution.Y + ChunkJ;
+			if (!Heightmap->IsChunkReferenced(ChunkIndex))
+			{
+				continue;
+			}
+
+			Heightmap->RetraceChunk(ChunkIndex, [&](TArrayView<float> Heights)
+				{
+					ForEachTileInChunk(ChunkIndex, [&](FIntVector2 TileIJ)
+						{
+							if (TileIJ.X >= ClampedMinIJ.X && TileIJ.X <= ClampedMaxIJ.X && TileIJ.Y >= ClampedMinIJ.Y && TileIJ.Y <= ClampedMaxIJ.Y)
+							{
+								Heights[GetTileIndexInChunk(TileIJ)] = CalculateTileHeight(TileIJ);
+							}
+						});
+				});
+			bRetracedAnything = true;
+		}
+	}
+
+	if (bRetracedAnything)
+	{
+		Heightmap->OnTilesRetraced.Broadcast(ClampedMinIJ, ClampedMaxIJ);
+	}
+}
+
+void AFogOfWar::OnHeightmapTilesRetraced(FIntVector2 MinIJ, FIntVector2 MaxIJ)
+{
+	// the max heights of the chunks are recalculated together with the occluders
+	UpdateOccludedArea(MinIJ, MaxIJ);
+}
+
+void AFogOfWar::UpdateAreaResidency(const FBox& WorldBounds, int ResidencyCounterDelta)
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("UpdateAreaResidency"), STAT_FogOfWarUpdateAreaResidency, STATGROUP_FogOfWar);
+
+	if (TileChunks.IsEmpty())
+	{
+		return;
+	}
+
+	const FIntVector2 MinIJ = ConvertWorldLocationToTileIJ(FVector2D(WorldBounds.Min));
+	const FIntVector2 MaxIJ = ConvertWorldLocationToTileIJ(FVector2D(WorldBounds.Max));
+	if (MaxIJ.X < 0 || MaxIJ.Y < 0 || MinIJ.X >= GridResolution.X || MinIJ.Y >= GridResolution.Y)
+	{
+		return;
+	}
+
+	const FIntVector2 MinChunkIJ = { FMath::Max(MinIJ.X, 0) >> TileChunkSizeLog2, FMath::Max(MinIJ.Y, 0) >> TileChunkSizeLog2 };
+	const FIntVector2 MaxChunkIJ = { FMath::Min(MaxIJ.X, GridResolution.X - 1) >> TileChunkSizeLog2, FMath::Min(MaxIJ.Y, GridResolution.Y - 1) >> TileChunkSizeLog2 };
+
+	TArray<int, TInlineAllocator<64>> FlippedChunkIndexes;
+	for (int ChunkI = MinChunkIJ.X; ChunkI <= MaxChunkIJ.X; ChunkI++)
+	{
+		for (int ChunkJ = MinChunkIJ.Y; ChunkJ <= MaxChunkIJ.Y; ChunkJ++)
+		{
+			const int ChunkIndex = ChunkI * ChunkResolution.Y + ChunkJ;
+			FTileChunk& TileChunk = TileChunks[ChunkIndex];
+			const bool bWasResident = TileChunk.ResidencyCounter > 0;
+			TileChunk.ResidencyCounter += ResidencyCounterDelta;
+			checkSlow(TileChunk.ResidencyCounter >= 0);
+			if (bWasResident != (TileChunk.ResidencyCounter > 0))
+			{
+				FlippedChunkIndexes.Add(ChunkIndex);
+			}
+		}
+	}
+
+	if (FlippedChunkIndexes.IsEmpty())
+	{
+		return;
+	}
+
+	// the vision results touching the flipped chunks were calculated for the old residency (and the counters of the unloaded tiles are about to be lost)
+	// so they are released before the chunks change and recalculated right after
+	InvalidateVisionUnitsInArea(
+		{ MinChunkIJ.X << TileChunkSizeLog2, MinChunkIJ.Y << TileChunkSizeLog2 },
+		{ ((MaxChunkIJ.X + 1) << TileChunkSizeLog2) - 1, ((MaxChunkIJ.Y + 1) << TileChunkSizeLog2) - 1 });
+
+	for (const int ChunkIndex : FlippedChunkIndexes)
+	{
+		if (TileChunks[ChunkIndex].ResidencyCounter > 0)
+		{
+			LoadTileChunk(ChunkIndex);
+		}
+		else
+		{
+			UnloadTileChunk(ChunkIndex);
+		}
+	}
+
+	RecalculateInvalidatedVisionUnits();
+
+#if WITH_EDITORONLY_DATA
+	if (HeightmapTexture)
+	{
+		WriteHeightmapDataToTexture(HeightmapTexture);
+	}
+#endif
+}
+
+void AFogOfWar::InvalidateVisionUnitsInArea(FIntVector2 MinIJ, FIntVector2 MaxIJ)
+{
+	const auto IsOutsideArea = [&MinIJ, &MaxIJ](FIntVector2 AreaMinIJ, FIntVector2 AreaMaxIJ)
+	{
+		return AreaMaxIJ.X < MinIJ.X || AreaMaxIJ.Y < MinIJ.Y || AreaMinIJ.X > MaxIJ.X || AreaMinIJ.Y > MaxIJ.Y;
+	};
+	const auto GetAreaMaxIJ = [](const FVisionResult& VisionResult)
+	{
+		return VisionResult.LocalToGlobal({ VisionResult.LocalAreaTilesResolution - 1, VisionResult.LocalAreaTilesResolution - 1 });
+	};
+
+	for (int VisionUnitIndex = 0; VisionUnitIndex < VisionUnits.Num(); VisionUnitIndex++)
+	{
+		FVisionUnitData& VisionUnitData = VisionUnits[VisionUnitIndex];
+
+		// they were calculated with the old heights too
+		for (int RecentResultIndex = VisionUnitData.RecentResults.Num() - 1; RecentResultIndex >= 0; RecentResultIndex--)
+		{
+			const FVisionResult& RecentResult = *VisionUnitData.RecentResults[RecentResultIndex];
+			if (!IsOutsideArea(RecentResult.LocalAreaCachedMinIJ, GetAreaMaxIJ(RecentResult)))
+			{
+				PoolVisionResult(VisionUnitData.RecentResults[RecentResultIndex]);
+				VisionUnitData.RecentResults.RemoveAt(RecentResultIndex, 1, false);
+			}
+		}
+
+		FIntVector2 AreaMinIJ;
+		FIntVector2 AreaMaxIJ;
+		if (VisionUnitData.HasCachedData())
+		{
+			AreaMinIJ = VisionUnitData.Result->LocalAreaCachedMinIJ;
+			AreaMaxIJ = GetAreaMaxIJ(*VisionUnitData.Result);
+		}
+		else
+		{
+			// the vision unit may be waiting for its chunk to be streamed in
+			AreaMinIJ = AreaMaxIJ = ConvertWorldLocationToTileIJ(FVector2D(VisionUnitLocations[VisionUnitIndex]));
+		}
+
+		if (IsOutsideArea(AreaMinIJ, AreaMaxIJ))
+		{
+			continue;
+		}
+
+		ReleaseVisionResult(VisionUnitIndex);
+		InvalidatedVisionUnitIndexes.Add(VisionUnitIndex);
+	}
+}
+
+void AFogOfWar::RecalculateInvalidatedVisionUnits()
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("RecalculateInvalidatedVisionUnits"), STAT_FogOfWarRecalculateInvalidatedVisionUnits, STATGROUP_FogOfWar);
+
+	// all of them are released by now, so none picks up a stale shared result
+	for (const int VisionUnitIndex : InvalidatedVisionUnitIndexes)
+	{
+		UpdateVisibilities(VisionUnitIndex);
+	}
+	InvalidatedVisionUnitIndexes.Reset();
 }
 
-void AFogOfWar::ResetCachedVisibilities(FVisionUnitData& VisionUnitData)
+void AFogOfWar::LoadTileChunk(int ChunkIndex)
 {
+	FTileChunk& TileChunk = TileChunks[ChunkIndex];
+	checkSlow(!TileChunk.IsResident());
+
+	// only traced if no other instance has the chunk resident
+	TileChunk.Heights = Heightmap->AcquireChunk(ChunkIndex, [&](TArrayView<float> Heights)
+		{
+			ForEachTileInChunk(ChunkIndex, [&](FIntVector2 TileIJ)
+				{
+					Heights[GetTileIndexInChunk(TileIJ)] = CalculateTileHeight(TileIJ);
+				});
+		});
+	TileChunk.Tiles.SetNum(1 << (TileChunkSizeLog2 * 2));
+	// allocated for the whole residency, so the occluder updates never reallocate what the line of sight queries read
+	TileChunk.OccluderHeights.Init(-std::numeric_limits<float>::infinity(), 1 << (TileChunkSizeLog2 * 2));
+
+	// also calculates the max height
+	const FIntVector2 ChunkMinIJ = GetChunkMinIJ(ChunkIndex);
+	StampOccluders(ChunkMinIJ, ChunkMinIJ + FIntVector2(TileChunkSizeMask, TileChunkSizeMask));
+
+#if WITH_EDITORONLY_DATA
+	ResidentTileChunksNum++;
+#endif
+}
+
+void AFogOfWar::UnloadTileChunk(int ChunkIndex)
+{
+	FTileChunk& TileChunk = TileChunks[ChunkIndex];
+	checkSlow(TileChunk.IsResident());
+
+#if DO_GUARD_SLOW
+	ForEachTileInChunk(ChunkIndex, [&](FIntVector2 TileIJ)
+		{
+			check(TileChunk.Tiles[GetTileIndexInChunk(TileIJ)].VisibilityCounter == 0);
+		});
+#endif
+
+	Heightmap->ReleaseChunk(ChunkIndex);
+	TileChunk.Heights = nullptr;
+	TileChunk.OccluderHeights.Empty();
+	TileChunk.Tiles.Empty();
+	TileChunk.MaxHeight = std::numeric_limits<float>::infinity();
+
+#if WITH_EDITORONLY_DATA
+	ResidentTileChunksNum--;
+#endif
+}
+
+FVisionOccluderHandle AFogOfWar::AddCircleOccluder(FVector2D Center, float Radius, float Height)
+{
+	// the grid must be known to find the covered tiles
+	if (!ensure(bActivated))
+	{
+		return {};
+	}
+
+	FVisionOccluder Occluder;
+	Occluder.MinIJ = ConvertWorldLocationToTileIJ(Center - Radius);
+	Occluder.MaxIJ = ConvertWorldLocationToTileIJ(Center + Radius);
+	Occluder.bIsCircle = true;
+	Occluder.GridSpaceCenter = ConvertWorldSpaceLocationToGridSpace(Center);
+	Occluder.GridSpaceRadiusSqr = FMath::Square(Radius / TileSize);
+	Occluder.Height = Height;
+	return AddOccluderInternal(Occluder);
+}
+
+FVisionOccluderHandle AFogOfWar::AddBoxOccluder(FBox2D Box, float Height)
+{
+	if (!ensure(bActivated))
+	{
+		return {};
+	}
+
+	FVisionOccluder Occluder;
+	Occluder.MinIJ = ConvertWorldLocationToTileIJ(Box.Min);
+	Occluder.MaxIJ = ConvertWorldLocationToTileIJ(Box.Max);
+	Occluder.Height = Height;
+	return AddOccluderInternal(Occluder);
+}
+
+void AFogOfWar::SetOccluderHeight(FVisionOccluderHandle Handle, float Height)
+{
+	const int OccluderIndex = GetOccluderIndex(Handle);
+	if (!ensure(OccluderIndex != INDEX_NONE))
+	{
+		return;
+	}
+
+	FVisionOccluder& Occluder = Occluders[OccluderIndex];
+	Occluder.Height = bDeterministicMode ? FMath::RoundToFloat(Height) : Height;
+	UpdateOccludedArea(Occluder.MinIJ, Occluder.MaxIJ);
+}
+
+void AFogOfWar::RemoveOccluder(FVisionOccluderHandle Handle)
+{
+	const int OccluderIndex = GetOccluderIndex(Handle);
+	if (!ensure(OccluderIndex != INDEX_NONE))
+	{
+		return;
+	}
+
+	FVisionOccluder& Occluder = Occluders[OccluderIndex];
+	Occluder.bIsActive = false;
+	Occluder.Generation++;
+	FreeOccluderIndexes.Add(OccluderIndex);
+	UpdateOccludedArea(Occluder.MinIJ, Occluder.MaxIJ);
+}
+
+bool AFogOfWar::IsOccluderValid(FVisionOccluderHandle Handle) const
+{
+	return GetOccluderIndex(Handle) != INDEX_NONE;
+}
+
+FVisionOccluderHandle AFogOfWar::AddOccluderInternal(const FVisionOccluder& NewOccluder)
+{
+	int OccluderIndex;
+	if (!FreeOccluderIndexes.IsEmpty())
+	{
+		OccluderIndex = FreeOccluderIndexes.Pop(false);
+	}
+	else
+	{
+		OccluderIndex = Occluders.AddDefaulted();
+	}
+
+	FVisionOccluder& Occluder = Occluders[OccluderIndex];
+	const int Generation = Occluder.Generation;
+	Occluder = NewOccluder;
+	Occluder.Generation = Generation;
+	Occluder.bIsActive = true;
+	if (bDeterministicMode)
+	{
+		Occluder.Height = FMath::RoundToFloat(Occluder.Height);
+	}
+	UpdateOccludedArea(Occluder.MinIJ, Occluder.MaxIJ);
+
+	FVisionOccluderHandle Handle;
+	Handle.Index = OccluderIndex;
+	Handle.Generation = Generation;
+	return Handle;
+}
+
+int AFogOfWar::GetOccluderIndex(FVisionOccluderHandle Handle) const
+{
+	if (!Occluders.IsValidIndex(Handle.Index))
+	{
+		return INDEX_NONE;
+	}
+	const FVisionOccluder& Occluder = Occluders[Handle.Index];
+	return Occluder.bIsActive && Occluder.Generation == Handle.Generation ? Handle.Index : INDEX_NONE;
+}
+
+void AFogOfWar::StampOccluders(FIntVector2 MinIJ, FIntVector2 MaxIJ)
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("StampOccluders"), STAT_FogOfWarStampOccluders, STATGROUP_FogOfWar);
+
+	MinIJ = { FMath::Max(MinIJ.X, 0), FMath::Max(MinIJ.Y, 0) };
+	MaxIJ = { FMath::Min(MaxIJ.X, GridResolution.X - 1), FMath::Min(MaxIJ.Y, GridResolution.Y - 1) };
+	if (MinIJ.X > MaxIJ.X || MinIJ.Y > MaxIJ.Y || TileChunks.IsEmpty())
+	{
+		return;
+	}
+
+	for (int I = MinIJ.X; I <= MaxIJ.X; I++)
+	{
+		for (int J = MinIJ.Y; J <= MaxIJ.Y; J++)
+		{
+			FTileChunk& TileChunk = TileChunks[GetChunkIndex({ I, J })];
+			if (TileChunk.IsResident())
+			{
+				TileChunk.OccluderHeights[GetTileIndexInChunk({ I, J })] = -std::numeric_limits<float>::infinity();
+			}
+		}
+	}
+
+	for (const FVisionOccluder& Occluder : Occluders)
+	{
+		if (!Occluder.bIsActive)
+		{
+			continue;
+		}
+		const FIntVector2 StampMinIJ = { FMath::Max(Occluder.MinIJ.X, MinIJ.X), FMath::Max(Occluder.MinIJ.Y, MinIJ.Y) };
+		const FIntVector2 StampMaxIJ = { FMath::Min(Occluder.MaxIJ.X, MaxIJ.X), FMath::Min(Occluder.MaxIJ.Y, MaxIJ.Y) };
+		for (int I = StampMinIJ.X; I <= StampMaxIJ.X; I++)
+		{
+			for (int J = StampMinIJ.Y; J <= StampMaxIJ.Y; J++)
+			{
+				FTileChunk& TileChunk = TileChunks[GetChunkIndex({ I, J })];
+				if (!Occluder.Covers({ I, J }) || !TileChunk.IsResident())
+				{
+					continue;
+				}
+				float& OccluderHeight = TileChunk.OccluderHeights[GetTileIndexInChunk({ I, J })];
+				OccluderHeight = FMath::Max(OccluderHeight, Occluder.Height);
+			}
+		}
+	}
+
+	// the max heights can go down as well, so they are recalculated from scratch
+	for (int ChunkI = MinIJ.X >> TileChunkSizeLog2; ChunkI <= MaxIJ.X >> TileChunkSizeLog2; ChunkI++)
+	{
+		for (int ChunkJ = MinIJ.Y >> TileChunkSizeLog2; ChunkJ <= MaxIJ.Y >> TileChunkSizeLog2; ChunkJ++)
+		{
+			const int ChunkIndex = ChunkI * ChunkResolution.Y + ChunkJ;
+			FTileChunk& TileChunk = TileChunks[ChunkIndex];
+			if (!TileChunk.IsResident())
+			{
+				continue;
+			}
+			TileChunk.MaxHeight = -std::numeric_limits<float>::infinity();
+			ForEachTileInChunk(ChunkIndex, [&](FIntVector2 TileIJ)
+				{
+					TileChunk.MaxHeight = FMath::Max(TileChunk.MaxHeight, GetTileHeight(TileIJ));
+				});
+		}
+	}
+}
+
+void AFogOfWar::UpdateOccludedArea(FIntVector2 MinIJ, FIntVector2 MaxIJ)
+{
+	InvalidateVisionUnitsInArea(MinIJ, MaxIJ);
+	StampOccluders(MinIJ, MaxIJ);
+	RecalculateInvalidatedVisionUnits();
+
+#if WITH_EDITORONLY_DATA
+	if (HeightmapTexture)
+	{
+		WriteHeightmapDataToTexture(HeightmapTexture);
+	}
+#endif
+}
+
+void AFogOfWar::ResetCachedVisibilities(FVisionResult& VisionResult)
+{
+	VisionResult.ForEachVisibleTile([this](FIntVector2 GlobalIJ)
+		{
+			DecrementVisibilityCounter(GlobalIJ);
+		});
+}
+
+void AFogOfWar::ReleaseVisionResult(int VisionUnitIndex, bool bKeepRecent)
+{
+	FVisionUnitData& VisionUnitData = VisionUnits[VisionUnitIndex];
 	if (!VisionUnitData.HasCachedData())
 	{
 		return;
 	}
+	VisionUnitCachedOriginGlobalIndexes[VisionUnitIndex] = INDEX_NONE;
 
-	for (int I = 0; I < VisionUnitData.LocalAreaTilesResolution; I++)
+	FVisionResult& VisionResult = *VisionUnitData.Result;
+	checkSlow(VisionResult.Multiplicity > 0);
+	VisionResult.Multiplicity--;
+
+	if (VisionResult.Multiplicity == 0)
 	{
-		for (int J = 0; J < VisionUnitData.LocalAreaTilesResolution; J++)
+		ResetCachedVisibilities(VisionResult);
+		VisionResults.Remove(VisionResult.Key);
+
+#if WITH_EDITORONLY_DATA
+		VisionResultsNum = VisionResults.Num();
+		TotalRegisteredVisionsCacheTilesNum -= FMath::Square(VisionResult.LocalAreaTilesResolution);
+#endif
+
+		if (bKeepRecent && MaxRecentVisionResultsPerUnit > 0)
 		{
-			if (VisionUnitData.GetLocalTileState({ I, J }) == FVisionUnitData::TileState::Visible)
+			// the least recent ones make room
+			while (VisionUnitData.RecentResults.Num() >= MaxRecentVisionResultsPerUnit)
 			{
-				FIntVector2 GlobalIJ = VisionUnitData.LocalToGlobal({ I, J });
-				FTile& GlobalTile = GetGlobalTile(GlobalIJ);
-				checkSlow(GlobalTile.VisibilityCounter > 0);
-				GlobalTile.VisibilityCounter--;
+				PoolVisionResult(VisionUnitData.RecentResults.Pop(false));
 			}
+			VisionUnitData.RecentResults.Insert(VisionUnitData.Result, 0);
+		}
+		else
+		{
+			PoolVisionResult(VisionUnitData.Result);
 		}
 	}
 
-	VisionUnitData.bHasCachedData = false;
+	VisionUnitData.Result.Reset();
 }
 
-void AFogOfWar::UpdateVisibilities(const FVector3d& OriginWorldLocation, FVisionUnitData& VisionUnitData)
+void AFogOfWar::ForgetRecentVisionResults(FVisionUnitData& VisionUnitData)
+{
+	for (const TSharedPtr<FVisionResult>& RecentResult : VisionUnitData.RecentResults)
+	{
+		PoolVisionResult(RecentResult);
+	}
+	VisionUnitData.RecentResults.Reset();
+}
+
+void AFogOfWar::PoolVisionResult(const TSharedPtr<FVisionResult>& VisionResult)
+{
+	TArray<TSharedPtr<FVisionResult>>& PoolBucket = VisionResultsPool.FindOrAdd(VisionResult->ReservedLocalAreaTilesResolution);
+	if (PoolBucket.Num() < MaxPooledVisionResultsPerResolution)
+	{
+		PoolBucket.Add(VisionResult);
+
+#if WITH_EDITORONLY_DATA
+		PooledVisionResultsNum++;
+#endif
+	}
+}
+
+void AFogOfWar::UpdateVisibilities(int VisionUnitIndex)
 {
 	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("UpdateVisibilities"), STAT_FogOfWarUpdateVisibilities, STATGROUP_FogOfWar);
 
-	const FVector2f OriginGridLocation = ConvertWorldSpaceLocationToGridSpace(FVector2D(OriginWorldLocation));
+	bool bKeepRecent = true;
+#if WITH_EDITORONLY_DATA
+	// the stress test measures the full recalculation
+	bKeepRecent = !bDebugStressTestIgnoreCache;
+#endif
+	ReleaseVisionResult(VisionUnitIndex, bKeepRecent);
+	VisionUnitDirtyFlags[VisionUnitIndex] = false;
+
+	FVisionUnitData& VisionUnitData = VisionUnits[VisionUnitIndex];
+	const FVector& OriginWorldLocation = VisionUnitLocations[VisionUnitIndex];
 
+	const FIntVector2 OriginGlobalIJ = ConvertWorldLocationToTileIJ(FVector2D(OriginWorldLocation));
+	// the result doesn't depend on the location within the tile, the deterministic mode uses the tile center to get rid of the float location entirely
+	const FVector2f OriginGridLocation = bDeterministicMode
+		? FVector2f(OriginGlobalIJ.X + 0.5f, OriginGlobalIJ.Y + 0.5f)
+		: ConvertWorldSpaceLocationToGridSpace(FVector2D(OriginWorldLocation));
+	// if the vision unit is outside the grid, we ignore it (normally this shouldn't happen)
+	if (!ensureMsgf(IsGlobalIJValid(OriginGlobalIJ), TEXT("Vision actor is outside the grid")))
+	{
+		return;
+	}
+	// the vision unit is recalculated when its chunk is streamed in
+	if (!IsTileResident(OriginGlobalIJ))
+	{
+		return;
+	}
+
+	const FVisionResultKey Key = {
+		.OriginGlobalIndex = GetGlobalIndex(OriginGlobalIJ),
+		.GridSpaceRadiusSqr = VisionUnitData.GridSpaceRadiusSqr,
+		.ObserverHeight = GetObserverHeight(OriginWorldLocation.Z),
+	};
+
+	VisionUnitCachedOriginGlobalIndexes[VisionUnitIndex] = Key.OriginGlobalIndex;
+
+	const int RecentResultIndex = VisionUnitData.RecentResults.IndexOfByPredicate([&Key](const TSharedPtr<FVisionResult>& RecentResult) { return RecentResult->Key == Key; });
+
+	if (const TSharedPtr<FVisionResult>* ExistingVisionResult = VisionResults.Find(Key))
+	{
+		// another vision unit has already done all the work for us, the own copy isn't needed anymore
+		if (RecentResultIndex != INDEX_NONE)
+		{
+			PoolVisionResult(VisionUnitData.RecentResults[RecentResultIndex]);
+			VisionUnitData.RecentResults.RemoveAt(RecentResultIndex, 1, false);
+		}
+		VisionUnitData.Result = *ExistingVisionResult;
+		VisionUnitData.Result->Multiplicity++;
+		return;
+	}
+
+	TSharedPtr<FVisionResult> VisionResult;
+	if (RecentResultIndex != INDEX_NONE)
+	{
+		// the vision unit is back on a tile it has recently left, only the counters have to be restored
+		VisionResult = MoveTemp(VisionUnitData.RecentResults[RecentResultIndex]);
+		VisionUnitData.RecentResults.RemoveAt(RecentResultIndex, 1, false);
+		VisionResult->ForEachVisibleTile([this](FIntVector2 GlobalIJ)
+			{
+				IncrementVisibilityCounter(GlobalIJ);
+			});
+	}
+	else
+	{
+		VisionResult = AcquireVisionResult(VisionUnitData.ReservedLocalAreaTilesResolution);
+		VisionResult->Key = Key;
+		CalculateVisionResult(OriginGridLocation, VisionUnitData, *VisionResult);
+	}
+	VisionResult->Multiplicity = 1;
+
+	VisionResults.Add(Key, VisionResult);
+	VisionUnitData.Result = MoveTemp(VisionResult);
+
+#if WITH_EDITORONLY_DATA
+	VisionResultsNum = VisionResults.Num();
+	TotalRegisteredVisionsCacheTilesNum += FMath::Square(VisionUnitData.Result->LocalAreaTilesResolution);
+#endif
+}
+
+void AFogOfWar::CalculateVisionResult(const FVector2f& OriginGridLocation, const FVisionUnitData& VisionUnitData, FVisionResult& VisionResult)
+{
 	// check that we have allocated enough local area cached tiles to fit the radius. THIS IS A MUST!
 	checkSlow(ConvertGridLocationToTileIJ(OriginGridLocation + VisionUnitData.GridSpaceRadius).X - ConvertGridLocationToTileIJ(OriginGridLocation - VisionUnitData.GridSpaceRadius).X + 1 <= VisionUnitData.LocalAreaTilesResolution);
 	checkSlow(ConvertGridLocationToTileIJ(OriginGridLocation + VisionUnitData.GridSpaceRadius).Y - ConvertGridLocationToTileIJ(OriginGridLocation - VisionUnitData.GridSpaceRadius).Y + 1 <= VisionUnitData.LocalAreaTilesResolution);
@@ -377,37 +1817,47 @@ void AFogOfWar::UpdateVisibilities(const FVector3d& OriginWorldLocation, FVision
 	checkSlow(ConvertGridLocationToTileIJ(OriginGridLocation + VisionUnitData.GridSpaceRadius).X - ConvertGridLocationToTileIJ(OriginGridLocation - VisionUnitData.GridSpaceRadius).X + 1 + 2 > VisionUnitData.LocalAreaTilesResolution);
 	checkSlow(ConvertGridLocationToTileIJ(OriginGridLocation + VisionUnitData.GridSpaceRadius).Y - ConvertGridLocationToTileIJ(OriginGridLocation - VisionUnitData.GridSpaceRadius).Y + 1 + 2 > VisionUnitData.LocalAreaTilesResolution);
 
-	ResetCachedVisibilities(VisionUnitData);
-
-	VisionUnitData.LocalAreaTilesCachedStates.Init(FVisionUnitData::TileState::Unknown, VisionUnitData.LocalAreaTilesCachedStates.Num());
-	const FIntVector2 OriginGlobalIJ = ConvertGridLocationToTileIJ(OriginGridLocation);
-	// if the vision unit is outside the grid, we ignore it (normally this shouldn't happen)
-	if (!ensureMsgf(IsGlobalIJValid(OriginGlobalIJ), TEXT("Vision actor is outside the grid")))
+	VisionResult.LocalAreaTilesResolution = VisionUnitData.LocalAreaTilesResolution;
+	const int LocalAreaTilesNum = FMath::Square(VisionResult.LocalAreaTilesResolution);
+	const int LocalAreaWordsNum = BitUtils::GetWordsNum(LocalAreaTilesNum);
+	checkSlow(VisionResult.LocalAreaTilesResolution <= VisionResult.ReservedLocalAreaTilesResolution);
+	// not shrinking to keep the buffer for the reserved resolution
+	VisionResult.LocalAreaVisibleTilesBits.SetNumUninitialized(LocalAreaWordsNum, false);
+	FMemory::Memzero(VisionResult.LocalAreaVisibleTilesBits.GetData(), LocalAreaWordsNum * sizeof(uint64));
+
+	if (VisionResult.LocalAreaTilesResolution == 0)
 	{
 		return;
 	}
 
-	if (VisionUnitData.LocalAreaTilesResolution == 0)
+	const float ObserverHeight = VisionResult.Key.ObserverHeight;
+	const FIntVector2 OriginGlobalIJ = ConvertGridLocationToTileIJ(OriginGridLocation);
+	// the "bottom-left" tile of the local area in the global grid space
+	VisionResult.LocalAreaCachedMinIJ = ConvertGridLocationToTileIJ(OriginGridLocation - VisionUnitData.GridSpaceRadius);
+	const FIntVector2 OriginLocalIJ = VisionResult.GlobalToLocal(OriginGlobalIJ);
+
+	// nothing can block the vision, so every tile within the radius is visible
+	if (IsAreaFreeOfVisionBlockers(ObserverHeight, VisionResult.LocalAreaCachedMinIJ, VisionResult.LocalToGlobal({ VisionResult.LocalAreaTilesResolution - 1, VisionResult.LocalAreaTilesResolution - 1 })))
 	{
+		ApplyVisionDiscStamp(OriginGlobalIJ, *VisionUnitData.DiscStamp, VisionResult);
 		return;
 	}
 
-	VisionUnitData.CachedOriginGlobalIndex = GetGlobalIndex(OriginGlobalIJ);
-	// the "bottom-left" tile of the local area in the global grid space
-	VisionUnitData.LocalAreaCachedMinIJ = ConvertGridLocationToTileIJ(OriginGridLocation - VisionUnitData.GridSpaceRadius);
-	const FIntVector2 OriginLocalIJ = VisionUnitData.GlobalToLocal(OriginGlobalIJ);
+	DDAKnownLocalTilesBits.SetNumUninitialized(LocalAreaWordsNum, false);
+	FMemory::Memzero(DDAKnownLocalTilesBits.GetData(), DDAKnownLocalTilesBits.Num() * sizeof(uint64));
 
 	// we see the tile we're currently on
-	VisionUnitData.GetLocalTileState(OriginLocalIJ) = FVisionUnitData::TileState::Visible;
+	VisionResult.SetLocalTileVisible(OriginLocalIJ);
+	SetLocalTileKnown(VisionResult.GetLocalIndex(OriginLocalIJ));
 
-	const float GridSpaceRadiusSqr = FMath::Square(VisionUnitData.GridSpaceRadius);
+	const int GridSpaceRadiusSqr = VisionUnitData.GridSpaceRadiusSqr;
 
 	// going in spiral (spooky code)
 	{
 #if DO_GUARD_SLOW
-		int SafetyIterations = VisionUnitData.LocalAreaTilesCachedStates.Num();
+		int SafetyIterations = LocalAreaTilesNum;
 		TArray<bool> IsTileVisited;
-		IsTileVisited.Init(false, VisionUnitData.LocalAreaTilesCachedStates.Num());
+		IsTileVisited.Init(false, LocalAreaTilesNum);
 #endif
 
 		// in the order of spiral traversal
@@ -427,7 +1877,7 @@ void AFogOfWar::UpdateVisibilities(const FVector3d& OriginWorldLocation, FVision
 
 		EDirection CurrentDirection = EDirection::Right;
 		bool Clock = true;
-		int CurrentStepSize = VisionUnitData.LocalAreaTilesResolution;
+		int CurrentStepSize = VisionResult.LocalAreaTilesResolution;
 		int LeftToSpend = CurrentStepSize;
 		FIntVector2 CurrentLocalIJ = FIntVector2(0, 0) - DirectionDeltas[static_cast<int>(CurrentDirection)];
 
@@ -438,14 +1888,14 @@ void AFogOfWar::UpdateVisibilities(const FVector3d& OriginWorldLocation, FVision
 			LeftToSpend--;
 
 			{
-				checkSlow(VisionUnitData.IsLocalIJValid(CurrentLocalIJ));
+				checkSlow(VisionResult.IsLocalIJValid(CurrentLocalIJ));
 
 #if DO_GUARD_SLOW
 				SafetyIterations--;
-				IsTileVisited[VisionUnitData.GetLocalIndex(CurrentLocalIJ)] = true;
+				IsTileVisited[VisionResult.GetLocalIndex(CurrentLocalIJ)] = true;
 #endif
 
-				FIntVector2 GlobalIJ = VisionUnitData.LocalToGlobal(CurrentLocalIJ);
+				FIntVector2 GlobalIJ = VisionResult.LocalToGlobal(CurrentLocalIJ);
 
 				if (IsGlobalIJValid(GlobalIJ))
 				{
@@ -453,8 +1903,8 @@ void AFogOfWar::UpdateVisibilities(const FVector3d& OriginWorldLocation, FVision
 					int DistToTileSqr = FMath::Square(OriginGlobalIJ.X - GlobalIJ.X) + FMath::Square(OriginGlobalIJ.Y - GlobalIJ.Y);
 					if (DistToTileSqr <= GridSpaceRadiusSqr)
 					{
-						ExecuteDDAVisibilityCheck(OriginWorldLocation.Z, CurrentLocalIJ, OriginLocalIJ, VisionUnitData);
-						checkSlow(VisionUnitData.GetLocalTileState(CurrentLocalIJ) != FVisionUnitData::TileState::Unknown);
+						ExecuteDDAVisibilityCheck(ObserverHeight, CurrentLocalIJ, OriginLocalIJ, VisionResult);
+						checkSlow(IsLocalTileKnown(VisionResult.GetLocalIndex(CurrentLocalIJ)));
 					}
 				}
 			}
@@ -485,32 +1935,16 @@ void AFogOfWar::UpdateVisibilities(const FVector3d& OriginWorldLocation, FVision
 #endif
 	}
 
-	for (int I = 0; I < VisionUnitData.LocalAreaTilesResolution; I++)
-	{
-		for (int J = 0; J < VisionUnitData.LocalAreaTilesResolution; J++)
+	// the ray casting only marks tiles within the radius as visible (the whole ray lies within the bounding box of its ends)
+	VisionResult.ForEachVisibleTile([&](FIntVector2 GlobalIJ)
 		{
-			FIntVector2 GlobalIJ = VisionUnitData.LocalToGlobal({ I, J });
-
-			if (IsGlobalIJValid(GlobalIJ))
-			{
-				// the distance between bottom-left corners of the tiles is the same as the distance between their centers, no need to add 0.5
-				int DistToTileSqr = FMath::Square(OriginGlobalIJ.X - GlobalIJ.X) + FMath::Square(OriginGlobalIJ.Y - GlobalIJ.Y);
-				if (DistToTileSqr <= GridSpaceRadiusSqr)
-				{
-					if (VisionUnitData.GetLocalTileState({ I, J }) == FVisionUnitData::TileState::Visible)
-					{
-						FTile& GlobalTile = GetGlobalTile(GlobalIJ);
-						GlobalTile.VisibilityCounter++;
-					}
-				}
-			}
-		}
-	}
-
-	VisionUnitData.bHasCachedData = true;
+			checkSlow(IsGlobalIJValid(GlobalIJ));
+			checkSlow(FMath::Square(OriginGlobalIJ.X - GlobalIJ.X) + FMath::Square(OriginGlobalIJ.Y - GlobalIJ.Y) <= GridSpaceRadiusSqr);
+			IncrementVisibilityCounter(GlobalIJ);
+		});
 }
 
-void AFogOfWar::CalculateTileHeight(FTile& Tile, FIntVector2 TileIJ)
+float AFogOfWar::CalculateTileHeight(FIntVector2 TileIJ) const
 {
 	FVector2D WorldLocation = ConvertTileIJToTileCenterWorldLocation(TileIJ);
 	FHitResult HitResult;
@@ -522,28 +1956,265 @@ void AFogOfWar::CalculateTileHeight(FTile& Tile, FIntVector2 TileIJ)
 
 	if (bFoundBlockingHit && HitResult.HasValidHitObjectHandle())
 	{
-		Tile.Height = HitResult.ImpactPoint.Z;
-		return;
+		return bDeterministicMode ? FMath::RoundToFloat(HitResult.ImpactPoint.Z) : HitResult.ImpactPoint.Z;
 	}
 
-	Tile.Height = -std::numeric_limits<decltype(Tile.Height)>::infinity();
+	return -std::numeric_limits<float>::infinity();
 }
 
-AFogOfWar::FVisionUnitData AFogOfWar::CreateVisionUnitDataFromVisionComponent(UVisionComponent* VisionComponent)
+bool AFogOfWar::IsAreaFreeOfVisionBlockers(float ObserverHeight, FIntVector2 MinIJ, FIntVector2 MaxIJ)
 {
-	int LocalAreaTilesResolution = FMath::CeilToInt32(VisionComponent->GetSightRadius() * 2 / TileSize) + 1;
-	TArray<FVisionUnitData::TileState> LocalAreaTilesStates;
-	LocalAreaTilesStates.Init(FVisionUnitData::TileState::NotVisible, LocalAreaTilesResolution * LocalAreaTilesResolution);
-	return {
-		.LocalAreaTilesResolution = LocalAreaTilesResolution,
-		.GridSpaceRadius = VisionComponent->GetSightRadius() / TileSize,
-		.LocalAreaTilesCachedStates = std::move(LocalAreaTilesStates),
-	};
+	MinIJ = { FMath::Max(MinIJ.X, 0), FMath::Max(MinIJ.Y, 0) };
+	MaxIJ = { FMath::Min(MaxIJ.X, GridResolution.X - 1), FMath::Min(MaxIJ.Y, GridResolution.Y - 1) };
+
+	for (int ChunkI = MinIJ.X >> TileChunkSizeLog2; ChunkI <= MaxIJ.X >> TileChunkSizeLog2; ChunkI++)
+	{
+		for (int ChunkJ = MinIJ.Y >> TileChunkSizeLog2; ChunkJ <= MaxIJ.Y >> TileChunkSizeLog2; ChunkJ++)
+		{
+			if (IsBlockingVision(ObserverHeight, TileChunks[ChunkI * ChunkResolution.Y + ChunkJ].MaxHeight))
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+void AFogOfWar::ApplyVisionDiscStamp(FIntVector2 OriginGlobalIJ, const FVisionDiscStamp& DiscStamp, FVisionResult& VisionResult)
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("ApplyVisionDiscStamp"), STAT_FogOfWarApplyVisionDiscStamp, STATGROUP_FogOfWar);
+
+	const int RowsHalfNum = DiscStamp.GetRowsHalfNum();
+
+	for (int Row = -RowsHalfNum; Row <= RowsHalfNum; Row++)
+	{
+		const int I = OriginGlobalIJ.X + Row;
+		if (I < 0 || I >= GridResolution.X)
+		{
+			continue;
+		}
+
+		const int RowHalfWidth = DiscStamp.RowHalfWidths[Row + RowsHalfNum];
+		const int MinJ = FMath::Max(OriginGlobalIJ.Y - RowHalfWidth, 0);
+		const int MaxJ = FMath::Min(OriginGlobalIJ.Y + RowHalfWidth, GridResolution.Y - 1);
+
+		for (int J = MinJ; J <= MaxJ; J++)
+		{
+			VisionResult.SetLocalTileVisible(VisionResult.GlobalToLocal({ I, J }));
+			IncrementVisibilityCounter({ I, J });
+		}
+	}
+}
+
+TSharedPtr<const AFogOfWar::FVisionDiscStamp> AFogOfWar::GetOrCreateVisionDiscStamp(int GridSpaceRadiusSqr)
+{
+	if (const TSharedPtr<const FVisionDiscStamp>* ExistingDiscStamp = VisionDiscStamps.Find(GridSpaceRadiusSqr))
+	{
+		return *ExistingDiscStamp;
+	}
+
+	// using the same integer distance check as the ray casting does, so the results are identical
+	int RowsHalfNum = 0;
+	while (FMath::Square(RowsHalfNum + 1) <= GridSpaceRadiusSqr)
+	{
+		RowsHalfNum++;
+	}
+
+	TSharedPtr<FVisionDiscStamp> DiscStamp = MakeShared<FVisionDiscStamp>();
+	DiscStamp->RowHalfWidths.SetNum(RowsHalfNum * 2 + 1);
+	for (int Row = -RowsHalfNum; Row <= RowsHalfNum; Row++)
+	{
+		int RowHalfWidth = 0;
+		while (FMath::Square(Row) + FMath::Square(RowHalfWidth + 1) <= GridSpaceRadiusSqr)
+		{
+			RowHalfWidth++;
+		}
+		DiscStamp->RowHalfWidths[Row + RowsHalfNum] = RowHalfWidth;
+	}
+
+	VisionDiscStamps.Add(GridSpaceRadiusSqr, DiscStamp);
+	return DiscStamp;
+}
+
+FVisionUnitHandle AFogOfWar::AddVisionUnitInternal(const FVector& Location, float SightRadius, float ReservedSightRadius, UVisionComponent* VisionComponent)
+{
+	int SlotIndex;
+	if (!FreeVisionUnitSlotIndexes.IsEmpty())
+	{
+		SlotIndex = FreeVisionUnitSlotIndexes.Pop(false);
+	}
+	else
+	{
+		SlotIndex = VisionUnitSlots.AddDefaulted();
+	}
+
+	FVisionUnitSlot& Slot = VisionUnitSlots[SlotIndex];
+	Slot.VisionUnitIndex = VisionUnits.Num();
+
+	FVisionUnitData& VisionUnitData = VisionUnits.AddDefaulted_GetRef();
+	InitializeVisionUnitSightRadius(VisionUnitData, SightRadius, ReservedSightRadius);
+	VisionUnitLocations.Add(Location);
+	VisionUnitCachedOriginGlobalIndexes.Add(INDEX_NONE);
+	VisionUnitComponents.Add(VisionComponent);
+	VisionUnitSlotIndexes.Add(SlotIndex);
+	VisionUnitDirtyFlags.Add(false);
+	MarkVisionUnitDirty(Slot.VisionUnitIndex);
+
+#if WITH_EDITORONLY_DATA
+	RegisteredVisionsNum = VisionUnits.Num();
+#endif
+
+	FVisionUnitHandle Handle;
+	Handle.SlotIndex = SlotIndex;
+	Handle.Generation = Slot.Generation;
+	if (MovementTrace)
+	{
+		MovementTrace->AddUnit(Handle, Location, SightRadius, ReservedSightRadius);
+	}
+	return Handle;
+}
+
+void AFogOfWar::RemoveVisionUnitInternal(int VisionUnitIndex)
+{
+	ReleaseVisionUnit(VisionUnitIndex);
+
+	VisionUnits.RemoveAtSwap(VisionUnitIndex, 1, false);
+	VisionUnitLocations.RemoveAtSwap(VisionUnitIndex, 1, false);
+	VisionUnitCachedOriginGlobalIndexes.RemoveAtSwap(VisionUnitIndex, 1, false);
+	VisionUnitComponents.RemoveAtSwap(VisionUnitIndex, 1, false);
+	VisionUnitSlotIndexes.RemoveAtSwap(VisionUnitIndex, 1, false);
+	VisionUnitDirtyFlags.RemoveAtSwap(VisionUnitIndex, 1, false);
+
+	// the last vision unit was moved into the hole
+	if (VisionUnitIndex < VisionUnits.Num())
+	{
+		VisionUnitSlots[VisionUnitSlotIndexes[VisionUnitIndex]].VisionUnitIndex = VisionUnitIndex;
+	}
+
+#if WITH_EDITORONLY_DATA
+	RegisteredVisionsNum = VisionUnits.Num();
+#endif
+}
+
+void AFogOfWar::ReleaseVisionUnit(int VisionUnitIndex)
+{
+	ReleaseVisionResult(VisionUnitIndex);
+	ForgetRecentVisionResults(VisionUnits[VisionUnitIndex]);
+
+	const int SlotIndex = VisionUnitSlotIndexes[VisionUnitIndex];
+	FVisionUnitSlot& Slot = VisionUnitSlots[SlotIndex];
+	if (MovementTrace)
+	{
+		FVisionUnitHandle Handle;
+		Handle.SlotIndex = SlotIndex;
+		Handle.Generation = Slot.Generation;
+		MovementTrace->RemoveUnit(Handle);
+	}
+	Slot.VisionUnitIndex = INDEX_NONE;
+	Slot.Generation++;
+	FreeVisionUnitSlotIndexes.Add(SlotIndex);
+	VisionUnitSlotIndexes[VisionUnitIndex] = INDEX_NONE;
+}
+
+void AFogOfWar::MarkVisionUnitDirty(int VisionUnitIndex)
+{
+	if (!VisionUnitDirtyFlags[VisionUnitIndex])
+	{
+		VisionUnitDirtyFlags[VisionUnitIndex] = true;
+		DirtyVisionUnitSlotIndexes.Add(VisionUnitSlotIndexes[VisionUnitIndex]);
+	}
+}
+
+void AFogOfWar::CompactVisionUnits()
+{
+	int NewNum = 0;
+	for (int VisionUnitIndex = 0; VisionUnitIndex < VisionUnits.Num(); VisionUnitIndex++)
+	{
+		if (VisionUnitSlotIndexes[VisionUnitIndex] == INDEX_NONE)
+		{
+			continue;
+		}
+
+		if (NewNum != VisionUnitIndex)
+		{
+			VisionUnits[NewNum] = MoveTemp(VisionUnits[VisionUnitIndex]);
+			VisionUnitLocations[NewNum] = VisionUnitLocations[VisionUnitIndex];
+			VisionUnitCachedOriginGlobalIndexes[NewNum] = VisionUnitCachedOriginGlobalIndexes[VisionUnitIndex];
+			VisionUnitComponents[NewNum] = VisionUnitComponents[VisionUnitIndex];
+			VisionUnitSlotIndexes[NewNum] = VisionUnitSlotIndexes[VisionUnitIndex];
+			VisionUnitDirtyFlags[NewNum] = VisionUnitDirtyFlags[VisionUnitIndex];
+			VisionUnitSlots[VisionUnitSlotIndexes[NewNum]].VisionUnitIndex = NewNum;
+		}
+		NewNum++;
+	}
+
+	VisionUnits.SetNum(NewNum, false);
+	VisionUnitLocations.SetNum(NewNum, false);
+	VisionUnitCachedOriginGlobalIndexes.SetNum(NewNum, false);
+	VisionUnitComponents.SetNum(NewNum, false);
+	VisionUnitSlotIndexes.SetNum(NewNum, false);
+	VisionUnitDirtyFlags.SetNum(NewNum, false);
+
+#if WITH_EDITORONLY_DATA
+	RegisteredVisionsNum = VisionUnits.Num();
+#endif
+}
+
+int AFogOfWar::GetVisionUnitIndex(FVisionUnitHandle Handle) const
+{
+	if (!VisionUnitSlots.IsValidIndex(Handle.SlotIndex))
+	{
+		return INDEX_NONE;
+	}
+
+	const FVisionUnitSlot& Slot = VisionUnitSlots[Handle.SlotIndex];
+	return Slot.Generation == Handle.Generation ? Slot.VisionUnitIndex : INDEX_NONE;
+}
+
+void AFogOfWar::InitializeVisionUnitSightRadius(FVisionUnitData& VisionUnitData, float SightRadius, float ReservedSightRadius)
+{
+	checkSlow(!VisionUnitData.HasCachedData());
+
+	VisionUnitData.LocalAreaTilesResolution = GetLocalAreaTilesResolution(SightRadius);
+	VisionUnitData.ReservedLocalAreaTilesResolution = GetLocalAreaTilesResolution(FMath::Max(SightRadius, ReservedSightRadius));
+	VisionUnitData.GridSpaceRadius = SightRadius / TileSize;
+	if (bDeterministicMode)
+	{
+		// TileSize is already whole here
+		const int64 IntSightRadius = FMath::RoundToInt64(SightRadius);
+		const int64 IntTileSize = static_cast<int64>(TileSize);
+		VisionUnitData.GridSpaceRadiusSqr = static_cast<int>(FMath::Square(IntSightRadius) / FMath::Square(IntTileSize));
+	}
+	else
+	{
+		VisionUnitData.GridSpaceRadiusSqr = FMath::FloorToInt(FMath::Square(VisionUnitData.GridSpaceRadius));
+	}
+	VisionUnitData.DiscStamp = GetOrCreateVisionDiscStamp(VisionUnitData.GridSpaceRadiusSqr);
+}
+
+TSharedPtr<AFogOfWar::FVisionResult> AFogOfWar::AcquireVisionResult(int ReservedLocalAreaTilesResolution)
+{
+	if (TArray<TSharedPtr<FVisionResult>>* PoolBucket = VisionResultsPool.Find(ReservedLocalAreaTilesResolution))
+	{
+		if (!PoolBucket->IsEmpty())
+		{
+#if WITH_EDITORONLY_DATA
+			PooledVisionResultsNum--;
+#endif
+			return PoolBucket->Pop(false);
+		}
+	}
+
+	TSharedPtr<FVisionResult> VisionResult = MakeShared<FVisionResult>();
+	VisionResult->ReservedLocalAreaTilesResolution = ReservedLocalAreaTilesResolution;
+	VisionResult->LocalAreaVisibleTilesBits.Reserve(BitUtils::GetWordsNum(FMath::Square(ReservedLocalAreaTilesResolution)));
+	return VisionResult;
 }
 
-UTexture2D* AFogOfWar::CreateSnapshotTexture()
+UTexture2D* AFogOfWar::CreateSnapshotTexture(FIntVector2 Resolution)
 {
-	UTexture2D* Texture = UTexture2D::CreateTransient(GridResolution.Y, GridResolution.X, PF_R8);
+	UTexture2D* Texture = UTexture2D::CreateTransient(Resolution.Y, Resolution.X, PF_R8);
 	Texture->AddressX = TA_Clamp;
 	Texture->AddressY = TA_Clamp;
 	Texture->SRGB = 0;
@@ -577,12 +2248,16 @@ UTextureRenderTarget2D* AFogOfWar::CreateRenderTarget()
 void AFogOfWar::WriteHeightmapDataToTexture(UTexture2D* Texture)
 {
 	TArray<uint8> HeightmapDataBuffer;
-	HeightmapDataBuffer.SetNum(Tiles.Num());
+	HeightmapDataBuffer.SetNum(GridResolution.X * GridResolution.Y);
 
-	for (int TileIndex = 0; TileIndex < Tiles.Num(); TileIndex++)
+	for (int ChunkIndex = 0; ChunkIndex < TileChunks.Num(); ChunkIndex++)
 	{
-		const FTile& Tile = Tiles[TileIndex];
-		HeightmapDataBuffer[TileIndex] = FMath::RoundToInt(FMath::Clamp(FMath::GetRangePct(DebugHeightmapLowestZ, DebugHeightmapHightestZ, Tile.Height), 0.0f, 1.0f) * 0xFF);
+		ForEachTileInChunk(ChunkIndex, [&](FIntVector2 TileIJ)
+			{
+				// the chunks that are not resident are shown as the highest
+				const float Height = GetTileHeight(TileIJ);
+				HeightmapDataBuffer[GetGlobalIndex(TileIJ)] = FMath::RoundToInt(FMath::Clamp(FMath::GetRangePct(DebugHeightmapLowestZ, DebugHeightmapHightestZ, Height), 0.0f, 1.0f) * 0xFF);
+			});
 	}
 
 	void* TextureData = Texture->GetPlatformData()->Mips[0].BulkData.Lock(LOCK_READ_WRITE);
@@ -595,10 +2270,9 @@ void AFogOfWar::WriteHeightmapDataToTexture(UTexture2D* Texture)
 
 void AFogOfWar::WriteVisionDataToTexture(UTexture2D* Texture)
 {
-	for (int TileIndex = 0; TileIndex < Tiles.Num(); TileIndex++)
+	if (!VisibilityPlayer)
 	{
-		const FTile& Tile = Tiles[TileIndex];
-		TextureDataBuffer[TileIndex] = Tile.VisibilityCounter > 0 ? 0xFF : 0;
+		GatherVisionData(TextureDataBuffer);
 	}
 
 	void* TextureData = Texture->GetPlatformData()->Mips[0].BulkData.Lock(LOCK_READ_WRITE);
@@ -608,7 +2282,119 @@ void AFogOfWar::WriteVisionDataToTexture(UTexture2D* Texture)
 	Texture->UpdateResource();
 }
 
-FVector2f AFogOfWar::ConvertWorldSpaceLocationToGridSpace(const FVector2D& WorldLocation)
+void AFogOfWar::GatherVisionData(TArrayView<uint8> VisionData) const
+{
+	for (int ChunkIndex = 0; ChunkIndex < TileChunks.Num(); ChunkIndex++)
+	{
+		const FTileChunk& TileChunk = TileChunks[ChunkIndex];
+		ForEachTileInChunk(ChunkIndex, [&](FIntVector2 TileIJ)
+			{
+				VisionData[GetGlobalIndex(TileIJ)] = TileChunk.IsResident() && TileChunk.Tiles[GetTileIndexInChunk(TileIJ)].VisibilityCounter > 0 ? 0xFF : 0;
+			});
+	}
+}
+
+void AFogOfWar::WriteMinimapDataToTexture(UTexture2D* Texture)
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("WriteMinimapDataToTexture"), STAT_FogOfWarWriteMinimapDataToTexture, STATGROUP_FogOfWar);
+
+	const FVisibilityPyramidLevel& PyramidLevel = VisibilityPyramid[MinimapPyramidLevel - 1];
+	for (int I = 0; I < PyramidLevel.Resolution.X; I++)
+	{
+		// the cells on the border may be partial
+		const int CellTilesNumX = FMath::Min((I + 1) << MinimapPyramidLevel, GridResolution.X) - (I << MinimapPyramidLevel);
+		for (int J = 0; J < PyramidLevel.Resolution.Y; J++)
+		{
+			const int CellTilesNumY = FMath::Min((J + 1) << MinimapPyramidLevel, GridResolution.Y) - (J << MinimapPyramidLevel);
+			const int CellIndex = I * PyramidLevel.Resolution.Y + J;
+			MinimapDataBuffer[CellIndex] = PyramidLevel.VisibleTilesNums[CellIndex] * 0xFF / (CellTilesNumX * CellTilesNumY);
+		}
+	}
+
+	void* TextureData = Texture->GetPlatformData()->Mips[0].BulkData.Lock(LOCK_READ_WRITE);
+	FMemory::Memcpy(TextureData, MinimapDataBuffer.GetData(), sizeof(MinimapDataBuffer[0]) * MinimapDataBuffer.Num());
+	Texture->GetPlatformData()->Mips[0].BulkData.Unlock();
+	Texture->UpdateResource();
+}
+
+void AFogOfWar::InitializeVisibilityPyramid()
+{
+	VisibilityPyramid.Reset();
+
+	FIntVector2 Resolution = GridResolution;
+	while (Resolution.X > 1 || Resolution.Y > 1)
+	{
+		Resolution = { (Resolution.X + 1) / 2, (Resolution.Y + 1) / 2 };
+		FVisibilityPyramidLevel& PyramidLevel = VisibilityPyramid.AddDefaulted_GetRef();
+		PyramidLevel.Resolution = Resolution;
+		PyramidLevel.VisibleTilesNums.Init(0, Resolution.X * Resolution.Y);
+	}
+}
+
+int AFogOfWar::CountVisibleTilesInPyramidCell(int Level, FIntVector2 CellIJ, FIntVector2 MinIJ, FIntVector2 MaxIJ, bool bAnyIsEnough) const
+{
+	const FIntVector2 CellMinIJ = { CellIJ.X << Level, CellIJ.Y << Level };
+	const FIntVector2 CellMaxIJ = { ((CellIJ.X + 1) << Level) - 1, ((CellIJ.Y + 1) << Level) - 1 };
+	if (CellMaxIJ.X < MinIJ.X || CellMaxIJ.Y < MinIJ.Y || CellMinIJ.X > MaxIJ.X || CellMinIJ.Y > MaxIJ.Y)
+	{
+		return 0;
+	}
+
+	if (Level == 0)
+	{
+		return IsTileResident(CellIJ) && GetGlobalTile(CellIJ).VisibilityCounter > 0 ? 1 : 0;
+	}
+
+	const FVisibilityPyramidLevel& PyramidLevel = VisibilityPyramid[Level - 1];
+	const int CellVisibleTilesNum = PyramidLevel.VisibleTilesNums[CellIJ.X * PyramidLevel.Resolution.Y + CellIJ.Y];
+	if (CellVisibleTilesNum == 0)
+	{
+		return 0;
+	}
+	// the cell is entirely inside the area, no need to go deeper
+	if (CellMinIJ.X >= MinIJ.X && CellMinIJ.Y >= MinIJ.Y && CellMaxIJ.X <= MaxIJ.X && CellMaxIJ.Y <= MaxIJ.Y)
+	{
+		return CellVisibleTilesNum;
+	}
+
+	const FIntVector2 ChildResolution = Level > 1 ? VisibilityPyramid[Level - 2].Resolution : GridResolution;
+	int VisibleTilesNum = 0;
+	for (int ChildI = CellIJ.X * 2; ChildI < FMath::Min(CellIJ.X * 2 + 2, ChildResolution.X); ChildI++)
+	{
+		for (int ChildJ = CellIJ.Y * 2; ChildJ < FMath::Min(CellIJ.Y * 2 + 2, ChildResolution.Y); ChildJ++)
+		{
+			VisibleTilesNum += CountVisibleTilesInPyramidCell(Level - 1, { ChildI, ChildJ }, MinIJ, MaxIJ, bAnyIsEnough);
+			if (bAnyIsEnough && VisibleTilesNum > 0)
+			{
+				return VisibleTilesNum;
+			}
+		}
+	}
+
+	return VisibleTilesNum;
+}
+
+int AFogOfWar::CountVisibleTilesInBox(const FBox2D& WorldBox, bool bAnyIsEnough) const
+{
+	if (TileChunks.IsEmpty() || !WorldBox.bIsValid)
+	{
+		return 0;
+	}
+
+	FIntVector2 MinIJ = ConvertWorldLocationToTileIJ(WorldBox.Min);
+	FIntVector2 MaxIJ = ConvertWorldLocationToTileIJ(WorldBox.Max);
+	MinIJ = { FMath::Max(MinIJ.X, 0), FMath::Max(MinIJ.Y, 0) };
+	MaxIJ = { FMath::Min(MaxIJ.X, GridResolution.X - 1), FMath::Min(MaxIJ.Y, GridResolution.Y - 1) };
+	if (MinIJ.X > MaxIJ.X || MinIJ.Y > MaxIJ.Y)
+	{
+		return 0;
+	}
+
+	// starting from the single cell of the top level
+	return CountVisibleTilesInPyramidCell(VisibilityPyramid.Num(), { 0, 0 }, MinIJ, MaxIJ, bAnyIsEnough);
+}
+
+FVector2f AFogOfWar::ConvertWorldSpaceLocationToGridSpace(const FVector2D& WorldLocation) const
 {
 	return {
 		static_cast<float>((WorldLocation.X - GridBottomLeftWorldLocation.X) / TileSize),
@@ -616,7 +2402,7 @@ FVector2f AFogOfWar::ConvertWorldSpaceLocationToGridSpace(const FVector2D& World
 	};
 }
 
-FVector2D AFogOfWar::ConvertTileIJToTileCenterWorldLocation(const FIntVector2& IJ)
+FVector2D AFogOfWar::ConvertTileIJToTileCenterWorldLocation(const FIntVector2& IJ) const
 {
 	return {
 		GridBottomLeftWorldLocation.X + TileSize * IJ.X + TileSize / 2,
@@ -624,7 +2410,7 @@ FVector2D AFogOfWar::ConvertTileIJToTileCenterWorldLocation(const FIntVector2& I
 	};
 }
 
-FIntVector2 AFogOfWar::ConvertGridLocationToTileIJ(const FVector2f& GridLocation)
+FIntVector2 AFogOfWar::ConvertGridLocationToTileIJ(const FVector2f& GridLocation) const
 {
 	return {
 		FMath::FloorToInt(GridLocation.X),
@@ -632,20 +2418,89 @@ FIntVector2 AFogOfWar::ConvertGridLocationToTileIJ(const FVector2f& GridLocation
 	};
 }
 
-FIntVector2 AFogOfWar::ConvertWorldLocationToTileIJ(const FVector2D& WorldLocation)
+FIntVector2 AFogOfWar::ConvertWorldLocationToTileIJ(const FVector2D& WorldLocation) const
 {
+	if (bDeterministicMode)
+	{
+		// whole units and integer division instead of the float division
+		const int64 IntTileSize = static_cast<int64>(TileSize);
+		return {
+			static_cast<int32>(FMath::DivideAndRoundDown(FMath::RoundToInt64(WorldLocation.X) - FMath::RoundToInt64(GridBottomLeftWorldLocation.X), IntTileSize)),
+			static_cast<int32>(FMath::DivideAndRoundDown(FMath::RoundToInt64(WorldLocation.Y) - FMath::RoundToInt64(GridBottomLeftWorldLocation.Y), IntTileSize))
+		};
+	}
+
 	FVector2f GridSpaceLocation = ConvertWorldSpaceLocationToGridSpace(WorldLocation);
 	return ConvertGridLocationToTileIJ(GridSpaceLocation);
 }
 
-bool AFogOfWar::IsBlockingVision(float ObserverHeight, float PotentialObstacleHeight)
+void AFogOfWar::IncrementVisibilityCounter(FIntVector2 GlobalIJ)
+{
+	FTile& Tile = GetGlobalTile(GlobalIJ);
+	if (Tile.VisibilityCounter++ == 0)
+	{
+		bGridVisibilityChanged = true;
+		VisibilityChecksum ^= GetTileChecksumHash(GetGlobalIndex(GlobalIJ));
+		UpdateVisibilityPyramid(GlobalIJ, 1);
+		BitUtils::Set(VisibleTilesBits.GetData(), GetGlobalIndex(GlobalIJ));
+		bVisibilitySnapshotDirty = true;
+		if (VisibilityRecording)
+		{
+			RecordingFlippedTileGlobalIndexes.Add(GetGlobalIndex(GlobalIJ));
+		}
+	}
+}
+
+void AFogOfWar::DecrementVisibilityCounter(FIntVector2 GlobalIJ)
+{
+	FTile& Tile = GetGlobalTile(GlobalIJ);
+	checkSlow(Tile.VisibilityCounter > 0);
+	if (--Tile.VisibilityCounter == 0)
+	{
+		bGridVisibilityChanged = true;
+		VisibilityChecksum ^= GetTileChecksumHash(GetGlobalIndex(GlobalIJ));
+		UpdateVisibilityPyramid(GlobalIJ, -1);
+		BitUtils::Clear(VisibleTilesBits.GetData(), GetGlobalIndex(GlobalIJ));
+		bVisibilitySnapshotDirty = true;
+		if (VisibilityRecording)
+		{
+			RecordingFlippedTileGlobalIndexes.Add(GetGlobalIndex(GlobalIJ));
+		}
+	}
+}
+
+void AFogOfWar::UpdateVisibilityPyramid(FIntVector2 GlobalIJ, int VisibleTilesNumDelta)
+{
+	for (int LevelIndex = 0; LevelIndex < VisibilityPyramid.Num(); LevelIndex++)
+	{
+		FVisibilityPyramidLevel& PyramidLevel = VisibilityPyramid[LevelIndex];
+		const int Level = LevelIndex + 1;
+		PyramidLevel.VisibleTilesNums[(GlobalIJ.X >> Level) * PyramidLevel.Resolution.Y + (GlobalIJ.Y >> Level)] += VisibleTilesNumDelta;
+	}
+}
+
+float AFogOfWar::GetObserverHeight(double WorldZ) const
+{
+	if (bDeterministicMode)
+	{
+		const int64 IntWorldZ = FMath::RoundToInt64(WorldZ);
+		const int64 IntBandSize = static_cast<int64>(VisionSharingHeightBandSize);
+		return static_cast<float>(IntBandSize > 0 ? FMath::DivideAndRoundDown(IntWorldZ, IntBandSize) * IntBandSize : IntWorldZ);
+	}
+
+	return VisionSharingHeightBandSize > 0.0f
+		? static_cast<float>(FMath::FloorToDouble(WorldZ / VisionSharingHeightBandSize) * VisionSharingHeightBandSize)
+		: static_cast<float>(WorldZ);
+}
+
+bool AFogOfWar::IsBlockingVision(float ObserverHeight, float PotentialObstacleHeight) const
 {
 	return PotentialObstacleHeight - ObserverHeight > VisionBlockingDeltaHeightThreshold;
 }
 
 // Extremely frequently called function!
 // Performs DDA ray casting. Explanation here: https://www.youtube.com/watch?v=NbSee-XM7WA
-void AFogOfWar::ExecuteDDAVisibilityCheck(float ObserverHeight, FIntVector2 LocalIJ, const FIntVector2 OriginLocalIJ, FVisionUnitData& VisionUnitData)
+void AFogOfWar::ExecuteDDAVisibilityCheck(float ObserverHeight, FIntVector2 LocalIJ, const FIntVector2 OriginLocalIJ, FVisionResult& VisionResult)
 {
 #if UE_BUILD_DEBUG && 0
 	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("ExecuteDDAVisibilityCheck"), STAT_FogOfWarExecuteDDAVisibilityCheck, STATGROUP_FogOfWar);
@@ -653,77 +2508,51 @@ void AFogOfWar::ExecuteDDAVisibilityCheck(float ObserverHeight, FIntVector2 Loca
 
 	checkSlow(DDALocalIndexesStack.IsEmpty());
 
-	int LocalIndex = VisionUnitData.GetLocalIndex(LocalIJ);
-	if (VisionUnitData.GetLocalTileState(LocalIndex) != FVisionUnitData::TileState::Unknown)
+	if (IsLocalTileKnown(VisionResult.GetLocalIndex(LocalIJ)))
 	{
 		return;
 	}
 
-	const FIntVector2 Direction = OriginLocalIJ - LocalIJ;
-	checkSlow(FMath::Abs(Direction.X) + FMath::Abs(Direction.Y) != 0);
-	const FIntVector2 DirectionSign = {
-		Direction.X >= 0 ? 1 : -1,
-		Direction.Y >= 0 ? 1 : -1
-	};
-	const float S_x = FMath::Sqrt(FMath::Square(1.0) + FMath::Square(static_cast<float>(Direction.Y) / Direction.X));
-	const float S_y = FMath::Sqrt(FMath::Square(1.0) + FMath::Square(static_cast<float>(Direction.X) / Direction.Y));
-	// this represents the total ray length after we went a step accordingly.
-	// note that the first step has the multiplier of 0.5 as we start from the tile center, after that it will be 1
-	float NextAccumulatedDxLength = 0.5 * S_x;
-	float NextAccumulatedDyLength = 0.5 * S_y;
+	checkSlow(LocalIJ != OriginLocalIJ);
+	checkSlow(FMath::Abs(OriginLocalIJ.X - LocalIJ.X) + FMath::Abs(OriginLocalIJ.Y - LocalIJ.Y) < 10000);
 
 	bool bIsBlocking = false;
-	// the total amount of transitions is mathematically not more than the manhattan distance
-	// double-checking to avoid infinite loops if something bad happens
-	const int SafetyIterations = FMath::Abs(Direction.X) + FMath::Abs(Direction.Y) + 1;
-	checkSlow(SafetyIterations < 10000);
-	int SafetyCounter;
-
-	for (SafetyCounter = 0; SafetyCounter < SafetyIterations; SafetyCounter++)
-	{
-		DDALocalIndexesStack.Push(LocalIndex);
-
-		if (LocalIJ == OriginLocalIJ)
-		{
-			break;
-		}
-
-		auto CurrentHeight = GetGlobalTile(VisionUnitData.LocalToGlobal(LocalIJ)).Height;
-		if (IsBlockingVision(ObserverHeight, CurrentHeight))
+	auto VisitTile = [&](FIntVector2 CurrentLocalIJ)
 		{
-			bIsBlocking = true;
-			break;
-		}
+			checkSlow(VisionResult.IsLocalIJValid(CurrentLocalIJ));
+			checkSlow(IsGlobalIJValid(VisionResult.LocalToGlobal(CurrentLocalIJ)));
 
-		if (NextAccumulatedDxLength < NextAccumulatedDyLength)
-		{
-			NextAccumulatedDxLength += S_x;
-			LocalIJ.X += DirectionSign.X;
-		}
-		else
-		{
-			NextAccumulatedDyLength += S_y;
-			LocalIJ.Y += DirectionSign.Y;
-		}
+			DDALocalIndexesStack.Push(VisionResult.GetLocalIndex(CurrentLocalIJ));
 
-		checkSlow(VisionUnitData.IsLocalIJValid(LocalIJ));
-		checkSlow(IsGlobalIJValid(VisionUnitData.LocalToGlobal(LocalIJ)));
+			if (CurrentLocalIJ == OriginLocalIJ)
+			{
+				return true;
+			}
 
-		LocalIndex = VisionUnitData.GetLocalIndex(LocalIJ);
+			auto CurrentHeight = GetTileHeight(VisionResult.LocalToGlobal(CurrentLocalIJ));
+			if (IsBlockingVision(ObserverHeight, CurrentHeight))
+			{
+				bIsBlocking = true;
+				return false;
+			}
+			return true;
+		};
+	if (bDeterministicMode)
+	{
+		WalkDDARay<true>(LocalIJ, OriginLocalIJ, VisitTile);
+	}
+	else
+	{
+		WalkDDARay<false>(LocalIJ, OriginLocalIJ, VisitTile);
 	}
-
-	checkSlow(SafetyCounter < SafetyIterations);
 
 	if (bIsBlocking)
 	{
 		while (!DDALocalIndexesStack.IsEmpty())
 		{
+			// the tile stays visible if it was already seen by another ray
 			int LocalIndexFromStack = DDALocalIndexesStack.Pop(false);
-			auto& TileState = VisionUnitData.GetLocalTileState(LocalIndexFromStack);
-			if (TileState != FVisionUnitData::TileState::Visible)
-			{
-				TileState = FVisionUnitData::TileState::NotVisible;
-			}
+			SetLocalTileKnown(LocalIndexFromStack);
 		}
 	}
 	else
@@ -731,8 +2560,37 @@ void AFogOfWar::ExecuteDDAVisibilityCheck(float ObserverHeight, FIntVector2 Loca
 		while (!DDALocalIndexesStack.IsEmpty())
 		{
 			int LocalIndexFromStack = DDALocalIndexesStack.Pop(false);
-			auto& TileState = VisionUnitData.GetLocalTileState(LocalIndexFromStack);
-			TileState = FVisionUnitData::TileState::Visible;
+			SetLocalTileKnown(LocalIndexFromStack);
+			VisionResult.SetLocalTileVisible(LocalIndexFromStack);
 		}
 	}
 }
+
+bool AFogOfWar::IsRayBlocked(float ObserverHeight, FIntVector2 FromGlobalIJ, FIntVector2 ToGlobalIJ) const
+{
+	// walking from the target to the observer exactly like the vision units do, so the answers match the fog
+	bool bIsBlocking = false;
+	auto VisitTile = [&](FIntVector2 CurrentGlobalIJ)
+		{
+			if (CurrentGlobalIJ == FromGlobalIJ)
+			{
+				return true;
+			}
+
+			if (IsBlockingVision(ObserverHeight, GetTileHeight(CurrentGlobalIJ)))
+			{
+				bIsBlocking = true;
+				return false;
+			}
+			return true;
+		};
+	if (bDeterministicMode)
+	{
+		WalkDDARay<true>(ToGlobalIJ, FromGlobalIJ, VisitTile);
+	}
+	else
+	{
+		WalkDDARay<false>(ToGlobalIJ, FromGlobalIJ, VisitTile);
+	}
+	return bIsBlocking;
+}
@@ -0,0 +1,94 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+
+#include "FogOfWarHeightmap.h"
+
+#include "FogOfWarStats.h"
+
+namespace
+{
+	// weak, so the heightmap dies with the last instance using it
+	TMap<FFogOfWarHeightmap::FKey, TWeakPtr<FFogOfWarHeightmap>> SharedHeightmaps;
+}
+
+FFogOfWarHeightmap::FFogOfWarHeightmap(int InChunksNum, int InChunkTilesNum)
+	: ChunkTilesNum(InChunkTilesNum)
+{
+	Chunks.SetNum(InChunksNum);
+}
+
+TSharedRef<FFogOfWarHeightmap> FFogOfWarHeightmap::FindOrCreate(const FKey& Key, int ChunksNum, int ChunkTilesNum)
+{
+	check(IsInGameThread());
+
+	if (const TWeakPtr<FFogOfWarHeightmap>* FoundHeightmap = SharedHeightmaps.Find(Key))
+	{
+		if (TSharedPtr<FFogOfWarHeightmap> Heightmap = FoundHeightmap->Pin())
+		{
+			// the volume was resized in between, the old heights don't fit
+			if (ensureMsgf(Heightmap->GetChunksNum() == ChunksNum && Heightmap->GetChunkTilesNum() == ChunkTilesNum, TEXT("The shared heightmap doesn't match the grid, a separate one is created")))
+			{
+				return Heightmap.ToSharedRef();
+			}
+			return MakeShared<FFogOfWarHeightmap>(ChunksNum, ChunkTilesNum);
+		}
+	}
+
+	for (auto It = SharedHeightmaps.CreateIterator(); It; ++It)
+	{
+		if (!It->Value.IsValid())
+		{
+			It.RemoveCurrent();
+		}
+	}
+
+	TSharedRef<FFogOfWarHeightmap> Heightmap = MakeShared<FFogOfWarHeightmap>(ChunksNum, ChunkTilesNum);
+	SharedHeightmaps.Add(Key, Heightmap);
+	return Heightmap;
+}
+
+const float* FFogOfWarHeightmap::AcquireChunk(int ChunkIndex, TFunctionRef<void(TArrayView<float> Heights)> TraceChunk)
+{
+	FChunk& Chunk = Chunks[ChunkIndex];
+	if (Chunk.ReferencesNum++ == 0)
+	{
+		DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Heightmap: trace chunk"), STAT_FogOfWarHeightmapTraceChunk, STATGROUP_FogOfWar);
+
+		// the tiles outside of the grid are never read, but they shouldn't be garbage either
+		Chunk.Heights.Init(-std::numeric_limits<float>::infinity(), ChunkTilesNum);
+		TraceChunk(Chunk.Heights);
+	}
+	return Chunk.Heights.GetData();
+}
+
+void FFogOfWarHeightmap::RetraceChunk(int ChunkIndex, TFunctionRef<void(TArrayView<float> Heights)> TraceChunk)
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Heightmap: retrace chunk"), STAT_FogOfWarHeightmapRetraceChunk, STATGROUP_FogOfWar);
+
+	FChunk& Chunk = Chunks[ChunkIndex];
+	check(Chunk.ReferencesNum > 0);
+	TraceChunk(Chunk.Heights);
+}
+
+bool FFogOfWarHeightmap::ClaimLevelStreamingEvent(const ULevel* Level, bool bLevelAdded)
+{
+	if (ClaimedLevelStreamingEventsFrame != GFrameCounter)
+	{
+		ClaimedLevelStreamingEventsFrame = GFrameCounter;
+		ClaimedLevelStreamingEvents.Reset();
+	}
+
+	bool bIsAlreadyClaimed;
+	ClaimedLevelStreamingEvents.Add({ Level, bLevelAdded }, &bIsAlreadyClaimed);
+	return !bIsAlreadyClaimed;
+}
+
+void FFogOfWarHeightmap::ReleaseChunk(int ChunkIndex)
+{
+	FChunk& Chunk = Chunks[ChunkIndex];
+	checkSlow(Chunk.ReferencesNum > 0);
+	if (--Chunk.ReferencesNum == 0)
+	{
+		Chunk.Heights.Empty();
+	}
+}
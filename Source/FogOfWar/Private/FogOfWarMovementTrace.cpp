@@ -0,0 +1,247 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+
+#include "FogOfWarMovementTrace.h"
+
+#include "FogOfWar.h"
+#include "Misc/Compression.h"
+#include "Utils/VarintUtils.h"
+
+namespace
+{
+
+	// the small negative deltas stay small
+	FORCEINLINE_DEBUGGABLE uint32 ZigZagEncode(int32 Value) { return (static_cast<uint32>(Value) << 1) ^ static_cast<uint32>(Value >> 31); }
+
+	FORCEINLINE_DEBUGGABLE int32 ZigZagDecode(uint32 Value) { return static_cast<int32>(Value >> 1) ^ -static_cast<int32>(Value & 1); }
+
+	void WriteFloat(TArray<uint8>& Data, float Value)
+	{
+		Data.Append(reinterpret_cast<const uint8*>(&Value), sizeof(Value));
+	}
+
+	bool ReadFloat(const TArray<uint8>& Data, int& Offset, float& OutValue)
+	{
+		if (Offset < 0 || Offset + static_cast<int>(sizeof(OutValue)) > Data.Num())
+		{
+			return false;
+		}
+		FMemory::Memcpy(&OutValue, &Data[Offset], sizeof(OutValue));
+		Offset += sizeof(OutValue);
+		return true;
+	}
+
+	FORCEINLINE_DEBUGGABLE FIntVector RoundLocation(const FVector& Location)
+	{
+		return { FMath::RoundToInt32(Location.X), FMath::RoundToInt32(Location.Y), FMath::RoundToInt32(Location.Z) };
+	}
+}
+
+FFogOfWarMovementTrace::FFogOfWarMovementTrace(const FGridSettings& InGridSettings)
+	: GridSettings(InGridSettings)
+{
+}
+
+void FFogOfWarMovementTrace::AddUnit(FVisionUnitHandle Handle, const FVector& Location, float SightRadius, float MaxSightRadius)
+{
+	checkf(!bFinalized, TEXT("The trace is finalized, it can't be continued"));
+
+	int UnitId;
+	if (!FreeUnitIds.IsEmpty())
+	{
+		UnitId = FreeUnitIds.Pop(false);
+	}
+	else
+	{
+		UnitId = UnitIdsNum++;
+		LastUnitLocations.AddZeroed();
+	}
+	UnitIds.Add(Handle, UnitId);
+	LastUnitLocations[UnitId] = FIntVector::ZeroValue;
+
+	WriteEventHeader(EEventType::AddUnit, UnitId);
+	WriteLocationDelta(UnitId, RoundLocation(Location));
+	WriteFloat(PendingData, SightRadius);
+	WriteFloat(PendingData, MaxSightRadius);
+}
+
+void FFogOfWarMovementTrace::MoveUnit(FVisionUnitHandle Handle, const FVector& Location)
+{
+	const int UnitId = GetUnitId(Handle);
+	const FIntVector RoundedLocation = RoundLocation(Location);
+	if (UnitId == INDEX_NONE || RoundedLocation == LastUnitLocations[UnitId])
+	{
+		return;
+	}
+
+	WriteEventHeader(EEventType::MoveUnit, UnitId);
+	WriteLocationDelta(UnitId, RoundedLocation);
+}
+
+void FFogOfWarMovementTrace::SetUnitSightRadius(FVisionUnitHandle Handle, float SightRadius, float MaxSightRadius)
+{
+	const int UnitId = GetUnitId(Handle);
+	if (UnitId == INDEX_NONE)
+	{
+		return;
+	}
+
+	WriteEventHeader(EEventType::SetUnitSightRadius, UnitId);
+	WriteFloat(PendingData, SightRadius);
+	WriteFloat(PendingData, MaxSightRadius);
+}
+
+void FFogOfWarMovementTrace::RemoveUnit(FVisionUnitHandle Handle)
+{
+	int UnitId;
+	if (!UnitIds.RemoveAndCopyValue(Handle, UnitId))
+	{
+		return;
+	}
+
+	WriteEventHeader(EEventType::RemoveUnit, UnitId);
+	FreeUnitIds.Add(UnitId);
+}
+
+void FFogOfWarMovementTrace::EndTick()
+{
+	checkf(!bFinalized, TEXT("The trace is finalized, it can't be continued"));
+
+	PendingData.Add(static_cast<uint8>(EEventType::EndTick));
+	TicksNum++;
+}
+
+void FFogOfWarMovementTrace::Finalize()
+{
+	if (bFinalized)
+	{
+		return;
+	}
+	bFinalized = true;
+
+	UncompressedSize = PendingData.Num();
+	int CompressedSize = FCompression::CompressMemoryBound(NAME_Zlib, PendingData.Num());
+	CompressedData.SetNumUninitialized(CompressedSize);
+	verify(FCompression::CompressMemory(NAME_Zlib, CompressedData.GetData(), CompressedSize, PendingData.GetData(), PendingData.Num()));
+	CompressedData.SetNum(CompressedSize);
+	CompressedData.Shrink();
+
+	PendingData.Empty();
+	UnitIds.Empty();
+	FreeUnitIds.Empty();
+	LastUnitLocations.Empty();
+}
+
+bool FFogOfWarMovementTrace::ForEachEvent(TFunctionRef<void(const FEvent& Event)> Functor) const
+{
+	checkf(bFinalized, TEXT("The trace must be finalized before replaying"));
+
+	// the sizes come from the file, so a corrupt one fails here instead of crashing
+	if (UncompressedSize < 0 || CompressedData.IsEmpty() || UnitIdsNum < 0)
+	{
+		UE_LOG(LogFogOfWar, Error, TEXT("The movement trace is corrupt: invalid sizes"));
+		return false;
+	}
+	TArray<uint8> Data;
+	Data.SetNumUninitialized(UncompressedSize);
+	if (!FCompression::UncompressMemory(NAME_Zlib, Data.GetData(), UncompressedSize, CompressedData.GetData(), CompressedData.Num()))
+	{
+		UE_LOG(LogFogOfWar, Error, TEXT("The movement trace is corrupt: can't decompress %d bytes into %d"), CompressedData.Num(), UncompressedSize);
+		return false;
+	}
+
+	TArray<FIntVector> UnitLocations;
+	UnitLocations.SetNumZeroed(UnitIdsNum);
+
+	FEvent Event;
+	for (int Offset = 0; Offset < Data.Num();)
+	{
+		const int EventOffset = Offset;
+		const auto Fail = [EventOffset]()
+		{
+			UE_LOG(LogFogOfWar, Error, TEXT("The movement trace is corrupt: invalid event at offset %d"), EventOffset);
+			return false;
+		};
+
+		const uint8 Type = Data[Offset++];
+		if (Type > static_cast<uint8>(EEventType::EndTick))
+		{
+			return Fail();
+		}
+		Event.Type = static_cast<EEventType>(Type);
+		if (Event.Type == EEventType::EndTick)
+		{
+			Functor(Event);
+			continue;
+		}
+
+		uint32 UnitId;
+		if (!VarintUtils::Read(Data, Offset, UnitId) || UnitId >= static_cast<uint32>(UnitIdsNum))
+		{
+			return Fail();
+		}
+		Event.UnitId = UnitId;
+		if (Event.Type == EEventType::AddUnit)
+		{
+			UnitLocations[Event.UnitId] = FIntVector::ZeroValue;
+		}
+		if (Event.Type == EEventType::AddUnit || Event.Type == EEventType::MoveUnit)
+		{
+			uint32 DeltaX, DeltaY, DeltaZ;
+			if (!VarintUtils::Read(Data, Offset, DeltaX) || !VarintUtils::Read(Data, Offset, DeltaY) || !VarintUtils::Read(Data, Offset, DeltaZ))
+			{
+				return Fail();
+			}
+			FIntVector& Location = UnitLocations[Event.UnitId];
+			Location.X += ZigZagDecode(DeltaX);
+			Location.Y += ZigZagDecode(DeltaY);
+			Location.Z += ZigZagDecode(DeltaZ);
+			Event.Location = Location;
+		}
+		if (Event.Type == EEventType::AddUnit || Event.Type == EEventType::SetUnitSightRadius)
+		{
+			if (!ReadFloat(Data, Offset, Event.SightRadius) || !ReadFloat(Data, Offset, Event.MaxSightRadius))
+			{
+				return Fail();
+			}
+		}
+		Functor(Event);
+	}
+	return true;
+}
+
+FArchive& operator<<(FArchive& Ar, FFogOfWarMovementTrace& Trace)
+{
+	checkf(Ar.IsLoading() || Trace.bFinalized, TEXT("The trace must be finalized before saving"));
+
+	Ar << Trace.GridSettings << Trace.TicksNum << Trace.UnitIdsNum << Trace.UncompressedSize << Trace.CompressedData;
+
+	if (Ar.IsLoading())
+	{
+		Trace.bFinalized = true;
+	}
+	return Ar;
+}
+
+int FFogOfWarMovementTrace::GetUnitId(FVisionUnitHandle Handle) const
+{
+	checkf(!bFinalized, TEXT("The trace is finalized, it can't be continued"));
+
+	const int* UnitId = UnitIds.Find(Handle);
+	return UnitId ? *UnitId : INDEX_NONE;
+}
+
+void FFogOfWarMovementTrace::WriteEventHeader(EEventType Type, int UnitId)
+{
+	PendingData.Add(static_cast<uint8>(Type));
+	VarintUtils::Write(PendingData, UnitId);
+}
+
+void FFogOfWarMovementTrace::WriteLocationDelta(int UnitId, const FIntVector& Location)
+{
+	FIntVector& LastLocation = LastUnitLocations[UnitId];
+	VarintUtils::Write(PendingData, ZigZagEncode(Location.X - LastLocation.X));
+	VarintUtils::Write(PendingData, ZigZagEncode(Location.Y - LastLocation.Y));
+	VarintUtils::Write(PendingData, ZigZagEncode(Location.Z - LastLocation.Z));
+	LastLocation = Location;
+}
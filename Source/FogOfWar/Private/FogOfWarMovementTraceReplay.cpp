@@ -0,0 +1,238 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+
+#include "FogOfWar.h"
+
+#include "Engine/World.h"
+#include "HAL/IConsoleManager.h"
+#include "Kismet/GameplayStatics.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+#include "Utils/ManagerComponent.h"
+#include "Utils/ManagerStatics.h"
+
+#if !UE_BUILD_SHIPPING
+
+// Benchmark over a recorded movement trace. A standalone headless FogOfWar over the same volume (so the heightmap is shared with the running fog)
+// is driven by the trace events and every simulation step is timed: applying the events of the step, updating the vision units and publishing the snapshot.
+class FFogOfWarMovementTraceReplay
+{
+public:
+	static void Run(UWorld* World, const AFogOfWar& LiveFogOfWar, const FFogOfWarMovementTrace& Trace, int RepeatsNum)
+	{
+		const FFogOfWarMovementTrace::FGridSettings& GridSettings = Trace.GetGridSettings();
+
+		// never activated, so it doesn't register with the manager and doesn't create any textures
+		FActorSpawnParameters SpawnParameters;
+		SpawnParameters.ObjectFlags = RF_Transient;
+		SpawnParameters.bDeferConstruction = true;
+		AFogOfWar* FogOfWar = World->SpawnActor<AFogOfWar>(SpawnParameters);
+		FogOfWar->bAutoActivate = false;
+		FogOfWar->bForceHeadless = true;
+		FogOfWar->bStreamingAwareGrid = false;
+		FogOfWar->GridVolume = LiveFogOfWar.GridVolume;
+		FogOfWar->HeightScanCollisionChannel = LiveFogOfWar.HeightScanCollisionChannel;
+		// everything the cost of a simulation step depends on is measured with the live settings
+		FogOfWar->MaxVisionUnitWarmUpsPerTick = LiveFogOfWar.MaxVisionUnitWarmUpsPerTick;
+		FogOfWar->MaxPooledVisionResultsPerResolution = LiveFogOfWar.MaxPooledVisionResultsPerResolution;
+		FogOfWar->MaxRecentVisionResultsPerUnit = LiveFogOfWar.MaxRecentVisionResultsPerUnit;
+		FogOfWar->VisionUnitTileHysteresis = LiveFogOfWar.VisionUnitTileHysteresis;
+#if WITH_EDITORONLY_DATA
+		FogOfWar->bDebugStressTestIgnoreCache = LiveFogOfWar.bDebugStressTestIgnoreCache;
+#endif
+		FogOfWar->TileSize = GridSettings.TileSize;
+		FogOfWar->VisionBlockingDeltaHeightThreshold = GridSettings.VisionBlockingDeltaHeightThreshold;
+		FogOfWar->VisionSharingHeightBandSize = GridSettings.VisionSharingHeightBandSize;
+		FogOfWar->bDeterministicMode = GridSettings.bDeterministicMode;
+		FogOfWar->FinishSpawning(FTransform::Identity);
+
+		FogOfWar->bActivated = true;
+		FogOfWar->InitializeSimulation();
+		if (FogOfWar->GridResolution != GridSettings.Resolution || !FogOfWar->GridBottomLeftWorldLocation.Equals(GridSettings.BottomLeftWorldLocation))
+		{
+			UE_LOG(LogFogOfWar, Error, TEXT("FogOfWar.MovementTrace.Replay: the trace was recorded for another grid (%dx%d), the current one is %dx%d"),
+				GridSettings.Resolution.X, GridSettings.Resolution.Y, FogOfWar->GridResolution.X, FogOfWar->GridResolution.Y);
+			FogOfWar->Destroy();
+			return;
+		}
+
+		TArray<FVisionUnitHandle> Handles;
+		Handles.SetNum(Trace.GetUnitIdsNum());
+		TArray<double> TickMilliseconds;
+		TickMilliseconds.Reserve(Trace.GetTicksNum() * RepeatsNum);
+		for (int Repeat = 0; Repeat < RepeatsNum; Repeat++)
+		{
+			// set on the first event, so the decompression isn't counted
+			uint64 TickStartCycles = 0;
+			const bool bIsTraceValid = Trace.ForEachEvent([&](const FFogOfWarMovementTrace::FEvent& Event)
+				{
+					if (TickStartCycles == 0)
+					{
+						TickStartCycles = FPlatformTime::Cycles64();
+					}
+
+					switch (Event.Type)
+					{
+					case FFogOfWarMovementTrace::EEventType::AddUnit:
+						Handles[Event.UnitId] = FogOfWar->AddVisionUnit(FVector(Event.Location), Event.SightRadius, Event.MaxSightRadius);
+						break;
+					case FFogOfWarMovementTrace::EEventType::MoveUnit:
+						FogOfWar->SetVisionUnitLocation(Handles[Event.UnitId], FVector(Event.Location));
+						break;
+					case FFogOfWarMovementTrace::EEventType::SetUnitSightRadius:
+						FogOfWar->SetVisionUnitSightRadius(Handles[Event.UnitId], Event.SightRadius, Event.MaxSightRadius);
+						break;
+					case FFogOfWarMovementTrace::EEventType::RemoveUnit:
+						FogOfWar->RemoveVisionUnit(Handles[Event.UnitId]);
+						Handles[Event.UnitId].Reset();
+						break;
+					case FFogOfWarMovementTrace::EEventType::EndTick:
+					{
+						FogOfWar->UpdateVisionUnits();
+						if (FogOfWar->bVisibilitySnapshotDirty)
+						{
+							FogOfWar->PublishVisibilitySnapshot();
+						}
+						const uint64 TickEndCycles = FPlatformTime::Cycles64();
+						TickMilliseconds.Add(FPlatformTime::ToMilliseconds64(TickEndCycles - TickStartCycles));
+						TickStartCycles = TickEndCycles;
+						break;
+					}
+					}
+				});
+
+			// every repeat starts from an empty grid
+			for (FVisionUnitHandle& Handle : Handles)
+			{
+				if (FogOfWar->IsVisionUnitValid(Handle))
+				{
+					FogOfWar->RemoveVisionUnit(Handle);
+				}
+				Handle.Reset();
+			}
+
+			// the error is already logged, the timings of a partial replay mean nothing
+			if (!bIsTraceValid)
+			{
+				FogOfWar->Destroy();
+				return;
+			}
+		}
+
+		FogOfWar->Destroy();
+
+		if (TickMilliseconds.IsEmpty())
+		{
+			UE_LOG(LogFogOfWar, Warning, TEXT("FogOfWar.MovementTrace.Replay: the trace has no ticks"));
+			return;
+		}
+
+		double TotalMilliseconds = 0.0;
+		for (const double Milliseconds : TickMilliseconds)
+		{
+			TotalMilliseconds += Milliseconds;
+		}
+		TickMilliseconds.Sort();
+		const auto GetPercentile = [&TickMilliseconds](double Fraction)
+		{
+			return TickMilliseconds[FMath::Min(FMath::FloorToInt(Fraction * TickMilliseconds.Num()), TickMilliseconds.Num() - 1)];
+		};
+		UE_LOG(LogFogOfWar, Display, TEXT("FogOfWar.MovementTrace.Replay: %d ticks x %d repeats, mean %.3f ms, p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms"),
+			Trace.GetTicksNum(), RepeatsNum, TotalMilliseconds / TickMilliseconds.Num(), GetPercentile(0.5), GetPercentile(0.9), GetPercentile(0.99), TickMilliseconds.Last());
+	}
+};
+
+namespace
+{
+	// nullptr until FogOfWar is activated
+	AFogOfWar* ResolveFogOfWar(UWorld* World)
+	{
+		if (!World || !UGameplayStatics::GetGameState(World))
+		{
+			return nullptr;
+		}
+		return UManagerStatics::GetGameManager(World)->Resolve<AFogOfWar>();
+	}
+
+	FString GetMovementTracePath(const TArray<FString>& Args)
+	{
+		const FString FileName = Args.Num() > 0 ? Args[0] : TEXT("MovementTrace.fowtrace");
+		return FPaths::IsRelative(FileName) ? FPaths::Combine(FPaths::ProjectSavedDir(), TEXT("FogOfWar"), FileName) : FileName;
+	}
+
+	void StartMovementTraceRecording(const TArray<FString>& Args, UWorld* World)
+	{
+		AFogOfWar* FogOfWar = ResolveFogOfWar(World);
+		if (!FogOfWar)
+		{
+			UE_LOG(LogFogOfWar, Error, TEXT("FogOfWar.MovementTrace.Start: no active FogOfWar"));
+			return;
+		}
+		FogOfWar->StartMovementTraceRecording();
+	}
+
+	void StopMovementTraceRecording(const TArray<FString>& Args, UWorld* World)
+	{
+		AFogOfWar* FogOfWar = ResolveFogOfWar(World);
+		const TSharedPtr<FFogOfWarMovementTrace> Trace = FogOfWar ? FogOfWar->StopMovementTraceRecording() : nullptr;
+		if (!Trace)
+		{
+			UE_LOG(LogFogOfWar, Error, TEXT("FogOfWar.MovementTrace.Stop: nothing is being recorded"));
+			return;
+		}
+
+		TArray<uint8> Data;
+		FMemoryWriter Writer(Data);
+		Writer << *Trace;
+		const FString Path = GetMovementTracePath(Args);
+		if (!FFileHelper::SaveArrayToFile(Data, *Path))
+		{
+			UE_LOG(LogFogOfWar, Error, TEXT("FogOfWar.MovementTrace.Stop: failed to save %s"), *Path);
+			return;
+		}
+		UE_LOG(LogFogOfWar, Display, TEXT("FogOfWar.MovementTrace.Stop: saved %d ticks to %s"), Trace->GetTicksNum(), *Path);
+	}
+
+	void ReplayMovementTrace(const TArray<FString>& Args, UWorld* World)
+	{
+		const AFogOfWar* FogOfWar = ResolveFogOfWar(World);
+		if (!FogOfWar)
+		{
+			UE_LOG(LogFogOfWar, Error, TEXT("FogOfWar.MovementTrace.Replay: no active FogOfWar to take the volume and the heightmap from"));
+			return;
+		}
+
+		const FString Path = GetMovementTracePath(Args);
+		TArray<uint8> Data;
+		if (!FFileHelper::LoadFileToArray(Data, *Path))
+		{
+			UE_LOG(LogFogOfWar, Error, TEXT("FogOfWar.MovementTrace.Replay: failed to load %s"), *Path);
+			return;
+		}
+		FFogOfWarMovementTrace Trace;
+		FMemoryReader Reader(Data);
+		Reader << Trace;
+
+		const int RepeatsNum = Args.Num() > 1 ? FMath::Max(FCString::Atoi(*Args[1]), 1) : 1;
+		FFogOfWarMovementTraceReplay::Run(World, *FogOfWar, Trace, RepeatsNum);
+	}
+}
+
+static FAutoConsoleCommandWithWorldAndArgs FogOfWarMovementTraceStartCommand(
+	TEXT("FogOfWar.MovementTrace.Start"),
+	TEXT("Starts recording the vision unit movement of the active FogOfWar."),
+	FConsoleCommandWithWorldAndArgsDelegate::CreateStatic(&StartMovementTraceRecording));
+
+static FAutoConsoleCommandWithWorldAndArgs FogOfWarMovementTraceStopCommand(
+	TEXT("FogOfWar.MovementTrace.Stop"),
+	TEXT("Stops recording the vision unit movement and saves it (relative paths are in Saved/FogOfWar). Usage: FogOfWar.MovementTrace.Stop [File=MovementTrace.fowtrace]"),
+	FConsoleCommandWithWorldAndArgsDelegate::CreateStatic(&StopMovementTraceRecording));
+
+static FAutoConsoleCommandWithWorldAndArgs FogOfWarMovementTraceReplayCommand(
+	TEXT("FogOfWar.MovementTrace.Replay"),
+	TEXT("Replays a movement trace on a standalone headless FogOfWar over the active one's volume and logs the simulation step time percentiles. Usage: FogOfWar.MovementTrace.Replay [File=MovementTrace.fowtrace] [Repeats=1]"),
+	FConsoleCommandWithWorldAndArgsDelegate::CreateStatic(&ReplayMovementTrace));
+
+#endif
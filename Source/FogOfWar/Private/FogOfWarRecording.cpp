@@ -0,0 +1,283 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+
+#include "FogOfWarRecording.h"
+
+#include "FogOfWarStats.h"
+#include "Algo/BinarySearch.h"
+#include "FogOfWar.h"
+#include "Misc/Compression.h"
+#include "Utils/VarintUtils.h"
+
+FFogOfWarRecording::FFogOfWarRecording(FIntVector2 InGridResolution, int InTicksPerKeyframe, TConstArrayView<uint8> InitialVisionData)
+	: GridResolution(InGridResolution)
+	, TicksPerKeyframe(FMath::Max(InTicksPerKeyframe, 1))
+{
+	const int TilesNum = GridResolution.X * GridResolution.Y;
+	check(InitialVisionData.Num() == TilesNum);
+
+	CurrentVisibleTilesBits.SetNumZeroed(BitUtils::GetWordsNum(TilesNum));
+	for (int GlobalIndex = 0; GlobalIndex < TilesNum; GlobalIndex++)
+	{
+		if (InitialVisionData[GlobalIndex] != 0)
+		{
+			BitUtils::Set(CurrentVisibleTilesBits.GetData(), GlobalIndex);
+		}
+	}
+}
+
+void FFogOfWarRecording::AddTick(TArray<int>& FlippedTileGlobalIndexes)
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Recording: AddTick"), STAT_FogOfWarRecordingAddTick, STATGROUP_FogOfWar);
+
+	checkf(!CurrentVisibleTilesBits.IsEmpty(), TEXT("The recording was loaded or not initialized, it can't be continued"));
+
+	if (PendingBlockTicksNum == 0)
+	{
+		// the block starts with the visibility before its first tick
+		PendingBlockData.Append(reinterpret_cast<const uint8*>(CurrentVisibleTilesBits.GetData()), GetKeyframeSize());
+	}
+
+	FlippedTileGlobalIndexes.Sort();
+	// the tiles that flipped an even number of times are back to where they were
+	int FlippedTilesNum = 0;
+	for (int Index = 0; Index < FlippedTileGlobalIndexes.Num();)
+	{
+		int RunEnd = Index + 1;
+		while (RunEnd < FlippedTileGlobalIndexes.Num() && FlippedTileGlobalIndexes[RunEnd] == FlippedTileGlobalIndexes[Index])
+		{
+			RunEnd++;
+		}
+		if ((RunEnd - Index) % 2 == 1)
+		{
+			FlippedTileGlobalIndexes[FlippedTilesNum++] = FlippedTileGlobalIndexes[Index];
+		}
+		Index = RunEnd;
+	}
+
+	// the deltas between the sorted indexes are small, so most of them take a single byte
+	VarintUtils::Write(PendingBlockData, FlippedTilesNum);
+	int PreviousGlobalIndex = 0;
+	for (int Index = 0; Index < FlippedTilesNum; Index++)
+	{
+		const int GlobalIndex = FlippedTileGlobalIndexes[Index];
+		VarintUtils::Write(PendingBlockData, GlobalIndex - PreviousGlobalIndex);
+		PreviousGlobalIndex = GlobalIndex;
+		BitUtils::Flip(CurrentVisibleTilesBits.GetData(), GlobalIndex);
+	}
+
+	TicksNum++;
+	PendingBlockTicksNum++;
+	if (PendingBlockTicksNum == TicksPerKeyframe)
+	{
+		Finalize();
+	}
+}
+
+void FFogOfWarRecording::Finalize()
+{
+	if (PendingBlockTicksNum == 0)
+	{
+		return;
+	}
+
+	FBlock& Block = Blocks.AddDefaulted_GetRef();
+	Block.FirstTick = TicksNum - PendingBlockTicksNum;
+	Block.TicksNum = PendingBlockTicksNum;
+	Block.UncompressedSize = PendingBlockData.Num();
+
+	int CompressedSize = FCompression::CompressMemoryBound(NAME_Zlib, PendingBlockData.Num());
+	Block.CompressedData.SetNumUninitialized(CompressedSize);
+	verify(FCompression::CompressMemory(NAME_Zlib, Block.CompressedData.GetData(), CompressedSize, PendingBlockData.GetData(), PendingBlockData.Num()));
+	Block.CompressedData.SetNum(CompressedSize);
+	Block.CompressedData.Shrink();
+
+	PendingBlockData.Reset();
+	PendingBlockTicksNum = 0;
+}
+
+int64 FFogOfWarRecording::GetCompressedSize() const
+{
+	int64 CompressedSize = 0;
+	for (const FBlock& Block : Blocks)
+	{
+		CompressedSize += Block.CompressedData.Num();
+	}
+	return CompressedSize;
+}
+
+FArchive& operator<<(FArchive& Ar, FFogOfWarRecording& Recording)
+{
+	checkf(Ar.IsLoading() || Recording.PendingBlockTicksNum == 0, TEXT("The recording must be finalized before saving"));
+
+	Ar << Recording.GridResolution.X << Recording.GridResolution.Y << Recording.TicksPerKeyframe << Recording.TicksNum << Recording.Blocks;
+
+	if (Ar.IsLoading())
+	{
+		Recording.PendingBlockData.Reset();
+		Recording.PendingBlockTicksNum = 0;
+		Recording.CurrentVisibleTilesBits.Reset();
+
+		// nothing is decoded from a file that doesn't add up, the player of an empty recording does nothing
+		if (Ar.IsError() || !Recording.IsLoadedDataValid())
+		{
+			UE_LOG(LogFogOfWar, Error, TEXT("The visibility recording is corrupt and can't be loaded"));
+			Ar.SetError();
+			Recording.GridResolution = { 0, 0 };
+			Recording.TicksNum = 0;
+			Recording.Blocks.Empty();
+		}
+	}
+	return Ar;
+}
+
+bool FFogOfWarRecording::IsLoadedDataValid() const
+{
+	// the same limit as the grid of FogOfWar itself
+	if (GridResolution.X <= 0 || GridResolution.Y <= 0 || GridResolution.X + GridResolution.Y > 10000 || TicksPerKeyframe <= 0 || TicksNum < 0)
+	{
+		return false;
+	}
+
+	int ExpectedFirstTick = 0;
+	for (const FBlock& Block : Blocks)
+	{
+		// the keyframe and at most TicksPerKeyframe ticks, every tick is a varint count and at most a varint per tile
+		const int64 MaxUncompressedSize = GetKeyframeSize() + static_cast<int64>(TicksPerKeyframe) * VarintUtils::MaxBytesNum * (GridResolution.X * GridResolution.Y + 1);
+		if (Block.FirstTick != ExpectedFirstTick || Block.TicksNum <= 0 || Block.TicksNum > TicksPerKeyframe
+			|| Block.UncompressedSize < GetKeyframeSize() || Block.UncompressedSize > MaxUncompressedSize || Block.CompressedData.IsEmpty())
+		{
+			return false;
+		}
+		ExpectedFirstTick += Block.TicksNum;
+	}
+	return ExpectedFirstTick == TicksNum;
+}
+
+bool FFogOfWarRecording::DecompressBlock(int BlockIndex, TArray<uint8>& OutData) const
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Recording: DecompressBlock"), STAT_FogOfWarRecordingDecompressBlock, STATGROUP_FogOfWar);
+
+	// the sizes are validated on load, but the compressed data itself may still be damaged
+	const FBlock& Block = Blocks[BlockIndex];
+	OutData.SetNumUninitialized(Block.UncompressedSize);
+	if (!FCompression::UncompressMemory(NAME_Zlib, OutData.GetData(), Block.UncompressedSize, Block.CompressedData.GetData(), Block.CompressedData.Num()))
+	{
+		UE_LOG(LogFogOfWar, Error, TEXT("Block %d of the visibility recording can't be decompressed"), BlockIndex);
+		OutData.Reset();
+		return false;
+	}
+	return true;
+}
+
+FFogOfWarRecordingPlayer::FFogOfWarRecordingPlayer(TSharedRef<const FFogOfWarRecording> InRecording)
+	: Recording(InRecording)
+{
+	checkf(Recording->PendingBlockTicksNum == 0, TEXT("The recording must be finalized before playing"));
+}
+
+bool FFogOfWarRecordingPlayer::Seek(int Tick, TArrayView<uint8> VisionData)
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Recording: Seek"), STAT_FogOfWarRecordingSeek, STATGROUP_FogOfWar);
+
+	if (Recording->Blocks.IsEmpty() || bIsCorrupt)
+	{
+		return false;
+	}
+
+	Tick = FMath::Clamp(Tick, INDEX_NONE, Recording->GetTicksNum() - 1);
+	// the last block starting not after the tick. INDEX_NONE is the first block's keyframe
+	const int TargetBlockIndex = FMath::Max(Algo::UpperBoundBy(Recording->Blocks, Tick, &FFogOfWarRecording::FBlock::FirstTick) - 1, 0);
+
+	bool bChanged = false;
+	if (TargetBlockIndex != CurrentBlockIndex || Tick < CurrentTick)
+	{
+		if (!LoadBlock(TargetBlockIndex, VisionData))
+		{
+			return MarkCorrupt();
+		}
+		bChanged = true;
+	}
+	while (CurrentTick < Tick && !bIsCorrupt)
+	{
+		bChanged |= DecodeNextTick(VisionData);
+	}
+	return bChanged;
+}
+
+bool FFogOfWarRecordingPlayer::StepForward(TArrayView<uint8> VisionData)
+{
+	if (IsFinished())
+	{
+		return false;
+	}
+	if (CurrentBlockIndex == INDEX_NONE)
+	{
+		return Seek(CurrentTick + 1, VisionData);
+	}
+
+	const FFogOfWarRecording::FBlock& CurrentBlock = Recording->Blocks[CurrentBlockIndex];
+	if (CurrentTick + 1 >= CurrentBlock.FirstTick + CurrentBlock.TicksNum)
+	{
+		// the keyframe of the next block is exactly the current visibility, so only the ticks have to be decoded
+		CurrentBlockIndex++;
+		if (!Recording->DecompressBlock(CurrentBlockIndex, CurrentBlockData))
+		{
+			return MarkCorrupt();
+		}
+		CurrentBlockReadOffset = Recording->GetKeyframeSize();
+	}
+	return DecodeNextTick(VisionData);
+}
+
+bool FFogOfWarRecordingPlayer::LoadBlock(int BlockIndex, TArrayView<uint8> VisionData)
+{
+	const int TilesNum = Recording->GridResolution.X * Recording->GridResolution.Y;
+	check(VisionData.Num() == TilesNum);
+
+	if (!Recording->DecompressBlock(BlockIndex, CurrentBlockData))
+	{
+		return false;
+	}
+	const uint64* KeyframeWords = reinterpret_cast<const uint64*>(CurrentBlockData.GetData());
+	for (int GlobalIndex = 0; GlobalIndex < TilesNum; GlobalIndex++)
+	{
+		VisionData[GlobalIndex] = BitUtils::Test(KeyframeWords, GlobalIndex) ? 0xFF : 0;
+	}
+
+	CurrentBlockIndex = BlockIndex;
+	CurrentBlockReadOffset = Recording->GetKeyframeSize();
+	CurrentTick = Recording->Blocks[BlockIndex].FirstTick - 1;
+	return true;
+}
+
+bool FFogOfWarRecordingPlayer::DecodeNextTick(TArrayView<uint8> VisionData)
+{
+	const uint32 TilesNum = VisionData.Num();
+	uint32 FlippedTilesNum;
+	if (!VarintUtils::Read(CurrentBlockData, CurrentBlockReadOffset, FlippedTilesNum) || FlippedTilesNum > TilesNum)
+	{
+		return MarkCorrupt();
+	}
+
+	uint32 GlobalIndex = 0;
+	for (uint32 Index = 0; Index < FlippedTilesNum; Index++)
+	{
+		uint32 Delta;
+		if (!VarintUtils::Read(CurrentBlockData, CurrentBlockReadOffset, Delta) || Delta >= TilesNum - GlobalIndex)
+		{
+			return MarkCorrupt();
+		}
+		GlobalIndex += Delta;
+		VisionData[GlobalIndex] ^= 0xFF;
+	}
+	CurrentTick++;
+	return FlippedTilesNum > 0;
+}
+
+bool FFogOfWarRecordingPlayer::MarkCorrupt()
+{
+	UE_LOG(LogFogOfWar, Error, TEXT("The visibility recording is corrupt, the playback stops at tick %d"), CurrentTick);
+	bIsCorrupt = true;
+	return false;
+}
@@ -0,0 +1,662 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+
+#include "FogOfWar.h"
+
+#include "Engine/World.h"
+#include "HAL/IConsoleManager.h"
+
+#if !UE_BUILD_SHIPPING
+
+// Differential oracle for the vision engine. Random grids, radii, occluders and vision unit sequences are fed to a standalone FogOfWar,
+// and after every update its visibility counters (and the pyramid and the published snapshot) are compared with a brute-force reference.
+// The reference follows the same rules without any of the engine's machinery: no shared, pooled or recent results, no disc stamps,
+// no chunk max heights, no incremental counters, no dirty flags. Which location every vision unit is calculated from is tracked by the harness itself.
+// Only the ray rasterization (WalkDDARay), the tile of a location and the observer height banding are reused, they are the spec.
+class FFogOfWarVerification
+{
+public:
+	FFogOfWarVerification(AFogOfWar& InFogOfWar, int32 Seed)
+		: FogOfWar(InFogOfWar)
+		, Random(Seed)
+	{
+	}
+
+	// returns the number of the failed checks
+	int RunIteration(int Iteration)
+	{
+		CurrentIteration = Iteration;
+		FailedChecksNum = 0;
+
+		InitializeGrid();
+		ReferenceUnits.Reset();
+
+		AddRandomUnits(Random.RandRange(1, 24));
+		UpdateAndCompare(TEXT("initial update"));
+
+		const int StepsNum = Random.RandRange(4, 12);
+		for (int Step = 0; Step < StepsNum && FailedChecksNum == 0; Step++)
+		{
+			const int OperationsNum = Random.RandRange(1, 8);
+			for (int Operation = 0; Operation < OperationsNum; Operation++)
+			{
+				ExecuteRandomOperation();
+			}
+			UpdateAndCompare(TEXT("random operations"));
+		}
+
+		// everything must be released exactly once
+		TArray<FVisionUnitHandle> Handles;
+		for (const FReferenceUnit& ReferenceUnit : ReferenceUnits)
+		{
+			Handles.Add(ReferenceUnit.Handle);
+		}
+		FogOfWar.RemoveVisionUnits(Handles);
+		ReferenceUnits.Reset();
+		for (const FReferenceOccluder& ReferenceOccluder : ReferenceOccluders)
+		{
+			FogOfWar.RemoveOccluder(ReferenceOccluder.Handle);
+		}
+		ReferenceOccluders.Reset();
+		UpdateAndCompare(TEXT("removing all vision units"));
+		Verify(FogOfWar.GetVisibilityChecksum() == 0, TEXT("the checksum is not zero for an empty grid"));
+		Verify(FogOfWar.VisionResults.IsEmpty(), TEXT("vision results leaked"));
+
+		return FailedChecksNum;
+	}
+
+private:
+	struct FReferenceUnit
+	{
+		FVisionUnitHandle Handle;
+
+		// the latest location the vision unit was given
+		FVector Location;
+
+		// the location the vision is calculated from. It only follows Location when the vision unit leaves its tile (farther than the hysteresis),
+		// changes its radius or an occluder changes its area
+		FVector CalculatedLocation;
+
+		bool bIsCalculated = false;
+
+		// left the tile since the last calculation, recalculated from the latest location on the next update
+		bool bIsDirty = true;
+	};
+
+	struct FReferenceOccluder
+	{
+		FVisionOccluderHandle Handle;
+
+		// the covered tiles, not clamped to the grid
+		FIntVector2 MinIJ;
+
+		FIntVector2 MaxIJ;
+	};
+
+	void InitializeGrid()
+	{
+		FogOfWar.TileSize = 100.0f;
+		FogOfWar.bDeterministicMode = Random.RandRange(0, 1) == 1;
+		FogOfWar.VisionBlockingDeltaHeightThreshold = Random.RandRange(0, 3) * 100.0f;
+		FogOfWar.VisionSharingHeightBandSize = Random.RandRange(0, 1) * 50.0f;
+		FogOfWar.MaxVisionUnitWarmUpsPerTick = Random.RandRange(0, 3);
+		FogOfWar.MaxRecentVisionResultsPerUnit = Random.RandRange(0, 2);
+		FogOfWar.VisionUnitTileHysteresis = Random.RandRange(0, 1) * 25.0f;
+
+		const FIntVector2 Resolution = { Random.RandRange(4, 80), Random.RandRange(4, 80) };
+		FogOfWar.InitializeGrid(
+			{ static_cast<double>(Random.RandRange(-5000, 5000)), static_cast<double>(Random.RandRange(-5000, 5000)) },
+			{ Resolution.X * FogOfWar.TileSize, Resolution.Y * FogOfWar.TileSize });
+		check(FogOfWar.GridResolution == Resolution);
+
+		// the low noise never blocks anything, the walls and the pits are what the rays have to deal with
+		TArray<float> Heights;
+		Heights.SetNum(Resolution.X * Resolution.Y);
+		for (float& Height : Heights)
+		{
+			Height = FMath::RoundToFloat(Random.FRandRange(0.0f, 50.0f));
+		}
+		const int WallsNum = Random.RandRange(0, 12);
+		for (int WallIndex = 0; WallIndex < WallsNum; WallIndex++)
+		{
+			const FIntVector2 MinIJ = { Random.RandRange(0, Resolution.X - 1), Random.RandRange(0, Resolution.Y - 1) };
+			const FIntVector2 MaxIJ = { FMath::Min(MinIJ.X + Random.RandRange(0, 8), Resolution.X - 1), FMath::Min(MinIJ.Y + Random.RandRange(0, 8), Resolution.Y - 1) };
+			const float WallHeight = Random.RandRange(0, 9) == 0 ? -std::numeric_limits<float>::infinity() : FMath::RoundToFloat(Random.FRandRange(100.0f, 600.0f));
+			for (int I = MinIJ.X; I <= MaxIJ.X; I++)
+			{
+				for (int J = MinIJ.Y; J <= MaxIJ.Y; J++)
+				{
+					Heights[FogOfWar.GetGlobalIndex({ I, J })] = WallHeight;
+				}
+			}
+		}
+
+		FogOfWar.Occluders.Reset();
+		FogOfWar.FreeOccluderIndexes.Reset();
+		FogOfWar.TileChunks.Reset();
+		FogOfWar.TileChunks.SetNum(FogOfWar.ChunkResolution.X * FogOfWar.ChunkResolution.Y);
+		FogOfWar.Heightmap = MakeShared<FFogOfWarHeightmap>(FogOfWar.TileChunks.Num(), 1 << (AFogOfWar::TileChunkSizeLog2 * 2));
+		for (int ChunkIndex = 0; ChunkIndex < FogOfWar.TileChunks.Num(); ChunkIndex++)
+		{
+			// there's no world to trace, so the harness acquires the chunk first with its own heights (the reference is dropped with the heightmap)
+			// and the engine loads the chunk the same way a second instance sharing the heightmap would
+			FogOfWar.Heightmap->AcquireChunk(ChunkIndex, [&](TArrayView<float> ChunkHeights)
+				{
+					FogOfWar.ForEachTileInChunk(ChunkIndex, [&](FIntVector2 TileIJ)
+						{
+							ChunkHeights[FogOfWar.GetTileIndexInChunk(TileIJ)] = Heights[FogOfWar.GetGlobalIndex(TileIJ)];
+						});
+				});
+			FogOfWar.TileChunks[ChunkIndex].ResidencyCounter = 1;
+			FogOfWar.LoadTileChunk(ChunkIndex);
+		}
+		FogOfWar.InitializeVisibilityPyramid();
+		FogOfWar.VisibleTilesBits.Reset();
+		FogOfWar.VisibleTilesBits.SetNumZeroed(BitUtils::GetWordsNum(FogOfWar.GridResolution.X * FogOfWar.GridResolution.Y));
+		FogOfWar.PublishedVisibilitySnapshot.Reset();
+		FogOfWar.RetiredVisibilitySnapshot.Reset();
+		FogOfWar.VisibilityChecksum = 0;
+		FogOfWar.bHeadless = true;
+		FogOfWar.bActivated = true;
+	}
+
+	FIntVector2 GetTileIJ(const FVector& Location) const
+	{
+		return FogOfWar.ConvertWorldLocationToTileIJ(FVector2D(Location));
+	}
+
+	FVector GetTileCenterLocation(FIntVector2 TileIJ, double Z) const
+	{
+		return FVector(FogOfWar.ConvertTileIJToTileCenterWorldLocation(TileIJ), Z);
+	}
+
+	// the "bottom-left" tile of the local area the vision is calculated in, the spiral order (and so the result) depends on it.
+	// The deterministic mode calculates from the tile center, the regular one from the location itself
+	FIntVector2 GetLocalAreaMinIJ(const FVector& Location, float GridSpaceRadius) const
+	{
+		if (FogOfWar.bDeterministicMode)
+		{
+			const FIntVector2 OriginIJ = GetTileIJ(Location);
+			return { FMath::FloorToInt(OriginIJ.X + 0.5f - GridSpaceRadius), FMath::FloorToInt(OriginIJ.Y + 0.5f - GridSpaceRadius) };
+		}
+		const float GridLocationX = static_cast<float>((Location.X - FogOfWar.GridBottomLeftWorldLocation.X) / FogOfWar.TileSize);
+		const float GridLocationY = static_cast<float>((Location.Y - FogOfWar.GridBottomLeftWorldLocation.Y) / FogOfWar.TileSize);
+		return { FMath::FloorToInt(GridLocationX - GridSpaceRadius), FMath::FloorToInt(GridLocationY - GridSpaceRadius) };
+	}
+
+	// An arbitrary location within the tile, in whole units and at least 5 units away from the tile borders and never exactly at the hysteresis
+	// distance from the neighboring tiles, so the harness and the engine can't disagree about the tile. The vision units sharing the tile, the radius
+	// and the observer height band share the result, so in the regular mode the location is only taken if its local area is the same as the tile center's,
+	// otherwise the shared result would depend on which vision unit came first
+	FVector GetLocationInTile(FIntVector2 TileIJ, double Z, float GridSpaceRadius)
+	{
+		const FVector TileCenterLocation = GetTileCenterLocation(TileIJ, Z);
+		const int TileSize = static_cast<int>(FogOfWar.TileSize);
+		const int Hysteresis = static_cast<int>(FogOfWar.VisionUnitTileHysteresis);
+		for (int Attempt = 0; Attempt < 8; Attempt++)
+		{
+			const FIntVector2 Offset = { Random.RandRange(5, TileSize - 5), Random.RandRange(5, TileSize - 5) };
+			if (Offset.X == Hysteresis || Offset.X == TileSize - Hysteresis || Offset.Y == Hysteresis || Offset.Y == TileSize - Hysteresis)
+			{
+				continue;
+			}
+			const FVector Location = {
+				FogOfWar.GridBottomLeftWorldLocation.X + TileSize * TileIJ.X + Offset.X,
+				FogOfWar.GridBottomLeftWorldLocation.Y + TileSize * TileIJ.Y + Offset.Y,
+				Z
+			};
+			if (GetLocalAreaMinIJ(Location, GridSpaceRadius) == GetLocalAreaMinIJ(TileCenterLocation, GridSpaceRadius))
+			{
+				return Location;
+			}
+		}
+		return TileCenterLocation;
+	}
+
+	FVector GetRandomLocation(float GridSpaceRadius)
+	{
+		const FIntVector2 TileIJ = { Random.RandRange(0, FogOfWar.GridResolution.X - 1), Random.RandRange(0, FogOfWar.GridResolution.Y - 1) };
+		const float GroundHeight = FMath::Max(FogOfWar.GetTileHeight(TileIJ), 0.0f);
+		return GetLocationInTile(TileIJ, GroundHeight + FMath::RoundToFloat(Random.FRandRange(0.0f, 400.0f)), GridSpaceRadius);
+	}
+
+	// somewhere in the same or a neighboring tile at the same height, so the vision units jitter back and forth across the borders,
+	// stay within the hysteresis and hit their recent results
+	FVector GetNearbyLocation(const FVector& Location, float GridSpaceRadius)
+	{
+		const FIntVector2 TileIJ = GetTileIJ(Location);
+		const FIntVector2 NearbyTileIJ = {
+			FMath::Clamp(TileIJ.X + Random.RandRange(-1, 1), 0, FogOfWar.GridResolution.X - 1),
+			FMath::Clamp(TileIJ.Y + Random.RandRange(-1, 1), 0, FogOfWar.GridResolution.Y - 1)
+		};
+		return GetLocationInTile(NearbyTileIJ, Location.Z, GridSpaceRadius);
+	}
+
+	float GetRandomSightRadius()
+	{
+		return FMath::RoundToFloat(Random.FRandRange(0.0f, 1500.0f));
+	}
+
+	float GetGridSpaceRadius(const FReferenceUnit& ReferenceUnit) const
+	{
+		return FogOfWar.VisionUnits[FogOfWar.GetVisionUnitIndex(ReferenceUnit.Handle)].GridSpaceRadius;
+	}
+
+	// the harness locations are whole units and never exactly at the hysteresis distance, so the plain math agrees with the engine's
+	bool IsWithinHysteresis(const FVector& Location, FIntVector2 TileIJ) const
+	{
+		const double Hysteresis = FogOfWar.VisionUnitTileHysteresis;
+		if (Hysteresis <= 0.0)
+		{
+			return GetTileIJ(Location) == TileIJ;
+		}
+		const double OffsetX = Location.X - FogOfWar.GridBottomLeftWorldLocation.X - TileIJ.X * FogOfWar.TileSize;
+		const double OffsetY = Location.Y - FogOfWar.GridBottomLeftWorldLocation.Y - TileIJ.Y * FogOfWar.TileSize;
+		return OffsetX >= -Hysteresis && OffsetX < FogOfWar.TileSize + Hysteresis && OffsetY >= -Hysteresis && OffsetY < FogOfWar.TileSize + Hysteresis;
+	}
+
+	void MoveReferenceUnit(FReferenceUnit& ReferenceUnit, const FVector& NewLocation)
+	{
+		FogOfWar.SetVisionUnitLocation(ReferenceUnit.Handle, NewLocation);
+		ReferenceUnit.Location = NewLocation;
+		// the vision of the old tile is kept while the vision unit is within the hysteresis around it, a dirty one stays dirty
+		if (ReferenceUnit.bIsCalculated && !IsWithinHysteresis(NewLocation, GetTileIJ(ReferenceUnit.CalculatedLocation)))
+		{
+			ReferenceUnit.bIsDirty = true;
+		}
+	}
+
+	static void RecalculateReferenceUnit(FReferenceUnit& ReferenceUnit)
+	{
+		ReferenceUnit.CalculatedLocation = ReferenceUnit.Location;
+		ReferenceUnit.bIsCalculated = true;
+		ReferenceUnit.bIsDirty = false;
+	}
+
+	// an occluder change recalculates the vision units seeing its area right away, the ones that were never calculated are checked by their tile
+	void InvalidateReferenceUnitsInArea(FIntVector2 MinIJ, FIntVector2 MaxIJ)
+	{
+		for (FReferenceUnit& ReferenceUnit : ReferenceUnits)
+		{
+			FIntVector2 AreaMinIJ;
+			FIntVector2 AreaMaxIJ;
+			if (ReferenceUnit.bIsCalculated)
+			{
+				const int Resolution = FogOfWar.VisionUnits[FogOfWar.GetVisionUnitIndex(ReferenceUnit.Handle)].LocalAreaTilesResolution;
+				AreaMinIJ = GetLocalAreaMinIJ(ReferenceUnit.CalculatedLocation, GetGridSpaceRadius(ReferenceUnit));
+				AreaMaxIJ = AreaMinIJ + FIntVector2(Resolution - 1, Resolution - 1);
+			}
+			else
+			{
+				AreaMinIJ = AreaMaxIJ = GetTileIJ(ReferenceUnit.Location);
+			}
+
+			if (AreaMaxIJ.X >= MinIJ.X && AreaMaxIJ.Y >= MinIJ.Y && AreaMinIJ.X <= MaxIJ.X && AreaMinIJ.Y <= MaxIJ.Y)
+			{
+				RecalculateReferenceUnit(ReferenceUnit);
+			}
+		}
+	}
+
+	void AddRandomUnits(int Num)
+	{
+		// a part of the vision units share the tile and the radius with another one
+		if (!ReferenceUnits.IsEmpty() && Random.RandRange(0, 2) == 0)
+		{
+			const FReferenceUnit& Twin = ReferenceUnits[Random.RandRange(0, ReferenceUnits.Num() - 1)];
+			const float SightRadius = GetGridSpaceRadius(Twin) * FogOfWar.TileSize;
+			const FVector Location = Twin.Location;
+			ReferenceUnits.Add({ FogOfWar.AddVisionUnit(Location, SightRadius), Location });
+			return;
+		}
+
+		const float SightRadius = GetRandomSightRadius();
+		// the same float division as the engine, so the local areas match
+		const float GridSpaceRadius = SightRadius / FogOfWar.TileSize;
+		if (Num > 1 && Random.RandRange(0, 1) == 0)
+		{
+			TArray<FVector> Locations;
+			for (int Index = 0; Index < Num; Index++)
+			{
+				Locations.Add(GetRandomLocation(GridSpaceRadius));
+			}
+			const TArray<FVisionUnitHandle> Handles = FogOfWar.AddVisionUnits(Locations, SightRadius, Random.RandRange(0, 1) * 1500.0f);
+			for (int Index = 0; Index < Num; Index++)
+			{
+				ReferenceUnits.Add({ Handles[Index], Locations[Index] });
+			}
+			return;
+		}
+
+		for (int Index = 0; Index < Num; Index++)
+		{
+			const FVector Location = GetRandomLocation(GridSpaceRadius);
+			ReferenceUnits.Add({ FogOfWar.AddVisionUnit(Location, SightRadius, Random.RandRange(0, 1) * 1500.0f), Location });
+		}
+	}
+
+	void AddReferenceOccluder(FVisionOccluderHandle Handle, FVector2D WorldMin, FVector2D WorldMax)
+	{
+		const FReferenceOccluder& ReferenceOccluder = ReferenceOccluders.Add_GetRef({ Handle, GetTileIJ(FVector(WorldMin, 0.0)), GetTileIJ(FVector(WorldMax, 0.0)) });
+		InvalidateReferenceUnitsInArea(ReferenceOccluder.MinIJ, ReferenceOccluder.MaxIJ);
+	}
+
+	void ExecuteRandomOperation()
+	{
+		const int OperationType = ReferenceUnits.IsEmpty() ? 0 : Random.RandRange(0, 8);
+		switch (OperationType)
+		{
+		case 0:
+			AddRandomUnits(Random.RandRange(1, 6));
+			break;
+		case 1:
+		case 2:
+		{
+			FReferenceUnit& ReferenceUnit = ReferenceUnits[Random.RandRange(0, ReferenceUnits.Num() - 1)];
+			const float GridSpaceRadius = GetGridSpaceRadius(ReferenceUnit);
+			MoveReferenceUnit(ReferenceUnit, OperationType == 1 ? GetRandomLocation(GridSpaceRadius) : GetNearbyLocation(ReferenceUnit.Location, GridSpaceRadius));
+			break;
+		}
+		case 3:
+		{
+			FReferenceUnit& ReferenceUnit = ReferenceUnits[Random.RandRange(0, ReferenceUnits.Num() - 1)];
+			const float SightRadius = GetRandomSightRadius();
+			// the location within the tile may give another local area with the new radius, see GetLocationInTile
+			const FVector TileCenterLocation = GetTileCenterLocation(GetTileIJ(ReferenceUnit.Location), ReferenceUnit.Location.Z);
+			if (GetLocalAreaMinIJ(ReferenceUnit.Location, SightRadius / FogOfWar.TileSize) != GetLocalAreaMinIJ(TileCenterLocation, SightRadius / FogOfWar.TileSize))
+			{
+				MoveReferenceUnit(ReferenceUnit, TileCenterLocation);
+			}
+			FogOfWar.SetVisionUnitSightRadius(ReferenceUnit.Handle, SightRadius, Random.RandRange(0, 1) * 1500.0f);
+			// recalculated right away from the latest location, even if the vision unit only moved within the tile or the hysteresis
+			RecalculateReferenceUnit(ReferenceUnit);
+			break;
+		}
+		case 4:
+		{
+			const int ReferenceUnitIndex = Random.RandRange(0, ReferenceUnits.Num() - 1);
+			FogOfWar.RemoveVisionUnit(ReferenceUnits[ReferenceUnitIndex].Handle);
+			ReferenceUnits.RemoveAtSwap(ReferenceUnitIndex);
+			break;
+		}
+		case 5:
+		{
+			TArray<FVisionUnitHandle> Handles;
+			for (int ReferenceUnitIndex = ReferenceUnits.Num() - 1; ReferenceUnitIndex >= 0; ReferenceUnitIndex--)
+			{
+				if (Random.RandRange(0, 2) == 0)
+				{
+					Handles.Add(ReferenceUnits[ReferenceUnitIndex].Handle);
+					ReferenceUnits.RemoveAtSwap(ReferenceUnitIndex);
+				}
+			}
+			FogOfWar.RemoveVisionUnits(Handles);
+			break;
+		}
+		case 6:
+		{
+			const FVector2D Center = FVector2D(GetRandomLocation(0.0f));
+			const float Extent = Random.FRandRange(0.0f, 600.0f);
+			const float Height = FMath::RoundToFloat(Random.FRandRange(0.0f, 800.0f));
+			if (Random.RandRange(0, 1) == 0)
+			{
+				AddReferenceOccluder(FogOfWar.AddCircleOccluder(Center, Extent, Height), Center - Extent, Center + Extent);
+			}
+			else
+			{
+				const FBox2D Box(Center - Extent, Center + Random.FRandRange(0.0f, 600.0f));
+				AddReferenceOccluder(FogOfWar.AddBoxOccluder(Box, Height), Box.Min, Box.Max);
+			}
+			break;
+		}
+		case 7:
+		case 8:
+		{
+			if (ReferenceOccluders.IsEmpty())
+			{
+				break;
+			}
+			const int ReferenceOccluderIndex = Random.RandRange(0, ReferenceOccluders.Num() - 1);
+			const FReferenceOccluder ReferenceOccluder = ReferenceOccluders[ReferenceOccluderIndex];
+			if (OperationType == 7)
+			{
+				FogOfWar.RemoveOccluder(ReferenceOccluder.Handle);
+				ReferenceOccluders.RemoveAtSwap(ReferenceOccluderIndex);
+			}
+			else
+			{
+				FogOfWar.SetOccluderHeight(ReferenceOccluder.Handle, FMath::RoundToFloat(Random.FRandRange(0.0f, 800.0f)));
+			}
+			InvalidateReferenceUnitsInArea(ReferenceOccluder.MinIJ, ReferenceOccluder.MaxIJ);
+			break;
+		}
+		}
+	}
+
+	void UpdateAndCompare(const TCHAR* Stage)
+	{
+		// MaxVisionUnitWarmUpsPerTick may spread the update over several ticks
+		while (!FogOfWar.DirtyVisionUnitSlotIndexes.IsEmpty())
+		{
+			FogOfWar.UpdateVisionUnits();
+		}
+
+		int MismatchedOriginsNum = 0;
+		for (FReferenceUnit& ReferenceUnit : ReferenceUnits)
+		{
+			if (ReferenceUnit.bIsDirty)
+			{
+				RecalculateReferenceUnit(ReferenceUnit);
+			}
+			const int VisionUnitIndex = FogOfWar.GetVisionUnitIndex(ReferenceUnit.Handle);
+			MismatchedOriginsNum += FogOfWar.VisionUnitCachedOriginGlobalIndexes[VisionUnitIndex] != FogOfWar.GetGlobalIndex(GetTileIJ(ReferenceUnit.CalculatedLocation));
+		}
+		Verify(MismatchedOriginsNum == 0, *FString::Printf(TEXT("%d vision units are calculated from another tile after %s"), MismatchedOriginsNum, Stage));
+
+		const int TilesNum = FogOfWar.GridResolution.X * FogOfWar.GridResolution.Y;
+		TArray<int> ReferenceCounters;
+		ReferenceCounters.SetNumZeroed(TilesNum);
+		for (const FReferenceUnit& ReferenceUnit : ReferenceUnits)
+		{
+			AddReferenceVisibility(ReferenceUnit, ReferenceCounters);
+		}
+
+		int MismatchedTilesNum = 0;
+		for (int GlobalIndex = 0; GlobalIndex < TilesNum; GlobalIndex++)
+		{
+			const int VisibilityCounter = FogOfWar.GetGlobalTile(FogOfWar.GetTileIJ(GlobalIndex)).VisibilityCounter;
+			if (VisibilityCounter != ReferenceCounters[GlobalIndex])
+			{
+				if (MismatchedTilesNum < 8)
+				{
+					const FIntVector2 TileIJ = FogOfWar.GetTileIJ(GlobalIndex);
+					UE_LOG(LogFogOfWar, Error, TEXT("FogOfWar.Verify: iteration %d (%s): tile (%d, %d) has the counter %d, the reference is %d"),
+						CurrentIteration, Stage, TileIJ.X, TileIJ.Y, VisibilityCounter, ReferenceCounters[GlobalIndex]);
+				}
+				MismatchedTilesNum++;
+			}
+		}
+		Verify(MismatchedTilesNum == 0, *FString::Printf(TEXT("%d tiles mismatched after %s"), MismatchedTilesNum, Stage));
+
+		FogOfWar.PublishVisibilitySnapshot();
+		const TSharedPtr<const FFogOfWarVisibilitySnapshot, ESPMode::ThreadSafe> Snapshot = FogOfWar.AcquireVisibilitySnapshot();
+		int MismatchedSnapshotTilesNum = 0;
+		for (int GlobalIndex = 0; GlobalIndex < TilesNum; GlobalIndex++)
+		{
+			MismatchedSnapshotTilesNum += Snapshot->IsTileVisible(FogOfWar.GetTileIJ(GlobalIndex)) != (ReferenceCounters[GlobalIndex] > 0);
+		}
+		Verify(MismatchedSnapshotTilesNum == 0, *FString::Printf(TEXT("%d snapshot tiles mismatched after %s"), MismatchedSnapshotTilesNum, Stage));
+
+		for (int LevelIndex = 0; LevelIndex < FogOfWar.VisibilityPyramid.Num(); LevelIndex++)
+		{
+			const AFogOfWar::FVisibilityPyramidLevel& PyramidLevel = FogOfWar.VisibilityPyramid[LevelIndex];
+			TArray<int> ReferenceVisibleTilesNums;
+			ReferenceVisibleTilesNums.SetNumZeroed(PyramidLevel.VisibleTilesNums.Num());
+			for (int GlobalIndex = 0; GlobalIndex < TilesNum; GlobalIndex++)
+			{
+				const FIntVector2 TileIJ = FogOfWar.GetTileIJ(GlobalIndex);
+				ReferenceVisibleTilesNums[(TileIJ.X >> (LevelIndex + 1)) * PyramidLevel.Resolution.Y + (TileIJ.Y >> (LevelIndex + 1))] += ReferenceCounters[GlobalIndex] > 0;
+			}
+			Verify(ReferenceVisibleTilesNums == PyramidLevel.VisibleTilesNums, *FString::Printf(TEXT("the pyramid level %d mismatched after %s"), LevelIndex + 1, Stage));
+		}
+	}
+
+	// The engine's rules: every tile within the radius casts a ray to the origin, visiting the local area in the spiral order from the outside in.
+	// The tiles on an unblocked ray become visible, the tiles on a blocked ray become known, and a known tile doesn't cast its own ray.
+	void AddReferenceVisibility(const FReferenceUnit& ReferenceUnit, TArray<int>& ReferenceCounters)
+	{
+		const int VisionUnitIndex = FogOfWar.GetVisionUnitIndex(ReferenceUnit.Handle);
+		check(VisionUnitIndex != INDEX_NONE);
+		const AFogOfWar::FVisionUnitData& VisionUnitData = FogOfWar.VisionUnits[VisionUnitIndex];
+		const int Resolution = VisionUnitData.LocalAreaTilesResolution;
+		if (Resolution == 0)
+		{
+			return;
+		}
+
+		check(ReferenceUnit.bIsCalculated);
+		const FIntVector2 OriginIJ = GetTileIJ(ReferenceUnit.CalculatedLocation);
+		const FIntVector2 MinIJ = GetLocalAreaMinIJ(ReferenceUnit.CalculatedLocation, VisionUnitData.GridSpaceRadius);
+		const float ObserverHeight = FogOfWar.GetObserverHeight(ReferenceUnit.CalculatedLocation.Z);
+
+		TArray<bool> KnownTiles;
+		KnownTiles.SetNumZeroed(Resolution * Resolution);
+		TArray<bool> VisibleTiles;
+		VisibleTiles.SetNumZeroed(Resolution * Resolution);
+		auto GetLocalIndex = [&](FIntVector2 GlobalIJ) { return (GlobalIJ.X - MinIJ.X) * Resolution + (GlobalIJ.Y - MinIJ.Y); };
+		KnownTiles[GetLocalIndex(OriginIJ)] = true;
+		VisibleTiles[GetLocalIndex(OriginIJ)] = true;
+
+		TArray<int> RayLocalIndexes;
+		auto CastRay = [&](FIntVector2 LocalIJ)
+			{
+				const FIntVector2 GlobalIJ = MinIJ + LocalIJ;
+				if (!FogOfWar.IsGlobalIJValid(GlobalIJ) ||
+					FMath::Square(GlobalIJ.X - OriginIJ.X) + FMath::Square(GlobalIJ.Y - OriginIJ.Y) > VisionUnitData.GridSpaceRadiusSqr ||
+					KnownTiles[GetLocalIndex(GlobalIJ)])
+				{
+					return;
+				}
+
+				RayLocalIndexes.Reset();
+				bool bIsBlocked = false;
+				auto VisitTile = [&](FIntVector2 CurrentGlobalIJ)
+					{
+						RayLocalIndexes.Add(GetLocalIndex(CurrentGlobalIJ));
+						if (CurrentGlobalIJ != OriginIJ && FogOfWar.GetTileHeight(CurrentGlobalIJ) - ObserverHeight > FogOfWar.VisionBlockingDeltaHeightThreshold)
+						{
+							bIsBlocked = true;
+							return false;
+						}
+						return true;
+					};
+				if (FogOfWar.bDeterministicMode)
+				{
+					AFogOfWar::WalkDDARay<true>(GlobalIJ, OriginIJ, VisitTile);
+				}
+				else
+				{
+					AFogOfWar::WalkDDARay<false>(GlobalIJ, OriginIJ, VisitTile);
+				}
+
+				for (const int LocalIndex : RayLocalIndexes)
+				{
+					KnownTiles[LocalIndex] = true;
+					VisibleTiles[LocalIndex] |= !bIsBlocked;
+				}
+			};
+
+		// layer by layer: the top row to the right, the right column up, the bottom row to the left, the left column down
+		for (int Layer = 0; Layer <= (Resolution - 1) / 2; Layer++)
+		{
+			const int Last = Resolution - 1 - Layer;
+			for (int J = Layer; J <= Last; J++)
+			{
+				CastRay({ Layer, J });
+			}
+			for (int I = Layer + 1; I <= Last; I++)
+			{
+				CastRay({ I, Last });
+			}
+			for (int J = Last - 1; J >= Layer && Last > Layer; J--)
+			{
+				CastRay({ Last, J });
+			}
+			for (int I = Last - 1; I > Layer; I--)
+			{
+				CastRay({ I, Layer });
+			}
+		}
+
+		for (int LocalIndex = 0; LocalIndex < VisibleTiles.Num(); LocalIndex++)
+		{
+			const FIntVector2 GlobalIJ = MinIJ + FIntVector2(LocalIndex / Resolution, LocalIndex % Resolution);
+			if (VisibleTiles[LocalIndex] && FogOfWar.IsGlobalIJValid(GlobalIJ))
+			{
+				ReferenceCounters[FogOfWar.GetGlobalIndex(GlobalIJ)]++;
+			}
+		}
+	}
+
+	void Verify(bool bCondition, const TCHAR* Message)
+	{
+		if (!bCondition)
+		{
+			UE_LOG(LogFogOfWar, Error, TEXT("FogOfWar.Verify: iteration %d: %s"), CurrentIteration, Message);
+			FailedChecksNum++;
+		}
+	}
+
+private:
+	AFogOfWar& FogOfWar;
+
+	FRandomStream Random;
+
+	TArray<FReferenceUnit> ReferenceUnits;
+
+	// the occluders are a part of the input: the reference reads them through GetTileHeight like the engine does
+	TArray<FReferenceOccluder> ReferenceOccluders;
+
+	int CurrentIteration = 0;
+
+	int FailedChecksNum = 0;
+};
+
+static void RunFogOfWarVerification(const TArray<FString>& Args, UWorld* World)
+{
+	const int IterationsNum = Args.Num() > 0 ? FCString::Atoi(*Args[0]) : 20;
+	const int32 Seed = Args.Num() > 1 ? FCString::Atoi(*Args[1]) : FMath::Rand();
+
+	// a standalone FogOfWar that is never activated, so neither the world nor the running fog (if any) are touched
+	FActorSpawnParameters SpawnParameters;
+	SpawnParameters.ObjectFlags = RF_Transient;
+	SpawnParameters.bDeferConstruction = true;
+	AFogOfWar* FogOfWar = World->SpawnActor<AFogOfWar>(SpawnParameters);
+	FogOfWar->bAutoActivate = false;
+	FogOfWar->FinishSpawning(FTransform::Identity);
+
+	FFogOfWarVerification Verification(*FogOfWar, Seed);
+	int FailedIterationsNum = 0;
+	for (int Iteration = 0; Iteration < IterationsNum; Iteration++)
+	{
+		FailedIterationsNum += Verification.RunIteration(Iteration) > 0;
+	}
+
+	FogOfWar->Destroy();
+
+	if (FailedIterationsNum == 0)
+	{
+		UE_LOG(LogFogOfWar, Display, TEXT("FogOfWar.Verify: %d iterations passed (seed %d)"), IterationsNum, Seed);
+	}
+	else
+	{
+		UE_LOG(LogFogOfWar, Error, TEXT("FogOfWar.Verify: %d of %d iterations failed (seed %d)"), FailedIterationsNum, IterationsNum, Seed);
+	}
+}
+
+static FAutoConsoleCommandWithWorldAndArgs FogOfWarVerifyCommand(
+	TEXT("FogOfWar.Verify"),
+	TEXT("Compares the vision engine with a brute-force reference on random grids, occluders and vision unit sequences. Usage: FogOfWar.Verify [Iterations=20] [Seed]"),
+	FConsoleCommandWithWorldAndArgsDelegate::CreateStatic(&RunFogOfWarVerification));
+
+#endif
@@ -0,0 +1,47 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+
+#include "FogOfWarVisibilitySnapshot.h"
+
+bool FFogOfWarVisibilitySnapshot::IsLocationVisible(const FVector& WorldLocation) const
+{
+	return IsTileVisible(ConvertWorldLocationToTileIJ(FVector2D(WorldLocation)));
+}
+
+void FFogOfWarVisibilitySnapshot::AreLocationsVisible(TConstArrayView<FVector> WorldLocations, TArrayView<bool> OutResults) const
+{
+	check(WorldLocations.Num() == OutResults.Num());
+
+	for (int Index = 0; Index < WorldLocations.Num(); Index++)
+	{
+		OutResults[Index] = IsLocationVisible(WorldLocations[Index]);
+	}
+}
+
+int FFogOfWarVisibilitySnapshot::CountVisibleLocations(TConstArrayView<FVector> WorldLocations) const
+{
+	int VisibleLocationsNum = 0;
+	for (const FVector& WorldLocation : WorldLocations)
+	{
+		VisibleLocationsNum += IsLocationVisible(WorldLocation);
+	}
+	return VisibleLocationsNum;
+}
+
+FIntVector2 FFogOfWarVisibilitySnapshot::ConvertWorldLocationToTileIJ(const FVector2D& WorldLocation) const
+{
+	// must match AFogOfWar::ConvertWorldLocationToTileIJ
+	if (bDeterministicMode)
+	{
+		const int64 IntTileSize = static_cast<int64>(TileSize);
+		return {
+			static_cast<int32>(FMath::DivideAndRoundDown(FMath::RoundToInt64(WorldLocation.X) - FMath::RoundToInt64(GridBottomLeftWorldLocation.X), IntTileSize)),
+			static_cast<int32>(FMath::DivideAndRoundDown(FMath::RoundToInt64(WorldLocation.Y) - FMath::RoundToInt64(GridBottomLeftWorldLocation.Y), IntTileSize))
+		};
+	}
+
+	return {
+		FMath::FloorToInt(static_cast<float>((WorldLocation.X - GridBottomLeftWorldLocation.X) / TileSize)),
+		FMath::FloorToInt(static_cast<float>((WorldLocation.Y - GridBottomLeftWorldLocation.Y) / TileSize))
+	};
+}
@@ -0,0 +1,151 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+
+#include "InstancedVisibleComponent.h"
+
+#include "FogOfWar.h"
+#include "FogOfWarStats.h"
+#include "Async/ParallelFor.h"
+#include "Components/InstancedStaticMeshComponent.h"
+#include "Utils/ManagerComponent.h"
+#include "Utils/ManagerStatics.h"
+
+UInstancedVisibleComponent::UInstancedVisibleComponent()
+{
+	PrimaryComponentTick.bCanEverTick = true;
+	// Preventing tick until FogOfWar is registered.
+	PrimaryComponentTick.bStartWithTickEnabled = false;
+}
+
+void UInstancedVisibleComponent::SetInstancedMeshes(const TArray<UInstancedStaticMeshComponent*>& NewInstancedMeshes)
+{
+	ManagedMeshes.Reset();
+	for (UInstancedStaticMeshComponent* InstancedMesh : NewInstancedMeshes)
+	{
+		if (IsValid(InstancedMesh))
+		{
+			ManagedMeshes.AddDefaulted_GetRef().Mesh = InstancedMesh;
+		}
+	}
+
+	if (FogOfWar)
+	{
+		UpdateVisibility(true);
+	}
+}
+
+bool UInstancedVisibleComponent::IsInstanceVisible(const UInstancedStaticMeshComponent* InstancedMesh, int InstanceIndex) const
+{
+	const FManagedInstancedMesh* ManagedMesh = ManagedMeshes.FindByPredicate([InstancedMesh](const FManagedInstancedMesh& Other) { return Other.Mesh.Get() == InstancedMesh; });
+	return ManagedMesh && ManagedMesh->InstanceVisibilities.IsValidIndex(InstanceIndex) && ManagedMesh->InstanceVisibilities[InstanceIndex];
+}
+
+void UInstancedVisibleComponent::BeginPlay()
+{
+	Super::BeginPlay();
+
+	if (ManagedMeshes.IsEmpty())
+	{
+		TArray<UInstancedStaticMeshComponent*> InstancedMeshes;
+		GetOwner()->GetComponents(InstancedMeshes);
+		SetInstancedMeshes(InstancedMeshes);
+	}
+
+	auto GameManager = UManagerStatics::GetGameManager(this);
+	GameManager->WaitForRegistrationAsync<AFogOfWar>(FObjectRegisteredInManager::CreateWeakLambda(this,
+		[this](UObject* Object)
+		{
+			FogOfWar = Cast<AFogOfWar>(Object);
+
+			UpdateVisibility(true);
+			PrimaryComponentTick.SetTickFunctionEnable(true);
+		}));
+}
+
+void UInstancedVisibleComponent::TickComponent(float DeltaTime, ELevelTick TickType, FActorComponentTickFunction* ThisTickFunction)
+{
+	Super::TickComponent(DeltaTime, TickType, ThisTickFunction);
+
+	UpdateVisibility();
+}
+
+void UInstancedVisibleComponent::UpdateVisibility(bool bForceChanged)
+{
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("InstancedVisibleComponent"), STAT_FogOfWarInstancedVisibleComponent, STATGROUP_FogOfWar);
+
+	const TSharedPtr<const FFogOfWarVisibilitySnapshot, ESPMode::ThreadSafe> Snapshot = FogOfWar->AcquireVisibilitySnapshot();
+	if (!Snapshot)
+	{
+		return;
+	}
+
+	bool bAnyInstancesNumChanged = false;
+	for (const FManagedInstancedMesh& ManagedMesh : ManagedMeshes)
+	{
+		const UInstancedStaticMeshComponent* InstancedMesh = ManagedMesh.Mesh.Get();
+		bAnyInstancesNumChanged |= InstancedMesh && InstancedMesh->GetInstanceCount() != ManagedMesh.InstanceVisibilities.Num();
+	}
+	// the static instances only depend on the fog
+	if (!bForceChanged && bStaticInstances && !bAnyInstancesNumChanged && Snapshot->GetVersion() == EvaluatedSnapshotVersion)
+	{
+		return;
+	}
+	EvaluatedSnapshotVersion = Snapshot->GetVersion();
+
+	for (FManagedInstancedMesh& ManagedMesh : ManagedMeshes)
+	{
+		UInstancedStaticMeshComponent* InstancedMesh = ManagedMesh.Mesh.Get();
+		if (!InstancedMesh)
+		{
+			continue;
+		}
+
+		const int InstancesNum = InstancedMesh->GetInstanceCount();
+		NewInstanceVisibilities.SetNumUninitialized(InstancesNum, false);
+		{
+			DECLARE_SCOPE_CYCLE_COUNTER(TEXT("InstancedVisibleComponent: evaluate"), STAT_FogOfWarInstancedVisibleComponentEvaluate, STATGROUP_FogOfWar);
+
+			// the snapshot is immutable, so the instances are evaluated on the worker threads. a single instance is too cheap to be worth a task of its own
+			constexpr int InstancesPerTask = 1024;
+			const FTransform ComponentTransform = InstancedMesh->GetComponentTransform();
+			ParallelFor(FMath::DivideAndRoundUp(InstancesNum, InstancesPerTask), [&](int TaskIndex)
+				{
+					const int EndInstanceIndex = FMath::Min((TaskIndex + 1) * InstancesPerTask, InstancesNum);
+					for (int InstanceIndex = TaskIndex * InstancesPerTask; InstanceIndex < EndInstanceIndex; InstanceIndex++)
+					{
+						const FVector WorldLocation = ComponentTransform.TransformPosition(InstancedMesh->PerInstanceSMData[InstanceIndex].Transform.GetOrigin());
+						NewInstanceVisibilities[InstanceIndex] = Snapshot->IsLocationVisible(WorldLocation);
+					}
+				});
+		}
+
+		// the removed instances shift the indexes and the new ones start with zeroed custom data, so everything is rewritten then
+		bool bWriteAll = bForceChanged || InstancesNum != ManagedMesh.InstanceVisibilities.Num();
+		if (InstancedMesh->NumCustomDataFloats <= CustomDataIndex)
+		{
+			InstancedMesh->SetNumCustomDataFloats(CustomDataIndex + 1);
+			bWriteAll = true;
+		}
+		ManagedMesh.InstanceVisibilities.SetNum(InstancesNum, false);
+
+		bool bAnyWritten = false;
+		for (int InstanceIndex = 0; InstanceIndex < InstancesNum; InstanceIndex++)
+		{
+			const bool bNewIsVisible = NewInstanceVisibilities[InstanceIndex];
+			if (!bWriteAll && ManagedMesh.InstanceVisibilities[InstanceIndex] == bNewIsVisible)
+			{
+				continue;
+			}
+			ManagedMesh.InstanceVisibilities[InstanceIndex] = bNewIsVisible;
+			// only queued into the instance update buffer, it's flushed once for the whole mesh below
+			InstancedMesh->SetCustomDataValue(InstanceIndex, CustomDataIndex, bNewIsVisible ? 1.0f : 0.0f, false);
+			bAnyWritten = true;
+		}
+
+		// the instance data is updated in place on the render thread, the scene proxy isn't recreated
+		if (bAnyWritten)
+		{
+			InstancedMesh->MarkRenderInstancesDirty();
+		}
+	}
+}
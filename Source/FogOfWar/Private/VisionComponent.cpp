@@ -17,7 +17,14 @@ void UVisionComponent::BeginPlay()
 		{
 			FogOfWar = Cast<AFogOfWar>(Object);
 
+			// the handle and the cached tile are set when the registration is applied
 			FogOfWar->RegisterVisionComponent(this);
+
+			// the fog is only notified when the owner moves, so it doesn't have to poll the static actors
+			if (USceneComponent* RootComponent = GetOwner()->GetRootComponent())
+			{
+				RootComponent->TransformUpdated.AddUObject(this, &UVisionComponent::OnOwnerTransformUpdated);
+			}
 		}));
 }
 
@@ -25,9 +32,15 @@ void UVisionComponent::EndPlay(const EEndPlayReason::Type EndPlayReason)
 {
 	Super::EndPlay(EndPlayReason);
 
+	if (USceneComponent* RootComponent = GetOwner()->GetRootComponent())
+	{
+		RootComponent->TransformUpdated.RemoveAll(this);
+	}
+
 	if (IsValid(FogOfWar))
 	{
 		FogOfWar->UnregisterVisionComponent(this);
+		VisionUnitHandle.Reset();
 	}
 }
 
@@ -49,11 +62,12 @@ void UVisionComponent::PostEditChangeChainProperty(FPropertyChangedChainEvent& P
 	// explanation with another solution: https://victor-istomin.github.io/c-with-crosses/posts/ue-post-edit-property/#conclusion-how-does-the-editor-change-a-property-of-a-_blueprint-constructed_-component
 
 	const FName PropertyName = PropertyChangedEvent.Property ? PropertyChangedEvent.Property->GetFName() : NAME_None;
-	if (PropertyName == GET_MEMBER_NAME_CHECKED(UVisionComponent, SightRadius))
+	if (PropertyName == GET_MEMBER_NAME_CHECKED(UVisionComponent, SightRadius) ||
+		PropertyName == GET_MEMBER_NAME_CHECKED(UVisionComponent, MaxSightRadius))
 	{
 		if (GetWorld()->IsGameWorld())
 		{
-			ReregisterToFogOfWar();
+			UpdateSightRadiusInFogOfWar();
 		}
 	}
 }
@@ -62,14 +76,33 @@ void UVisionComponent::PostEditChangeChainProperty(FPropertyChangedChainEvent& P
 void UVisionComponent::SetSightRadius(float NewSightRadius)
 {
 	SightRadius = NewSightRadius;
-	ReregisterToFogOfWar();
+	UpdateSightRadiusInFogOfWar();
+}
+
+void UVisionComponent::OnOwnerTransformUpdated(USceneComponent* UpdatedComponent, EUpdateTransformFlags UpdateTransformFlags, ETeleportType Teleport)
+{
+	if (!IsValid(FogOfWar) || !VisionUnitHandle.IsSet())
+	{
+		// the registration picks up the current location
+		return;
+	}
+
+	const FVector Location = UpdatedComponent->GetComponentLocation();
+	const int TileGlobalIndex = FogOfWar->GetTileGlobalIndexWithHysteresis(Location, CachedTileGlobalIndex);
+	if (TileGlobalIndex == CachedTileGlobalIndex)
+	{
+		// still on the same tile. nothing to recalculate
+		return;
+	}
+	CachedTileGlobalIndex = TileGlobalIndex;
+
+	FogOfWar->SetVisionUnitLocation(VisionUnitHandle, Location);
 }
 
-void UVisionComponent::ReregisterToFogOfWar()
+void UVisionComponent::UpdateSightRadiusInFogOfWar()
 {
 	if (IsValid(FogOfWar))
 	{
-		FogOfWar->UnregisterVisionComponent(this);
-		FogOfWar->RegisterVisionComponent(this);
+		FogOfWar->UpdateVisionComponentSightRadius(this);
 	}
 }
@@ -3,6 +3,13 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "VisionUnitHandle.h"
+#include "VisionOccluderHandle.h"
+#include "FogOfWarRecording.h"
+#include "FogOfWarHeightmap.h"
+#include "FogOfWarVisibilitySnapshot.h"
+#include "FogOfWarMovementTrace.h"
+#include "Utils/BitUtils.h"
 #include "FogOfWar.generated.h"
 
 DECLARE_LOG_CATEGORY_EXTERN(LogFogOfWar, Log, All)
@@ -10,31 +17,176 @@ DECLARE_LOG_CATEGORY_EXTERN(LogFogOfWar, Log, All)
 class UPostProcessComponent;
 class UVisionComponent;
 
+struct FFogOfWarLineOfSightQuery
+{
+	FVector From;
+
+	FVector To;
+};
+
 UCLASS(BlueprintType, Blueprintable)
 class FOGOFWAR_API AFogOfWar : public AActor
 {
 	GENERATED_BODY()
 
+	// the differential oracle (FogOfWar.Verify) sets up the grid and inspects the counters directly
+	friend class FFogOfWarVerification;
+	friend class FFogOfWarMovementTraceReplay;
+
 public:
 	AFogOfWar();
 
 public:
+	// The registrations and unregistrations are queued and applied at the start of the next tick, so a wave spawned or killed in one frame
+	// grows the storage once and is compacted in one pass, just like AddVisionUnits/RemoveVisionUnits. The component's handle is set on registration.
 	void RegisterVisionComponent(UVisionComponent* VisionComponent);
 
 	void UnregisterVisionComponent(UVisionComponent* VisionComponent);
 
+	// cheap compared to reregistering: the vision unit is updated in place without any allocations if the radius fits the reserved one
+	void UpdateVisionComponentSightRadius(UVisionComponent* VisionComponent);
+
+	// Adds a vision unit that is not backed by a VisionComponent. Its location must be pushed manually with SetVisionUnitLocation.
+	UFUNCTION(BlueprintCallable)
+	FVisionUnitHandle AddVisionUnit(FVector Location, float SightRadius, float MaxSightRadius = 0.0f);
+
+	UFUNCTION(BlueprintCallable)
+	void RemoveVisionUnit(FVisionUnitHandle Handle);
+
+	// A static vision source at a point without any actor, e.g. a reveal spell, a flare or a scouting ping. It's removed after Lifetime seconds of the game time,
+	// zero means it stays until RemoveVisionUnit. The expired sources are removed in a batch at the start of the tick, nothing is ticked per source.
+	UFUNCTION(BlueprintCallable)
+	FVisionUnitHandle AddTimedVisionUnit(FVector Location, float SightRadius, float Lifetime = 0.0f);
+
+	// For the spawned waves: the storage grows once for the whole batch. The vision is calculated in the next simulation steps (see MaxVisionUnitWarmUpsPerTick).
+	UFUNCTION(BlueprintCallable)
+	TArray<FVisionUnitHandle> AddVisionUnits(const TArray<FVector>& Locations, float SightRadius, float MaxSightRadius = 0.0f);
+
+	// For the death storms: the visibility of all vision units is released first, then the storage is compacted in one pass
+	// instead of swapping the units out one by one.
+	UFUNCTION(BlueprintCallable)
+	void RemoveVisionUnits(const TArray<FVisionUnitHandle>& Handles);
+
+	// marks the vision unit dirty only if it moved to another tile, so it's fine to call it every time the unit moves
+	UFUNCTION(BlueprintCallable)
+	void SetVisionUnitLocation(FVisionUnitHandle Handle, FVector Location);
+
+	UFUNCTION(BlueprintCallable)
+	void SetVisionUnitSightRadius(FVisionUnitHandle Handle, float SightRadius, float MaxSightRadius = 0.0f);
+
+	UFUNCTION(BlueprintPure)
+	bool IsVisionUnitValid(FVisionUnitHandle Handle) const;
+
+	// game thread only, the other threads should query AcquireVisibilitySnapshot
 	UFUNCTION(BlueprintCallable)
 	bool IsLocationVisible(FVector WorldLocation);
 
+	// INDEX_NONE if the location is outside the grid
+	int GetTileGlobalIndex(const FVector& WorldLocation) const;
+
+	// CurrentTileGlobalIndex while the location is within VisionUnitTileHysteresis outside of it, GetTileGlobalIndex otherwise.
+	// The tile-change checks of the vision units go through it, so the callers filtering the moves themselves should use it too.
+	int GetTileGlobalIndexWithHysteresis(const FVector& WorldLocation, int CurrentTileGlobalIndex) const;
+
+	// Same rules as the vision units use: the ray is traced over the tile heights with From.Z as the observer height. False if any point is outside the grid.
+	// Doesn't modify anything, so it's safe to call from worker threads as long as it doesn't overlap with the level streaming or the occluder edits on the game thread.
+	UFUNCTION(BlueprintPure)
+	bool HasLineOfSight(FVector From, FVector To) const;
+
+	// Every ray stops at the first blocking tile. Large batches are split across the worker threads.
+	void HasLineOfSightBatch(TConstArrayView<FFogOfWarLineOfSightQuery> Queries, TArrayView<bool> OutResults) const;
+
+	// The number of the visible tiles intersecting the box. Answered by the visibility pyramid, so large boxes are cheap.
+	UFUNCTION(BlueprintPure)
+	int GetVisibleTilesNumInBox(FBox2D WorldBox) const;
+
+	// Stops at the first visible tile found.
+	UFUNCTION(BlueprintPure)
+	bool IsAnyTileVisibleInBox(FBox2D WorldBox) const;
+
+	// XOR of the hashes of all visible tiles. It's updated incrementally when the tiles become visible or not visible,
+	// so the lockstep peers can compare it after every simulation step instead of exchanging the grid (see bDeterministicMode).
+	UFUNCTION(BlueprintPure)
+	FORCEINLINE_DEBUGGABLE int64 GetVisibilityChecksum() const { return static_cast<int64>(VisibilityChecksum); }
+
+	// The latest published visibility, nullptr until FogOfWar is activated. A new snapshot is published after every simulation step that changed the visibility.
+	// Can be called from any thread while FogOfWar is alive, the snapshot itself can be kept and queried for as long as needed.
+	TSharedPtr<const FFogOfWarVisibilitySnapshot, ESPMode::ThreadSafe> AcquireVisibilitySnapshot() const;
+
+	// Starts recording the tile visibility after every simulation step (see FFogOfWarRecording). Replaces the recording in progress.
+	void StartVisibilityRecording();
+
+	// the finalized recording, nullptr if nothing was being recorded
+	TSharedPtr<FFogOfWarRecording> StopVisibilityRecording();
+
+	// The snapshot texture shows the recording instead of the vision units, advancing by a tick every simulation step. No DDA runs for the recording.
+	// The vision units are not updated until the playback is stopped, the queries and the minimap keep using the live grid. Not available in the headless mode.
+	void StartVisibilityPlayback(TSharedRef<const FFogOfWarRecording> Recording);
+
+	// INDEX_NONE is the visibility before the first recorded tick
+	void SeekVisibilityPlayback(int Tick);
+
+	void SetVisibilityPlaybackPaused(bool bPaused);
+
+	// INDEX_NONE if nothing is being played
+	int GetVisibilityPlaybackTick() const;
+
+	void StopVisibilityPlayback();
+
+	// Starts recording what the vision units do (see FFogOfWarMovementTrace), the units that already exist are recorded as added. Replaces the trace in progress.
+	void StartMovementTraceRecording();
+
+	// the finalized trace, nullptr if nothing was being recorded
+	TSharedPtr<FFogOfWarMovementTrace> StopMovementTraceRecording();
+
+	// nullptr unless bCreateMinimapTexture is set
+	UFUNCTION(BlueprintPure)
+	FORCEINLINE_DEBUGGABLE UTexture2D* GetMinimapTexture() const { return MinimapTexture; }
+
+	// the CPU smooth visibility if it's uploaded (see bUploadSmoothVisibility), the final render target otherwise
 	UFUNCTION(BlueprintPure)
 	UTexture* GetFinalVisibilityTexture();
 
+	// The visibility with the fades from 0 (not visible) to 1 (visible), bilinearly filtered between the tile centers like the final texture.
+	// Read from the CPU pipeline without any GPU readback, zero unless bCalculateSmoothVisibilityOnCPU is set.
+	UFUNCTION(BlueprintPure)
+	float GetSmoothVisibility(FVector WorldLocation) const;
+
 	UFUNCTION(BlueprintCallable)
 	void SetCommonMIDParameters(UMaterialInstanceDynamic* MID);
 
 	UFUNCTION(BlueprintCallable)
 	void Activate();
 
+	// in the headless mode only the logical grid is maintained: no textures, render targets or materials are created
+	UFUNCTION(BlueprintPure)
+	FORCEINLINE_DEBUGGABLE bool IsHeadless() const { return bHeadless; }
+
+	// Blocks the vision over the tiles whose centers are inside the circle as if the ground there was raised to Height (world Z), e.g. smoke or a forest.
+	// Nothing is retraced, only the vision units whose areas intersect the occluder are recalculated. The overlapping occluders take the highest one.
+	UFUNCTION(BlueprintCallable)
+	FVisionOccluderHandle AddCircleOccluder(FVector2D Center, float Radius, float Height);
+
+	// covers every tile intersecting the box
+	UFUNCTION(BlueprintCallable)
+	FVisionOccluderHandle AddBoxOccluder(FBox2D Box, float Height);
+
+	// e.g. a gate that is closing
+	UFUNCTION(BlueprintCallable)
+	void SetOccluderHeight(FVisionOccluderHandle Handle, float Height);
+
+	UFUNCTION(BlueprintCallable)
+	void RemoveOccluder(FVisionOccluderHandle Handle);
+
+	UFUNCTION(BlueprintPure)
+	bool IsOccluderValid(FVisionOccluderHandle Handle) const;
+
+	// The chunks intersecting the area become resident (or stay resident longer, it's reference counted).
+	// Called automatically for the streamed levels if bStreamingAwareGrid is set, can also be used to drive the residency manually.
+	void AddResidentArea(const FBox& WorldBounds);
+
+	void RemoveResidentArea(const FBox& WorldBounds);
+
 protected:
 	UPROPERTY(EditAnywhere, BlueprintReadOnly)
 	TEnumAsByte<ECollisionChannel> HeightScanCollisionChannel = ECC_Camera;
@@ -45,19 +197,66 @@ protected:
 	UPROPERTY(EditAnywhere, BlueprintReadOnly)
 	bool bAutoActivate = true;
 
+	// The headless mode is enabled automatically on dedicated servers and with -nullrhi. This forces it everywhere else.
+	UPROPERTY(EditAnywhere, BlueprintReadOnly)
+	bool bForceHeadless = false;
+
 	UPROPERTY(EditInstanceOnly, BlueprintReadOnly)
 	AVolume* GridVolume = nullptr;
 
+	// If set, only the grid chunks covered by the loaded levels (World Partition cells, streaming levels and the persistent level) are resident.
+	// The rest of the grid holds no tiles and blocks the vision, so the memory and the height scan follow the streamed area.
+	UPROPERTY(EditAnywhere, BlueprintReadOnly)
+	bool bStreamingAwareGrid = false;
+
 	UPROPERTY(EditAnywhere, BlueprintReadOnly, meta = (ClampMin = 0.0f, UIMin = 0.0f))
 	float TileSize = 100.0f;
 
 	UPROPERTY(EditAnywhere, BlueprintReadOnly, meta = (ClampMin = 0.0f, UIMin = 0.0f))
 	float VisionBlockingDeltaHeightThreshold = 200.0f;
 
+	// Vision units with the same sight radius standing on the same tile share the vision calculations if their heights fall into the same band.
+	// Zero means that the heights must match exactly. Otherwise the vision is calculated from the bottom of the band, so it's an approximation.
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, meta = (ClampMin = 0.0f, UIMin = 0.0f))
+	float VisionSharingHeightBandSize = 0.0f;
+
+	// How many unused vision results are kept for every local area resolution to be reused without allocations.
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, meta = (ClampMin = 0, UIMin = 0))
+	int MaxPooledVisionResultsPerResolution = 64;
+
+	// How many results of the recently left tiles every vision unit keeps (e.g. jittering across a tile border, formation shuffling, patrolling back and forth).
+	// Returning to such a tile only applies the kept result to the visibility counters again without any ray casting. Zero (the default) disables it.
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, meta = (ClampMin = 0, UIMin = 0))
+	int MaxRecentVisionResultsPerUnit = 0;
+
+	// A vision unit only leaves its tile when it's farther than this outside of it, so jittering across the border doesn't recalculate anything.
+	// The vision stays calculated from the old tile meanwhile, so keep it well below TileSize. Rounded to whole units in the deterministic mode.
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, meta = (ClampMin = 0.0f, UIMin = 0.0f))
+	float VisionUnitTileHysteresis = 0.0f;
+
 	// The more the value, the less the impact of the new snapshot on the "history" will be and the smoother the transition will be.
 	UPROPERTY(EditAnywhere, meta = (ClampMin = 0.0f, UIMin = 0.0f))
 	float ApproximateSecondsToAbsorbNewSnapshot = 0.1f;
 
+	// The grid visibility only depends on integer math: the locations and the heights are rounded to whole units, TileSize and the thresholds are rounded on activation,
+	// and the rays are traced with integer DDA. Use it for the lockstep multiplayer together with GetVisibilityChecksum.
+	UPROPERTY(EditAnywhere, BlueprintReadOnly)
+	bool bDeterministicMode = false;
+
+	// How often the visibility recording stores the full grid. Seeking decodes up to this many ticks, the larger values compress better.
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, meta = (ClampMin = 1, UIMin = 1))
+	int RecordingTicksPerKeyframe = 64;
+
+	// How many vision units without the calculated vision (e.g. just added) can get it per simulation step, the rest wait for the next steps.
+	// Spreads the raycasting of a spawned wave over several frames. Zero means no limit.
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, meta = (ClampMin = 0, UIMin = 0))
+	int MaxVisionUnitWarmUpsPerTick = 0;
+
+	// How many times per second the vision units are updated and the new snapshot is uploaded. Zero means every frame.
+	// The snapshot interpolation still runs every frame, so the transitions stay smooth.
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, meta = (ClampMin = 0.0f, UIMin = 0.0f, UIMax = 60.0f))
+	float SimulationRate = 0.0f;
+
 	// All pixels with visibility less than this value will be zeroed out.
 	UPROPERTY(EditAnywhere, meta = (ClampMin = 0.0f, UIMin = 0.0f, ClampMax = 1.0f, UIMax = 1.0f))
 	float MinimalVisibility = 0.1f;
@@ -65,6 +264,24 @@ protected:
 	UPROPERTY(EditAnywhere, meta = (ClampMin = 0.0f, UIMin = 0.0f, ClampMax = 1.0f, UIMax = 1.0f))
 	float NotVisibleRegionBrightness = 0.1f;
 
+	// Also runs the interpolation, the MinimalVisibility cutoff and the super sampling (the steps 2-4 of the render pipeline) on the CPU with SIMD,
+	// so gameplay can read the fades with GetSmoothVisibility. Works in the headless mode too.
+	UPROPERTY(EditAnywhere, BlueprintReadOnly)
+	bool bCalculateSmoothVisibilityOnCPU = false;
+
+	// The CPU result is uploaded as the final visibility texture and the GPU passes 2-4 are skipped.
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, meta = (EditCondition = "bCalculateSmoothVisibilityOnCPU"))
+	bool bUploadSmoothVisibility = false;
+
+	// Creates a low resolution texture with the fraction of the visible tiles in every cell of the MinimapPyramidLevel of the visibility pyramid.
+	// It's filled from the pyramid together with the snapshot, so it doesn't depend on the render targets.
+	UPROPERTY(EditAnywhere, BlueprintReadOnly)
+	bool bCreateMinimapTexture = false;
+
+	// Every minimap pixel covers (1 << MinimapPyramidLevel) x (1 << MinimapPyramidLevel) tiles.
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, meta = (ClampMin = 1, UIMin = 1, UIMax = 6, EditCondition = "bCreateMinimapTexture"))
+	int MinimapPyramidLevel = 2;
+
 	UPROPERTY(EditAnywhere, Category = "FogOfWar|Materials")
 	UMaterialInterface* InterpolationMaterial;
 
@@ -92,38 +309,83 @@ protected:
 #endif
 
 protected:
+	// the traced heights live in the shared heightmap, only the per-instance state is here
 	struct FTile
 	{
-		float Height;
-
 		int VisibilityCounter = 0;
 	};
 
-	// some data for every vision unit, i.e. VisionComponent
-	// for now we cache tiles states in the local area of the unit not to update them when the vision unit is not moving
-	struct FVisionUnitData
+	// the tiles are stored chunk by chunk, so the chunks can be loaded and unloaded with the level streaming
+	struct FTileChunk
 	{
-		enum class TileState : uint8
+		// the chunk's heights in the shared heightmap, nullptr if the chunk is not resident. the chunk holds a reference to them while it's resident
+		const float* Heights = nullptr;
+
+		// the highest occluder covering every tile (-infinity if none), empty if the chunk is not resident
+		TArray<float> OccluderHeights;
+
+		// empty if the chunk is not resident
+		TArray<FTile> Tiles;
+
+		// the highest tile (or occluder) in the chunk. if it's not blocking the vision, none of the chunk's tiles are
+		// infinity if the chunk is not resident, so it blocks everything
+		float MaxHeight = std::numeric_limits<float>::infinity();
+
+		// the number of the resident areas covering the chunk
+		int ResidencyCounter = 0;
+
+		FORCEINLINE_DEBUGGABLE bool IsResident() const { return Heights != nullptr; }
+	};
+
+	// precomputed tiles within the radius around the origin tile
+	// used to apply the visibility without ray casting when nothing in the local area can block the vision
+	struct FVisionDiscStamp
+	{
+		// half width (in tiles) of every row of the disc, rows go from -GetRowsHalfNum() to GetRowsHalfNum() relative to the origin tile
+		TArray<int> RowHalfWidths;
+
+		FORCEINLINE_DEBUGGABLE int GetRowsHalfNum() const { return RowHalfWidths.Num() / 2; }
+	};
+
+	// vision units with equal keys see exactly the same tiles, so they can share the same vision result
+	struct FVisionResultKey
+	{
+		int OriginGlobalIndex;
+
+		// the visible tiles only depend on the integer squared radius, so the units with slightly different radii still share
+		int GridSpaceRadiusSqr;
+
+		// observer height snapped to VisionSharingHeightBandSize
+		float ObserverHeight;
+
+		FORCEINLINE_DEBUGGABLE bool operator==(const FVisionResultKey& Other) const
+		{
+			return OriginGlobalIndex == Other.OriginGlobalIndex && GridSpaceRadiusSqr == Other.GridSpaceRadiusSqr && ObserverHeight == Other.ObserverHeight;
+		}
+
+		friend FORCEINLINE_DEBUGGABLE uint32 GetTypeHash(const FVisionResultKey& Key)
 		{
-			Unknown,
-			NotVisible,
-			Visible
-		};
+			return HashCombineFast(HashCombineFast(::GetTypeHash(Key.OriginGlobalIndex), ::GetTypeHash(Key.GridSpaceRadiusSqr)), ::GetTypeHash(Key.ObserverHeight));
+		}
+	};
 
-		const int LocalAreaTilesResolution;
+	// cached visible tiles in the local area of the vision unit(s), so we don't update them when the vision units are not moving
+	struct FVisionResult
+	{
+		int LocalAreaTilesResolution = 0;
 
-		const float GridSpaceRadius;
+		// the local area resolution the buffers were allocated for, can be more than the actual one. it's the bucket in the results pool
+		int ReservedLocalAreaTilesResolution = 0;
 
 		FIntVector2 LocalAreaCachedMinIJ;
 
-		// I'm pretty sure this array can be made global and shared between all vision units. Needs some thinking
-		TArray<TileState> LocalAreaTilesCachedStates;
-
-		int CachedOriginGlobalIndex;
+		// one bit per local tile, indexed by the local index
+		TArray<uint64> LocalAreaVisibleTilesBits;
 
-		bool bHasCachedData = false;
+		FVisionResultKey Key;
 
-		FORCEINLINE_DEBUGGABLE bool HasCachedData() const { return bHasCachedData; }
+		// the amount of vision units using this result. the result contributes to the visibility counters only once regardless of it
+		int Multiplicity = 0;
 
 		FORCEINLINE_DEBUGGABLE int GetLocalIndex(FIntVector2 IJ) const { return IJ.X * LocalAreaTilesResolution + IJ.Y; }
 
@@ -131,18 +393,60 @@ protected:
 
 		FORCEINLINE_DEBUGGABLE bool IsLocalIJValid(FIntVector2 IJ) { return (IJ.X >= 0) & (IJ.Y >= 0) & (IJ.X < LocalAreaTilesResolution) & (IJ.Y < LocalAreaTilesResolution); }
 
-		FORCEINLINE_DEBUGGABLE TileState& GetLocalTileState(int LocalIndex) { return LocalAreaTilesCachedStates[LocalIndex]; }
+		FORCEINLINE_DEBUGGABLE bool IsLocalTileVisible(int LocalIndex) const { return BitUtils::Test(LocalAreaVisibleTilesBits.GetData(), LocalIndex); }
 
-		FORCEINLINE_DEBUGGABLE TileState& GetLocalTileState(FIntVector2 IJ) { checkSlow(IsLocalIJValid(IJ)); return GetLocalTileState(GetLocalIndex(IJ)); }
+		FORCEINLINE_DEBUGGABLE void SetLocalTileVisible(int LocalIndex) { BitUtils::Set(LocalAreaVisibleTilesBits.GetData(), LocalIndex); }
+
+		FORCEINLINE_DEBUGGABLE void SetLocalTileVisible(FIntVector2 IJ) { checkSlow(IsLocalIJValid(IJ)); SetLocalTileVisible(GetLocalIndex(IJ)); }
+
+		// calls Functor(GlobalIJ) for every visible tile
+		template<typename FunctorType>
+		FORCEINLINE_DEBUGGABLE void ForEachVisibleTile(FunctorType&& Functor) const
+		{
+			BitUtils::ForEachSetBit(LocalAreaVisibleTilesBits.GetData(), LocalAreaVisibleTilesBits.Num(), [this, &Functor](int LocalIndex)
+				{
+					Functor(LocalToGlobal({ LocalIndex / LocalAreaTilesResolution, LocalIndex % LocalAreaTilesResolution }));
+				});
+		}
 
 		FORCEINLINE_DEBUGGABLE FIntVector2 LocalToGlobal(FIntVector2 LocalIJ) const { return LocalAreaCachedMinIJ + LocalIJ; }
 
 		FORCEINLINE_DEBUGGABLE FIntVector2 GlobalToLocal(FIntVector2 GlobalIJ) const { return GlobalIJ - LocalAreaCachedMinIJ; }
 	};
 
+	// some data for every vision unit, i.e. VisionComponent
+	struct FVisionUnitData
+	{
+		int LocalAreaTilesResolution = 0;
+
+		// the vision unit's results are allocated for this resolution, so the sight radius can be changed up to it without any allocations
+		int ReservedLocalAreaTilesResolution = 0;
+
+		float GridSpaceRadius = 0.0f;
+
+		// a tile is within the radius if the squared distance between the tile centers is not more than this
+		int GridSpaceRadiusSqr = 0;
+
+		// shared between all vision units with the same radius
+		TSharedPtr<const FVisionDiscStamp> DiscStamp;
+
+		// shared between all vision units with the same FVisionResultKey
+		TSharedPtr<FVisionResult> Result;
+
+		// the results of the tiles the vision unit has recently left, the most recent first (see MaxRecentVisionResultsPerUnit)
+		// nobody else uses them, so they don't contribute to the visibility counters
+		TArray<TSharedPtr<FVisionResult>, TInlineAllocator<2>> RecentResults;
+
+		FORCEINLINE_DEBUGGABLE bool HasCachedData() const { return Result.IsValid(); }
+	};
+
 protected:
 	virtual void BeginPlay() override;
 
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
+	virtual void BeginDestroy() override;
+
 #if WITH_EDITOR
 	UFUNCTION(CallInEditor, Category = "FogOfWar", DisplayName = "RefreshVolume")
 	void RefreshVolumeInEditor();
@@ -157,15 +461,142 @@ protected:
 protected:
 	void Initialize();
 
-	void ResetCachedVisibilities(FVisionUnitData& VisionUnitData);
+	// everything Activate does except the render pipeline and the registration with the manager, so a standalone FogOfWar can simulate the grid
+	void InitializeSimulation();
 
-	void UpdateVisibilities(const FVector3d& OriginWorldLocation, FVisionUnitData& VisionUnitData);
+	// GridSize, GridResolution and ChunkResolution for the area, the chunks themselves are not touched
+	void InitializeGrid(const FVector2D& BottomLeftWorldLocation, const FVector2D& Size);
 
-	void CalculateTileHeight(FTile& Tile, FIntVector2 TileIJ);
+	void OnLevelAddedToWorld(ULevel* Level, UWorld* World);
 
-	FVisionUnitData CreateVisionUnitDataFromVisionComponent(UVisionComponent* VisionComponent);
+	void OnLevelRemovedFromWorld(ULevel* Level, UWorld* World);
 
-	UTexture2D* CreateSnapshotTexture();
+	// bRetraceResidentChunks is false during the initialization, when the resident chunks already have the level in them
+	void AddResidentLevel(ULevel* Level, bool bRetraceResidentChunks);
+
+	// retraces the tiles of the level bounds in every referenced chunk of the shared heightmap, once per event for all the instances
+	void RetraceLevelArea(const ULevel* Level, const FBox& LevelBounds, bool bLevelAdded);
+
+	void OnHeightmapTilesRetraced(FIntVector2 MinIJ, FIntVector2 MaxIJ);
+
+	void UpdateAreaResidency(const FBox& WorldBounds, int ResidencyCounterDelta);
+
+	void LoadTileChunk(int ChunkIndex);
+
+	void UnloadTileChunk(int ChunkIndex);
+
+	// the vision results intersecting the area are released (so nobody can share them anymore), their vision units are remembered for RecalculateInvalidatedVisionUnits
+	void InvalidateVisionUnitsInArea(FIntVector2 MinIJ, FIntVector2 MaxIJ);
+
+	// called right after the heights or the residency have changed, so the invalidated area is never left dark until the next update
+	void RecalculateInvalidatedVisionUnits();
+
+	struct FVisionOccluder
+	{
+		// the bounds of the covered tiles, not clamped to the grid
+		FIntVector2 MinIJ = { 0, 0 };
+
+		FIntVector2 MaxIJ = { -1, -1 };
+
+		bool bIsCircle = false;
+
+		FVector2f GridSpaceCenter = FVector2f::ZeroVector;
+
+		float GridSpaceRadiusSqr = 0.0f;
+
+		float Height = -std::numeric_limits<float>::infinity();
+
+		// removed occluders stay in the array (with bIsActive unset) until their index is reused
+		bool bIsActive = false;
+
+		int Generation = 0;
+
+		FORCEINLINE_DEBUGGABLE bool Covers(FIntVector2 IJ) const
+		{
+			return !bIsCircle || FMath::Square(IJ.X + 0.5f - GridSpaceCenter.X) + FMath::Square(IJ.Y + 0.5f - GridSpaceCenter.Y) <= GridSpaceRadiusSqr;
+		}
+	};
+
+	FVisionOccluderHandle AddOccluderInternal(const FVisionOccluder& NewOccluder);
+
+	int GetOccluderIndex(FVisionOccluderHandle Handle) const;
+
+	// Rebuilds OccluderHeights of the resident tiles in the area from the active occluders and updates the max heights of the chunks.
+	// The vision units are not touched.
+	void StampOccluders(FIntVector2 MinIJ, FIntVector2 MaxIJ);
+
+	// StampOccluders followed by the recalculation of the vision units seeing the area
+	void UpdateOccludedArea(FIntVector2 MinIJ, FIntVector2 MaxIJ);
+
+	void InitializeRenderPipeline();
+
+	// copies VisibleTilesBits into a new snapshot and swaps it with the published one
+	void PublishVisibilitySnapshot();
+
+	void UpdateVisionUnits();
+
+	// applies the queued RegisterVisionComponent/UnregisterVisionComponent calls
+	void ApplyPendingVisionComponents();
+
+	// grows the storage once for the vision units about to be added
+	void ReserveVisionUnits(int AddedNum);
+
+	// removes the timed vision units whose lifetime is over
+	void ExpireTimedVisionUnits();
+
+	void UpdateRenderPipeline(float DeltaSeconds, bool bUpdateSnapshot);
+
+	// the steps 2-4 of the render pipeline on the CPU
+	void UpdateSmoothVisibility(float DeltaSeconds, bool bUpdateSnapshot);
+
+	void ResetCachedVisibilities(FVisionResult& VisionResult);
+
+	// stops using the vision unit's result. the result's visibility is removed from the grid when nobody uses it anymore
+	// if bKeepRecent, such a result goes to the vision unit's recent results instead of the pool
+	void ReleaseVisionResult(int VisionUnitIndex, bool bKeepRecent = false);
+
+	// pools the recent results of the vision unit, e.g. when the sight radius is changed and they can't match anymore
+	void ForgetRecentVisionResults(FVisionUnitData& VisionUnitData);
+
+	// the result must not be used by anybody
+	void PoolVisionResult(const TSharedPtr<FVisionResult>& VisionResult);
+
+	void UpdateVisibilities(int VisionUnitIndex);
+
+	void CalculateVisionResult(const FVector2f& OriginGridLocation, const FVisionUnitData& VisionUnitData, FVisionResult& VisionResult);
+
+	float CalculateTileHeight(FIntVector2 TileIJ) const;
+
+	// checks the chunks max heights, so it's conservative: false doesn't mean that something is actually blocking the vision
+	bool IsAreaFreeOfVisionBlockers(float ObserverHeight, FIntVector2 MinIJ, FIntVector2 MaxIJ);
+
+	void ApplyVisionDiscStamp(FIntVector2 OriginGlobalIJ, const FVisionDiscStamp& DiscStamp, FVisionResult& VisionResult);
+
+	TSharedPtr<const FVisionDiscStamp> GetOrCreateVisionDiscStamp(int GridSpaceRadiusSqr);
+
+	FVisionUnitHandle AddVisionUnitInternal(const FVector& Location, float SightRadius, float ReservedSightRadius, UVisionComponent* VisionComponent);
+
+	void RemoveVisionUnitInternal(int VisionUnitIndex);
+
+	// everything about the removal except the dense arrays: the results, the trace and the slot. The slot index of the vision unit becomes INDEX_NONE
+	void ReleaseVisionUnit(int VisionUnitIndex);
+
+	void MarkVisionUnitDirty(int VisionUnitIndex);
+
+	// removes the vision units with INDEX_NONE slot index from the dense arrays, preserving the order of the rest
+	void CompactVisionUnits();
+
+	// returns INDEX_NONE if the handle is stale
+	int GetVisionUnitIndex(FVisionUnitHandle Handle) const;
+
+	void InitializeVisionUnitSightRadius(FVisionUnitData& VisionUnitData, float SightRadius, float ReservedSightRadius);
+
+	FORCEINLINE_DEBUGGABLE int GetLocalAreaTilesResolution(float SightRadius) const { return FMath::CeilToInt32(SightRadius * 2 / TileSize) + 1; }
+
+	// takes a result from the pool or allocates a new one if the pool is empty
+	TSharedPtr<FVisionResult> AcquireVisionResult(int ReservedLocalAreaTilesResolution);
+
+	UTexture2D* CreateSnapshotTexture(FIntVector2 Resolution);
 
 	UTextureRenderTarget2D* CreateRenderTarget();
 
@@ -175,27 +606,100 @@ protected:
 
 	void WriteVisionDataToTexture(UTexture2D* Texture);
 
+	// a byte per tile in the global index order: 0xFF if visible, 0 otherwise
+	void GatherVisionData(TArrayView<uint8> VisionData) const;
+
+	void WriteMinimapDataToTexture(UTexture2D* Texture);
+
+	void InitializeVisibilityPyramid();
+
+	FORCEINLINE_DEBUGGABLE void UpdateVisibilityPyramid(FIntVector2 GlobalIJ, int VisibleTilesNumDelta);
+
+	// the number of the visible tiles of the cell that are within [MinIJ, MaxIJ]. Level 0 is the tiles themselves
+	int CountVisibleTilesInPyramidCell(int Level, FIntVector2 CellIJ, FIntVector2 MinIJ, FIntVector2 MaxIJ, bool bAnyIsEnough) const;
+
+	int CountVisibleTilesInBox(const FBox2D& WorldBox, bool bAnyIsEnough) const;
+
 	FORCEINLINE_DEBUGGABLE int GetGlobalIndex(FIntVector2 IJ) const { return IJ.X * GridResolution.Y + IJ.Y; }
 
-	FORCEINLINE_DEBUGGABLE FIntVector2 GetTileIJ(int GlobalIndex) { return { GlobalIndex / GridResolution.Y, GlobalIndex % GridResolution.Y }; }
+	FORCEINLINE_DEBUGGABLE FIntVector2 GetTileIJ(int GlobalIndex) const { return { GlobalIndex / GridResolution.Y, GlobalIndex % GridResolution.Y }; }
+
+	FORCEINLINE_DEBUGGABLE int GetTileIndexInChunk(FIntVector2 IJ) const { return ((IJ.X & TileChunkSizeMask) << TileChunkSizeLog2) | (IJ.Y & TileChunkSizeMask); }
+
+	// the tile must be in a resident chunk
+	FORCEINLINE_DEBUGGABLE FTile& GetGlobalTile(FIntVector2 IJ) { checkSlow(IsGlobalIJValid(IJ)); checkSlow(IsTileResident(IJ)); return TileChunks[GetChunkIndex(IJ)].Tiles[GetTileIndexInChunk(IJ)]; }
+
+	FORCEINLINE_DEBUGGABLE const FTile& GetGlobalTile(FIntVector2 IJ) const { checkSlow(IsGlobalIJValid(IJ)); checkSlow(IsTileResident(IJ)); return TileChunks[GetChunkIndex(IJ)].Tiles[GetTileIndexInChunk(IJ)]; }
+
+	FORCEINLINE_DEBUGGABLE bool IsTileResident(FIntVector2 IJ) const { return TileChunks[GetChunkIndex(IJ)].IsResident(); }
+
+	// the height the tile blocks the vision at: the traced height or an occluder, whichever is higher
+	// infinity for the tiles of the chunks that are not resident, so they block the vision
+	FORCEINLINE_DEBUGGABLE float GetTileHeight(FIntVector2 IJ) const
+	{
+		const FTileChunk& TileChunk = TileChunks[GetChunkIndex(IJ)];
+		if (!TileChunk.IsResident())
+		{
+			return std::numeric_limits<float>::infinity();
+		}
+		const int TileIndex = GetTileIndexInChunk(IJ);
+		const float Height = TileChunk.Heights[TileIndex];
+		return FMath::Max(Height, TileChunk.OccluderHeights[TileIndex]);
+	}
+
+	FORCEINLINE_DEBUGGABLE bool IsGlobalIJValid(FIntVector2 IJ) const { return (IJ.X >= 0) & (IJ.Y >= 0) & (IJ.X < GridResolution.X) & (IJ.Y < GridResolution.Y); }
+
+	FORCEINLINE_DEBUGGABLE int GetChunkIndex(FIntVector2 TileIJ) const { return (TileIJ.X >> TileChunkSizeLog2) * ChunkResolution.Y + (TileIJ.Y >> TileChunkSizeLog2); }
+
+	FORCEINLINE_DEBUGGABLE FIntVector2 GetChunkMinIJ(int ChunkIndex) const { return { (ChunkIndex / ChunkResolution.Y) << TileChunkSizeLog2, (ChunkIndex % ChunkResolution.Y) << TileChunkSizeLog2 }; }
+
+	// calls Functor(IJ) for every tile of the chunk that is inside the grid (the chunks on the border are partial)
+	template<typename FunctorType>
+	FORCEINLINE_DEBUGGABLE void ForEachTileInChunk(int ChunkIndex, FunctorType&& Functor) const
+	{
+		const FIntVector2 ChunkMinIJ = GetChunkMinIJ(ChunkIndex);
+		const int MaxI = FMath::Min(ChunkMinIJ.X + (1 << TileChunkSizeLog2), GridResolution.X);
+		const int MaxJ = FMath::Min(ChunkMinIJ.Y + (1 << TileChunkSizeLog2), GridResolution.Y);
+		for (int I = ChunkMinIJ.X; I < MaxI; I++)
+		{
+			for (int J = ChunkMinIJ.Y; J < MaxJ; J++)
+			{
+				Functor(FIntVector2(I, J));
+			}
+		}
+	}
+
+	FORCEINLINE_DEBUGGABLE FVector2f ConvertWorldSpaceLocationToGridSpace(const FVector2D& WorldLocation) const;
+
+	FORCEINLINE_DEBUGGABLE FVector2D ConvertTileIJToTileCenterWorldLocation(const FIntVector2& IJ) const;
+
+	FORCEINLINE_DEBUGGABLE FIntVector2 ConvertGridLocationToTileIJ(const FVector2f& GridLocation) const;
+
+	FORCEINLINE_DEBUGGABLE FIntVector2 ConvertWorldLocationToTileIJ(const FVector2D& WorldLocation) const;
 
-	FORCEINLINE_DEBUGGABLE FTile& GetGlobalTile(int GlobalIndex) { return Tiles[GlobalIndex]; }
+	// all visibility counters changes must go through these to track the tiles that become visible or not visible
+	FORCEINLINE_DEBUGGABLE void IncrementVisibilityCounter(FIntVector2 GlobalIJ);
 
-	FORCEINLINE_DEBUGGABLE FTile& GetGlobalTile(FIntVector2 IJ) { checkSlow(IsGlobalIJValid(IJ)); return GetGlobalTile(GetGlobalIndex(IJ)); }
+	FORCEINLINE_DEBUGGABLE void DecrementVisibilityCounter(FIntVector2 GlobalIJ);
 
-	FORCEINLINE_DEBUGGABLE bool IsGlobalIJValid(FIntVector2 IJ) { return (IJ.X >= 0) & (IJ.Y >= 0) & (IJ.X < GridResolution.X) & (IJ.Y < GridResolution.Y); }
+	FORCEINLINE_DEBUGGABLE bool IsBlockingVision(float ObserverHeight, float PotentialObstacleHeight) const;
 
-	FORCEINLINE_DEBUGGABLE FVector2f ConvertWorldSpaceLocationToGridSpace(const FVector2D& WorldLocation);
+	FORCEINLINE_DEBUGGABLE bool IsLocalTileKnown(int LocalIndex) const { return BitUtils::Test(DDAKnownLocalTilesBits.GetData(), LocalIndex); }
 
-	FORCEINLINE_DEBUGGABLE FVector2D ConvertTileIJToTileCenterWorldLocation(const FIntVector2& IJ);
+	FORCEINLINE_DEBUGGABLE void SetLocalTileKnown(int LocalIndex) { BitUtils::Set(DDAKnownLocalTilesBits.GetData(), LocalIndex); }
 
-	FORCEINLINE_DEBUGGABLE FIntVector2 ConvertGridLocationToTileIJ(const FVector2f& GridLocation);
+	// Walks the tiles of the DDA ray from IJ to TargetIJ (both inclusive) while Functor(IJ) returns true.
+	// Explanation here: https://www.youtube.com/watch?v=NbSee-XM7WA
+	// bIntegerMath gives the same steps without the floating point (apart from the exact ties where the float rounding decides)
+	template<bool bIntegerMath, typename FunctorType>
+	static FORCEINLINE_DEBUGGABLE void WalkDDARay(FIntVector2 IJ, const FIntVector2 TargetIJ, FunctorType&& Functor);
 
-	FORCEINLINE_DEBUGGABLE FIntVector2 ConvertWorldLocationToTileIJ(const FVector2D& WorldLocation);
+	// the height of the observer standing at this Z, snapped to VisionSharingHeightBandSize
+	float GetObserverHeight(double WorldZ) const;
 
-	FORCEINLINE_DEBUGGABLE bool IsBlockingVision(float ObserverHeight, float PotentialObstacleHeight);
+	FORCEINLINE_DEBUGGABLE void ExecuteDDAVisibilityCheck(float ObserverHeight, FIntVector2 LocalIJ, FIntVector2 OriginLocalIJ, FVisionResult& VisionResult);
 
-	FORCEINLINE_DEBUGGABLE void ExecuteDDAVisibilityCheck(float ObserverHeight, FIntVector2 LocalIJ, FIntVector2 OriginLocalIJ, FVisionUnitData& VisionUnitData);
+	FORCEINLINE_DEBUGGABLE bool IsRayBlocked(float ObserverHeight, FIntVector2 FromGlobalIJ, FIntVector2 ToGlobalIJ) const;
 
 protected:
 	UPROPERTY(VisibleInstanceOnly)
@@ -207,6 +711,14 @@ protected:
 	UPROPERTY(VisibleInstanceOnly)
 	FVector2D GridBottomLeftWorldLocation = FVector2D::Zero();
 
+	// the grid is split into square chunks with the side of (1 << TileChunkSizeLog2) tiles
+	static constexpr int TileChunkSizeLog2 = 4;
+
+	static constexpr int TileChunkSizeMask = (1 << TileChunkSizeLog2) - 1;
+
+	UPROPERTY(VisibleInstanceOnly)
+	FIntVector2 ChunkResolution = {};
+
 #if WITH_EDITORONLY_DATA
 	UPROPERTY(VisibleInstanceOnly, Category = "FogOfWar|Textures")
 	UTexture2D* HeightmapTexture = nullptr;
@@ -215,6 +727,15 @@ protected:
 	UPROPERTY(VisibleInstanceOnly, Category = "FogOfWar|Textures")
 	UTexture2D* SnapshotTexture = nullptr;
 
+	UPROPERTY(VisibleInstanceOnly, Category = "FogOfWar|Textures")
+	UTexture2D* MinimapTexture = nullptr;
+
+	// replaces FinalVisibilityTextureRenderTarget if bUploadSmoothVisibility is set
+	UPROPERTY(VisibleInstanceOnly, Category = "FogOfWar|Textures")
+	UTexture2D* SmoothVisibilityTexture = nullptr;
+
+	TArray<uint8> MinimapDataBuffer;
+
 	UPROPERTY(VisibleInstanceOnly, Category = "FogOfWar|Textures")
 	UTextureRenderTarget2D* VisibilityTextureRenderTarget = nullptr;
 
@@ -236,11 +757,99 @@ protected:
 	UPROPERTY()
 	UMaterialInstanceDynamic* PostProcessingMID;
 
-	TArray<FTile> Tiles;
+	TArray<FTileChunk> TileChunks;
+
+	// shared with the other instances over the same volume, see FFogOfWarHeightmap
+	TSharedPtr<FFogOfWarHeightmap> Heightmap;
+
+	// the bounds each level was added with, so exactly the same area is released when it's unloaded
+	TMap<TObjectKey<ULevel>, FBox> ResidentLevelBounds;
+
+	TMap<int, TSharedPtr<const FVisionDiscStamp>> VisionDiscStamps;
 
 	TArray<uint8> TextureDataBuffer;
 
-	TMap<UVisionComponent*, FVisionUnitData> RegisteredVisions;
+	// the level L (starting from 1) counts the visible tiles in the cells of (1 << L) x (1 << L) tiles, so VisibilityPyramid[L - 1] is the level L
+	// every level is updated when a visibility counter crosses zero, the last level is a single cell with the whole grid
+	struct FVisibilityPyramidLevel
+	{
+		FIntVector2 Resolution;
+
+		TArray<int> VisibleTilesNums;
+	};
+
+	TArray<FVisibilityPyramidLevel> VisibilityPyramid;
+
+	// the vision units are stored densely as a structure of arrays (indexed by the vision unit index), so per-tick scans are linear passes
+	// removal swaps the last vision unit into the hole, so the indexes are not stable. use FVisionUnitHandle to reference the vision units
+	TArray<FVisionUnitData> VisionUnits;
+
+	TArray<FVector> VisionUnitLocations;
+
+	// the origin tile of the vision unit's current result or INDEX_NONE if it has no result
+	TArray<int> VisionUnitCachedOriginGlobalIndexes;
+
+	// nullptr if the vision unit is not backed by a VisionComponent
+	TArray<UVisionComponent*> VisionUnitComponents;
+
+	TArray<int> VisionUnitSlotIndexes;
+
+	TArray<bool> VisionUnitDirtyFlags;
+
+	// the vision units pushed since the last update. slot indexes are stored because the dense indexes may change until then
+	// only the units on this list are recalculated, so the update cost scales with the number of moving units
+	TArray<int> DirtyVisionUnitSlotIndexes;
+
+	// the dirty vision units that ran out of MaxVisionUnitWarmUpsPerTick, kept here not to reallocate every tick
+	TArray<int> DeferredDirtyVisionUnitSlotIndexes;
+
+	struct FVisionUnitSlot
+	{
+		int VisionUnitIndex = INDEX_NONE;
+
+		int Generation = 0;
+	};
+
+	// the handles point to the slots and the slots point to the dense vision units
+	TArray<FVisionUnitSlot> VisionUnitSlots;
+
+	TArray<int> FreeVisionUnitSlotIndexes;
+
+	struct FTimedVisionUnit
+	{
+		double ExpirationTime;
+
+		// may already be removed manually, then it's skipped on expiration
+		FVisionUnitHandle Handle;
+
+		FORCEINLINE_DEBUGGABLE bool operator<(const FTimedVisionUnit& Other) const { return ExpirationTime < Other.ExpirationTime; }
+	};
+
+	// a min-heap by the expiration time, so only the top has to be checked every tick
+	TArray<FTimedVisionUnit> TimedVisionUnits;
+
+	// kept here not to reallocate every tick
+	TArray<FVisionUnitHandle> ExpiredVisionUnitHandles;
+
+	// registered since the last tick, not added yet
+	TArray<UVisionComponent*> PendingVisionComponents;
+
+	// unregistered since the last tick, still holding their vision
+	TArray<FVisionUnitHandle> PendingUnregisteredVisionUnitHandles;
+
+	// between InvalidateVisionUnitsInArea and RecalculateInvalidatedVisionUnits
+	TArray<int> InvalidatedVisionUnitIndexes;
+
+	// indexed by FVisionOccluderHandle::Index
+	TArray<FVisionOccluder> Occluders;
+
+	TArray<int> FreeOccluderIndexes;
+
+	// all vision results that are currently in use. every result is applied to the visibility counters exactly once
+	TMap<FVisionResultKey, TSharedPtr<FVisionResult>> VisionResults;
+
+	// unused vision results with their buffers, bucketed by the reserved local area resolution
+	TMap<int, TArray<TSharedPtr<FVisionResult>>> VisionResultsPool;
 
 #if WITH_EDITORONLY_DATA
 	UPROPERTY(VisibleInstanceOnly)
@@ -248,12 +857,133 @@ protected:
 
 	UPROPERTY(VisibleInstanceOnly)
 	int64 TotalRegisteredVisionsCacheTilesNum = 0;
+
+	UPROPERTY(VisibleInstanceOnly)
+	int VisionResultsNum = 0;
+
+	UPROPERTY(VisibleInstanceOnly)
+	int PooledVisionResultsNum = 0;
+
+	UPROPERTY(VisibleInstanceOnly)
+	int ResidentTileChunksNum = 0;
 #endif
 
 	// this is to avoid recursion overhead and this is not a local variable to avoid allocations overhead
 	TArray<int> DDALocalIndexesStack;
 
+	// one bit per local tile of the vision result being calculated: whether the tile state is already known (visible or not visible)
+	// it's only needed during the traversal, so it's shared between all vision results
+	TArray<uint64> DDAKnownLocalTilesBits;
+
+	float SimulationTimeAccumulator = 0.0f;
+
+	// at least one tile became visible or not visible since the last snapshot
+	bool bGridVisibilityChanged = true;
+
+	uint64 VisibilityChecksum = 0;
+
+	// the live visibility bit of every tile, flipped together with the visibility counters crossing zero, so publishing is a plain copy
+	TArray<uint64> VisibleTilesBits;
+
+	// VisibleTilesBits changed since the last published snapshot
+	bool bVisibilitySnapshotDirty = false;
+
+	TSharedPtr<FFogOfWarVisibilitySnapshot, ESPMode::ThreadSafe> PublishedVisibilitySnapshot;
+
+	// the snapshot published before the current one, its buffer is reused once the readers let it go
+	TSharedPtr<FFogOfWarVisibilitySnapshot, ESPMode::ThreadSafe> RetiredVisibilitySnapshot;
+
+	// only guards swapping PublishedVisibilitySnapshot, the snapshots themselves are read without it
+	mutable FRWLock VisibilitySnapshotLock;
+
+	TSharedPtr<FFogOfWarRecording> VisibilityRecording;
+
+	TSharedPtr<FFogOfWarMovementTrace> MovementTrace;
+
+	// the tiles that flipped since the last recorded tick
+	TArray<int> RecordingFlippedTileGlobalIndexes;
+
+	// while it's set, TextureDataBuffer is owned by the player instead of being gathered from the grid
+	TUniquePtr<FFogOfWarRecordingPlayer> VisibilityPlayer;
+
+	bool bVisibilityPlaybackPaused = false;
+
+	// upper bound of the difference between the accumulated mask and the snapshot. the render targets are not updated when it's negligible
+	float SnapshotRemainingDifference = 1.0f;
+
+	// the CPU counterparts of the render targets, a float per tile in the global index order (see bCalculateSmoothVisibilityOnCPU)
+	// the snapshot expanded from the bits
+	TArray<float> SmoothVisibilitySnapshot;
+
+	// VisibilityTextureRenderTarget
+	TArray<float> SmoothVisibilityAccumulated;
+
+	// the cutoff and the horizontal half of the super sampling, the filter is separable
+	TArray<float> SmoothVisibilityRowsFiltered;
+
+	// FinalVisibilityTextureRenderTarget
+	TArray<float> SmoothVisibility;
+
+	TArray<uint8> SmoothVisibilityUploadBuffer;
+
+	// the published snapshot SmoothVisibilitySnapshot was expanded from
+	int64 SmoothVisibilitySnapshotVersion = INDEX_NONE;
+
+	// same as SnapshotRemainingDifference
+	float SmoothVisibilityRemainingDifference = 1.0f;
+
 	bool bFirstTick = true;
 
 	bool bActivated = false;
+
+	bool bHeadless = false;
 };
+
+template<bool bIntegerMath, typename FunctorType>
+void AFogOfWar::WalkDDARay(FIntVector2 IJ, const FIntVector2 TargetIJ, FunctorType&& Functor)
+{
+	const FIntVector2 Direction = TargetIJ - IJ;
+	const FIntVector2 DirectionSign = {
+		Direction.X >= 0 ? 1 : -1,
+		Direction.Y >= 0 ? 1 : -1
+	};
+	const FIntVector2 DirectionAbs = { FMath::Abs(Direction.X), FMath::Abs(Direction.Y) };
+	const float S_x = bIntegerMath ? 0.0f : FMath::Sqrt(FMath::Square(1.0) + FMath::Square(static_cast<float>(Direction.Y) / Direction.X));
+	const float S_y = bIntegerMath ? 0.0f : FMath::Sqrt(FMath::Square(1.0) + FMath::Square(static_cast<float>(Direction.X) / Direction.Y));
+	// this represents the total ray length after we went a step accordingly.
+	// note that the first step has the multiplier of 0.5 as we start from the tile center, after that it will be 1
+	float NextAccumulatedDxLength = 0.5 * S_x;
+	float NextAccumulatedDyLength = 0.5 * S_y;
+	// the integer version of the same: after kx steps along X the length is (kx + 0.5) * L / |dx| (L is the ray length),
+	// so comparing the lengths is comparing (2kx + 1) * |dy| with (2ky + 1) * |dx|. these are the doubled numerators
+	int NextDxNumerator = DirectionAbs.Y;
+	int NextDyNumerator = DirectionAbs.X;
+
+	// the total amount of transitions is mathematically not more than the manhattan distance
+	// double-checking to avoid infinite loops if something bad happens
+	const int SafetyIterations = DirectionAbs.X + DirectionAbs.Y + 1;
+	int SafetyCounter;
+
+	for (SafetyCounter = 0; SafetyCounter < SafetyIterations; SafetyCounter++)
+	{
+		if (!Functor(IJ) || IJ == TargetIJ)
+		{
+			break;
+		}
+
+		if (bIntegerMath ? NextDxNumerator < NextDyNumerator : NextAccumulatedDxLength < NextAccumulatedDyLength)
+		{
+			NextAccumulatedDxLength += S_x;
+			NextDxNumerator += 2 * DirectionAbs.Y;
+			IJ.X += DirectionSign.X;
+		}
+		else
+		{
+			NextAccumulatedDyLength += S_y;
+			NextDyNumerator += 2 * DirectionAbs.X;
+			IJ.Y += DirectionSign.Y;
+		}
+	}
+
+	checkSlow(SafetyCounter < SafetyIterations);
+}
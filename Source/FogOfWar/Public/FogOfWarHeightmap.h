@@ -0,0 +1,88 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Engine/EngineTypes.h"
+#include "UObject/ObjectKey.h"
+
+class AVolume;
+class ULevel;
+
+// The traced tile heights of a grid, stored chunk by chunk. The FogOfWar instances covering the same volume with the same TileSize and
+// collision channel (split-screen, per-player fog actors) share a single heightmap, so the grid is traced and stored once.
+// Every chunk is reference counted, so the instances keep their own residency. The heights of a referenced chunk only change when
+// the level streaming changes the geometry under it, then they are retraced in place and OnTilesRetraced notifies every instance.
+// Game thread only.
+class FOGOFWAR_API FFogOfWarHeightmap
+{
+public:
+	struct FKey
+	{
+		TObjectKey<AVolume> GridVolume;
+
+		float TileSize = 0.0f;
+
+		ECollisionChannel CollisionChannel = ECC_Camera;
+
+		// the deterministic mode rounds the traced heights
+		bool bRoundHeights = false;
+
+		FORCEINLINE_DEBUGGABLE bool operator==(const FKey& Other) const
+		{
+			return GridVolume == Other.GridVolume && TileSize == Other.TileSize && CollisionChannel == Other.CollisionChannel && bRoundHeights == Other.bRoundHeights;
+		}
+
+		friend FORCEINLINE_DEBUGGABLE uint32 GetTypeHash(const FKey& Key)
+		{
+			return HashCombineFast(HashCombineFast(GetTypeHash(Key.GridVolume), ::GetTypeHash(Key.TileSize)), ::GetTypeHash(Key.CollisionChannel * 2 + Key.bRoundHeights));
+		}
+	};
+
+	// a heightmap that is not shared with anybody
+	FFogOfWarHeightmap(int InChunksNum, int InChunkTilesNum);
+
+	// The heightmap somebody else already holds under the key or a new one.
+	static TSharedRef<FFogOfWarHeightmap> FindOrCreate(const FKey& Key, int ChunksNum, int ChunkTilesNum);
+
+	// The first reference fills the heights (in the chunk tile order) with TraceChunk, the next ones reuse them.
+	// The returned heights stay valid until the reference is released.
+	const float* AcquireChunk(int ChunkIndex, TFunctionRef<void(TArrayView<float> Heights)> TraceChunk);
+
+	void ReleaseChunk(int ChunkIndex);
+
+	FORCEINLINE_DEBUGGABLE bool IsChunkReferenced(int ChunkIndex) const { return Chunks[ChunkIndex].ReferencesNum > 0; }
+
+	// Overwrites the heights of a referenced chunk in place, the pointers returned by AcquireChunk stay valid.
+	void RetraceChunk(int ChunkIndex, TFunctionRef<void(TArrayView<float> Heights)> TraceChunk);
+
+	// Every instance sharing the heightmap gets the same level streaming event, only the first one in the frame gets true and retraces.
+	bool ClaimLevelStreamingEvent(const ULevel* Level, bool bLevelAdded);
+
+	DECLARE_MULTICAST_DELEGATE_TwoParams(FOnTilesRetraced, FIntVector2 /* MinIJ */, FIntVector2 /* MaxIJ */);
+
+	// broadcast by the instance that retraced the chunks, with the bounds of the retraced tiles
+	FOnTilesRetraced OnTilesRetraced;
+
+	FORCEINLINE_DEBUGGABLE int GetChunksNum() const { return Chunks.Num(); }
+
+	FORCEINLINE_DEBUGGABLE int GetChunkTilesNum() const { return ChunkTilesNum; }
+
+private:
+	struct FChunk
+	{
+		// empty until the first reference
+		TArray<float> Heights;
+
+		int ReferencesNum = 0;
+	};
+
+	TArray<FChunk> Chunks;
+
+	int ChunkTilesNum = 0;
+
+	// the level streaming events claimed during ClaimedLevelStreamingEventsFrame
+	TSet<TPair<TObjectKey<ULevel>, bool>> ClaimedLevelStreamingEvents;
+
+	uint64 ClaimedLevelStreamingEventsFrame = 0;
+};
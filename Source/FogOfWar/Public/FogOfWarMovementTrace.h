@@ -0,0 +1,125 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "VisionUnitHandle.h"
+
+// What the vision units did during a live session, simulation step by simulation step: added, moved, resized and removed.
+// Replaying it drives FogOfWar with the real workload (blobs, chokepoint traffic, mass deaths) instead of a synthetic one.
+// The locations are rounded to whole units and stored as the deltas from the unit's previous location, the whole stream is compressed.
+class FOGOFWAR_API FFogOfWarMovementTrace
+{
+public:
+	enum class EEventType : uint8
+	{
+		AddUnit,
+		MoveUnit,
+		SetUnitSightRadius,
+		RemoveUnit,
+		// the simulation step is over, the events after it belong to the next one
+		EndTick,
+	};
+
+	struct FEvent
+	{
+		EEventType Type = EEventType::EndTick;
+
+		// small and dense, reused after the unit is removed
+		int UnitId = INDEX_NONE;
+
+		// AddUnit and MoveUnit
+		FIntVector Location = FIntVector::ZeroValue;
+
+		// AddUnit and SetUnitSightRadius
+		float SightRadius = 0.0f;
+
+		float MaxSightRadius = 0.0f;
+	};
+
+	// the grid settings the trace was recorded with, the replay uses the same ones
+	struct FGridSettings
+	{
+		FVector2D BottomLeftWorldLocation = FVector2D::Zero();
+
+		FIntVector2 Resolution = { 0, 0 };
+
+		float TileSize = 0.0f;
+
+		float VisionBlockingDeltaHeightThreshold = 0.0f;
+
+		float VisionSharingHeightBandSize = 0.0f;
+
+		bool bDeterministicMode = false;
+
+		friend FArchive& operator<<(FArchive& Ar, FGridSettings& Settings)
+		{
+			return Ar << Settings.BottomLeftWorldLocation << Settings.Resolution.X << Settings.Resolution.Y << Settings.TileSize
+				<< Settings.VisionBlockingDeltaHeightThreshold << Settings.VisionSharingHeightBandSize << Settings.bDeterministicMode;
+		}
+	};
+
+	FFogOfWarMovementTrace() = default;
+
+	explicit FFogOfWarMovementTrace(const FGridSettings& InGridSettings);
+
+	void AddUnit(FVisionUnitHandle Handle, const FVector& Location, float SightRadius, float MaxSightRadius);
+
+	// the moves within the same whole unit are dropped
+	void MoveUnit(FVisionUnitHandle Handle, const FVector& Location);
+
+	void SetUnitSightRadius(FVisionUnitHandle Handle, float SightRadius, float MaxSightRadius);
+
+	void RemoveUnit(FVisionUnitHandle Handle);
+
+	void EndTick();
+
+	// compresses the recorded events, call it before replaying or saving the trace. Nothing can be recorded after that
+	void Finalize();
+
+	FORCEINLINE_DEBUGGABLE const FGridSettings& GetGridSettings() const { return GridSettings; }
+
+	FORCEINLINE_DEBUGGABLE int GetTicksNum() const { return TicksNum; }
+
+	// the number of the unit ids used, the replay can preallocate the handles for them
+	FORCEINLINE_DEBUGGABLE int GetUnitIdsNum() const { return UnitIdsNum; }
+
+	FORCEINLINE_DEBUGGABLE int64 GetCompressedSize() const { return CompressedData.Num(); }
+
+	// decompresses the events and calls Functor(const FEvent&) for each of them in order. False (with an error logged) if the trace is corrupt,
+	// the events before the corrupt one are still called
+	bool ForEachEvent(TFunctionRef<void(const FEvent& Event)> Functor) const;
+
+	friend FOGOFWAR_API FArchive& operator<<(FArchive& Ar, FFogOfWarMovementTrace& Trace);
+
+private:
+	int GetUnitId(FVisionUnitHandle Handle) const;
+
+	void WriteEventHeader(EEventType Type, int UnitId);
+
+	void WriteLocationDelta(int UnitId, const FIntVector& Location);
+
+private:
+	FGridSettings GridSettings;
+
+	int TicksNum = 0;
+
+	int UnitIdsNum = 0;
+
+	int UncompressedSize = 0;
+
+	TArray<uint8> CompressedData;
+
+	// everything below is only used while recording
+
+	TArray<uint8> PendingData;
+
+	TMap<FVisionUnitHandle, int> UnitIds;
+
+	TArray<int> FreeUnitIds;
+
+	// indexed by the unit id
+	TArray<FIntVector> LastUnitLocations;
+
+	bool bFinalized = false;
+};
@@ -0,0 +1,124 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Utils/BitUtils.h"
+
+// Tile visibility of every simulation step, stored as the tiles that flipped (became visible or not visible) during the step.
+// The steps are grouped into compressed blocks and every block starts with a keyframe (the full visibility bitset),
+// so seeking only decodes a single block.
+class FOGOFWAR_API FFogOfWarRecording
+{
+public:
+	FFogOfWarRecording() = default;
+
+	// InitialVisionData has a byte per tile in the global index order, non-zero means visible
+	FFogOfWarRecording(FIntVector2 InGridResolution, int InTicksPerKeyframe, TConstArrayView<uint8> InitialVisionData);
+
+	// FlippedTileGlobalIndexes may contain the same tile several times (it flipped back), such pairs cancel out. The array is sorted in place.
+	void AddTick(TArray<int>& FlippedTileGlobalIndexes);
+
+	// compresses the block that is still being recorded, call it before playing or saving the recording
+	void Finalize();
+
+	FORCEINLINE_DEBUGGABLE int GetTicksNum() const { return TicksNum; }
+
+	FORCEINLINE_DEBUGGABLE FIntVector2 GetGridResolution() const { return GridResolution; }
+
+	// the size of the compressed blocks in bytes
+	int64 GetCompressedSize() const;
+
+	friend FOGOFWAR_API FArchive& operator<<(FArchive& Ar, FFogOfWarRecording& Recording);
+
+private:
+	friend class FFogOfWarRecordingPlayer;
+
+	struct FBlock
+	{
+		int FirstTick = 0;
+
+		int TicksNum = 0;
+
+		int UncompressedSize = 0;
+
+		// the keyframe words followed by the ticks: the number of the flipped tiles and the deltas between their sorted global indexes, all as varints
+		TArray<uint8> CompressedData;
+
+		friend FArchive& operator<<(FArchive& Ar, FBlock& Block)
+		{
+			return Ar << Block.FirstTick << Block.TicksNum << Block.UncompressedSize << Block.CompressedData;
+		}
+	};
+
+	// false (with an error logged) if the block data is damaged
+	bool DecompressBlock(int BlockIndex, TArray<uint8>& OutData) const;
+
+	// the sizes and the tick ranges read from an archive, so nothing is decoded out of bounds
+	bool IsLoadedDataValid() const;
+
+	FORCEINLINE_DEBUGGABLE int GetKeyframeSize() const { return BitUtils::GetWordsNum(GridResolution.X * GridResolution.Y) * sizeof(uint64); }
+
+private:
+	FIntVector2 GridResolution = { 0, 0 };
+
+	int TicksPerKeyframe = 64;
+
+	int TicksNum = 0;
+
+	TArray<FBlock> Blocks;
+
+	// the block that is still being recorded, uncompressed
+	TArray<uint8> PendingBlockData;
+
+	int PendingBlockTicksNum = 0;
+
+	// the visibility after the last recorded tick, a keyframe is copied from it when a new block starts
+	TArray<uint64> CurrentVisibleTilesBits;
+};
+
+// Decodes a recording into the vision data (a byte per tile, 0 or 0xFF, the same format as the snapshot texture).
+// Stepping forward only decodes the next tick, seeking decompresses at most one block.
+class FOGOFWAR_API FFogOfWarRecordingPlayer
+{
+public:
+	explicit FFogOfWarRecordingPlayer(TSharedRef<const FFogOfWarRecording> InRecording);
+
+	// Moves to the tick and writes the visibility after it into VisionData. INDEX_NONE is the visibility before the first tick.
+	// Returns false if nothing changed.
+	bool Seek(int Tick, TArrayView<uint8> VisionData);
+
+	// Returns false if nothing changed or the recording is over.
+	bool StepForward(TArrayView<uint8> VisionData);
+
+	FORCEINLINE_DEBUGGABLE int GetCurrentTick() const { return CurrentTick; }
+
+	// a corrupt recording is finished at the last tick that could be decoded
+	FORCEINLINE_DEBUGGABLE bool IsFinished() const { return bIsCorrupt || CurrentTick + 1 >= Recording->GetTicksNum(); }
+
+	FORCEINLINE_DEBUGGABLE const FFogOfWarRecording& GetRecording() const { return *Recording; }
+
+private:
+	// writes the keyframe of the block into VisionData, CurrentTick becomes the tick before the block. False if the block is damaged
+	bool LoadBlock(int BlockIndex, TArrayView<uint8> VisionData);
+
+	// returns false if no tile flipped
+	bool DecodeNextTick(TArrayView<uint8> VisionData);
+
+	// logs the error and stops the playback, always returns false
+	bool MarkCorrupt();
+
+private:
+	TSharedRef<const FFogOfWarRecording> Recording;
+
+	int CurrentTick = INDEX_NONE;
+
+	int CurrentBlockIndex = INDEX_NONE;
+
+	TArray<uint8> CurrentBlockData;
+
+	// where the next tick starts in CurrentBlockData
+	int CurrentBlockReadOffset = 0;
+
+	bool bIsCorrupt = false;
+};
@@ -0,0 +1,54 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Utils/BitUtils.h"
+
+// A copy of the grid visibility (a bit per tile) published by FogOfWar after the simulation steps that changed it.
+// It's never modified after it's published, a newer snapshot replaces it instead, so any thread can hold it and read it without locks.
+class FOGOFWAR_API FFogOfWarVisibilitySnapshot
+{
+public:
+	// grows by one with every published snapshot, so the readers can tell whether anything changed since their last query
+	FORCEINLINE_DEBUGGABLE int64 GetVersion() const { return Version; }
+
+	FORCEINLINE_DEBUGGABLE FIntVector2 GetGridResolution() const { return GridResolution; }
+
+	// false if the tile is outside the grid
+	FORCEINLINE_DEBUGGABLE bool IsTileVisible(FIntVector2 TileIJ) const
+	{
+		if ((TileIJ.X < 0) | (TileIJ.Y < 0) | (TileIJ.X >= GridResolution.X) | (TileIJ.Y >= GridResolution.Y))
+		{
+			return false;
+		}
+		return BitUtils::Test(VisibleTilesBits.GetData(), TileIJ.X * GridResolution.Y + TileIJ.Y);
+	}
+
+	// same as AFogOfWar::IsLocationVisible at the moment the snapshot was published
+	bool IsLocationVisible(const FVector& WorldLocation) const;
+
+	void AreLocationsVisible(TConstArrayView<FVector> WorldLocations, TArrayView<bool> OutResults) const;
+
+	// the number of the visible tiles among the locations, e.g. to score the EQS items in bulk
+	int CountVisibleLocations(TConstArrayView<FVector> WorldLocations) const;
+
+	FIntVector2 ConvertWorldLocationToTileIJ(const FVector2D& WorldLocation) const;
+
+private:
+	friend class AFogOfWar;
+
+	int64 Version = 0;
+
+	FIntVector2 GridResolution = { 0, 0 };
+
+	FVector2D GridBottomLeftWorldLocation = FVector2D::Zero();
+
+	float TileSize = 0.0f;
+
+	// the tile conversion follows the deterministic mode of the grid
+	bool bDeterministicMode = false;
+
+	// in the global index order
+	TArray<uint64> VisibleTilesBits;
+};
@@ -0,0 +1,68 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Components/ActorComponent.h"
+#include "InstancedVisibleComponent.generated.h"
+
+
+class AFogOfWar;
+class UInstancedStaticMeshComponent;
+
+// Instanced mesh counterpart of VisibleComponent for the crowds and the buildings rendered as ISM/HISM instances.
+// The fog is evaluated for all instances of the owner's instanced meshes in one batch (against the published visibility snapshot, in parallel)
+// and the visibility is written into the per-instance custom data, 1 for visible and 0 for not visible, for the material to hide the instance.
+// Only the flipped instances are written and every mesh's instance data is flushed to the render thread once per update, without recreating the proxy.
+UCLASS(BlueprintType, Blueprintable, ClassGroup = (Custom), meta = (BlueprintSpawnableComponent))
+class FOGOFWAR_API UInstancedVisibleComponent : public UActorComponent
+{
+	GENERATED_BODY()
+
+public:
+	// NumCustomDataFloats of the meshes is raised to fit it
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, meta = (ClampMin = 0, UIMin = 0))
+	int CustomDataIndex = 0;
+
+	// The instances are never moved, so nothing is recalculated until the fog changes. Otherwise the instances are re-evaluated every tick.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	bool bStaticInstances = false;
+
+public:
+	UInstancedVisibleComponent();
+
+	// Replaces the meshes that are managed. By default these are all instanced meshes of the owner at BeginPlay.
+	UFUNCTION(BlueprintCallable)
+	void SetInstancedMeshes(const TArray<UInstancedStaticMeshComponent*>& NewInstancedMeshes);
+
+	// false if the instance is not managed or its visibility is not known yet
+	UFUNCTION(BlueprintPure)
+	bool IsInstanceVisible(const UInstancedStaticMeshComponent* InstancedMesh, int InstanceIndex) const;
+
+protected:
+	virtual void BeginPlay() override;
+
+	virtual void TickComponent(float DeltaTime, ELevelTick TickType, FActorComponentTickFunction* ThisTickFunction) override;
+
+	void UpdateVisibility(bool bForceChanged = false);
+
+protected:
+	struct FManagedInstancedMesh
+	{
+		TWeakObjectPtr<UInstancedStaticMeshComponent> Mesh;
+
+		// the visibility the custom data was last written with, indexed by the instance index
+		TArray<bool> InstanceVisibilities;
+	};
+
+	TArray<FManagedInstancedMesh> ManagedMeshes;
+
+	// the visibility snapshot the instances were last evaluated against
+	int64 EvaluatedSnapshotVersion = INDEX_NONE;
+
+	// the new visibility of the instances, kept here not to reallocate every tick
+	TArray<bool> NewInstanceVisibilities;
+
+	UPROPERTY()
+	AFogOfWar* FogOfWar = nullptr;
+};
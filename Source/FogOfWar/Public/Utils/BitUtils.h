@@ -0,0 +1,38 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+// helpers for the bitsets stored as plain arrays of 64-bit words
+namespace BitUtils
+{
+	constexpr int WordBitsNum = 64;
+
+	FORCEINLINE_DEBUGGABLE int GetWordsNum(int BitsNum) { return (BitsNum + WordBitsNum - 1) / WordBitsNum; }
+
+	FORCEINLINE_DEBUGGABLE bool Test(const uint64* Words, int Index) { return (Words[Index / WordBitsNum] >> (Index % WordBitsNum)) & 1; }
+
+	FORCEINLINE_DEBUGGABLE void Set(uint64* Words, int Index) { Words[Index / WordBitsNum] |= uint64(1) << (Index % WordBitsNum); }
+
+	FORCEINLINE_DEBUGGABLE void Clear(uint64* Words, int Index) { Words[Index / WordBitsNum] &= ~(uint64(1) << (Index % WordBitsNum)); }
+
+	FORCEINLINE_DEBUGGABLE void Flip(uint64* Words, int Index) { Words[Index / WordBitsNum] ^= uint64(1) << (Index % WordBitsNum); }
+
+	// calls Functor(Index) for every set bit, skipping the empty words entirely
+	template<typename FunctorType>
+	FORCEINLINE_DEBUGGABLE void ForEachSetBit(const uint64* Words, int WordsNum, FunctorType&& Functor)
+	{
+		for (int WordIndex = 0; WordIndex < WordsNum; WordIndex++)
+		{
+			uint64 Word = Words[WordIndex];
+			while (Word != 0)
+			{
+				const int BitIndex = static_cast<int>(FMath::CountTrailingZeros64(Word));
+				Functor(WordIndex * WordBitsNum + BitIndex);
+				// clearing the lowest set bit
+				Word &= Word - 1;
+			}
+		}
+	}
+}
@@ -0,0 +1,46 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+// LEB128, used by the recordings and the traces where most of the values (deltas, ids) are small and take a single byte
+namespace VarintUtils
+{
+	// enough for any uint32
+	constexpr int MaxBytesNum = 5;
+
+	FORCEINLINE_DEBUGGABLE void Write(TArray<uint8>& Data, uint32 Value)
+	{
+		while (Value >= 0x80)
+		{
+			Data.Add(static_cast<uint8>(Value) | 0x80);
+			Value >>= 7;
+		}
+		Data.Add(static_cast<uint8>(Value));
+	}
+
+	// false if the data ends in the middle of the value or the value doesn't fit uint32, the data may come from a corrupt file
+	FORCEINLINE_DEBUGGABLE bool Read(const TArray<uint8>& Data, int& Offset, uint32& OutValue)
+	{
+		OutValue = 0;
+		for (int ByteIndex = 0; ByteIndex < MaxBytesNum; ByteIndex++)
+		{
+			if (Offset < 0 || Offset >= Data.Num())
+			{
+				return false;
+			}
+			const uint8 Byte = Data[Offset++];
+			if (ByteIndex == MaxBytesNum - 1 && Byte > 0x0F)
+			{
+				return false;
+			}
+			OutValue |= static_cast<uint32>(Byte & 0x7F) << (ByteIndex * 7);
+			if ((Byte & 0x80) == 0)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+}
@@ -4,6 +4,7 @@
 
 #include "CoreMinimal.h"
 #include "Components/ActorComponent.h"
+#include "VisionUnitHandle.h"
 #include "VisionComponent.generated.h"
 
 
@@ -14,10 +15,17 @@ class FOGOFWAR_API UVisionComponent : public UActorComponent
 {
 	GENERATED_BODY()
 
+	friend class AFogOfWar;
+
 private:
 	UPROPERTY(EditAnywhere, meta = (ClampMin = 0.0f, UIMin = 0.0f))
 	float SightRadius = 1000.0f;
 
+	// The memory is reserved for this sight radius, so changing SightRadius up to this value is cheap (e.g. buffs or day/night cycle).
+	// Zero means that no additional memory is reserved.
+	UPROPERTY(EditAnywhere, meta = (ClampMin = 0.0f, UIMin = 0.0f))
+	float MaxSightRadius = 0.0f;
+
 protected:
 	virtual void BeginPlay() override;
 
@@ -34,10 +42,22 @@ public:
 	UFUNCTION(BlueprintCallable)
 	void SetSightRadius(float NewSightRadius);
 
+	UFUNCTION(BlueprintPure)
+	FORCEINLINE_DEBUGGABLE float GetMaxSightRadius() const { return MaxSightRadius; }
+
+	FORCEINLINE_DEBUGGABLE FVisionUnitHandle GetVisionUnitHandle() const { return VisionUnitHandle; }
+
 protected:
-	void ReregisterToFogOfWar();
+	void UpdateSightRadiusInFogOfWar();
+
+	void OnOwnerTransformUpdated(USceneComponent* UpdatedComponent, EUpdateTransformFlags UpdateTransformFlags, ETeleportType Teleport);
 
 private:
 	UPROPERTY()
 	AFogOfWar* FogOfWar = nullptr;
+
+	FVisionUnitHandle VisionUnitHandle;
+
+	// the tile the owner was on when the fog was notified last time
+	int CachedTileGlobalIndex = INDEX_NONE;
 };
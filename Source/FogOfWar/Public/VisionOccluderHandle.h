@@ -0,0 +1,32 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "VisionOccluderHandle.generated.h"
+
+// Stable reference to a vision occluder added to FogOfWar. Stays valid until the occluder is removed, after that it's safely rejected.
+USTRUCT(BlueprintType)
+struct FOGOFWAR_API FVisionOccluderHandle
+{
+	GENERATED_BODY()
+
+public:
+	FORCEINLINE_DEBUGGABLE bool IsSet() const { return Index != INDEX_NONE; }
+
+	FORCEINLINE_DEBUGGABLE void Reset() { *this = {}; }
+
+	FORCEINLINE_DEBUGGABLE bool operator==(const FVisionOccluderHandle& Other) const { return Index == Other.Index && Generation == Other.Generation; }
+
+	FORCEINLINE_DEBUGGABLE bool operator!=(const FVisionOccluderHandle& Other) const { return !(*this == Other); }
+
+	friend FORCEINLINE_DEBUGGABLE uint32 GetTypeHash(const FVisionOccluderHandle& Handle) { return HashCombineFast(::GetTypeHash(Handle.Index), ::GetTypeHash(Handle.Generation)); }
+
+private:
+	friend class AFogOfWar;
+
+	int32 Index = INDEX_NONE;
+
+	// the index is reused after the occluder is removed, so the generation tells the handles of the old and the new occluders apart
+	int32 Generation = 0;
+};
@@ -0,0 +1,32 @@
+// Copyright 2024 zhmyh1337 (https://github.com/zhmyh1337/). All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "VisionUnitHandle.generated.h"
+
+// Stable reference to a vision unit registered with FogOfWar. Stays valid until the unit is removed, after that it's safely rejected.
+USTRUCT(BlueprintType)
+struct FOGOFWAR_API FVisionUnitHandle
+{
+	GENERATED_BODY()
+
+public:
+	FORCEINLINE_DEBUGGABLE bool IsSet() const { return SlotIndex != INDEX_NONE; }
+
+	FORCEINLINE_DEBUGGABLE void Reset() { *this = {}; }
+
+	FORCEINLINE_DEBUGGABLE bool operator==(const FVisionUnitHandle& Other) const { return SlotIndex == Other.SlotIndex && Generation == Other.Generation; }
+
+	FORCEINLINE_DEBUGGABLE bool operator!=(const FVisionUnitHandle& Other) const { return !(*this == Other); }
+
+	friend FORCEINLINE_DEBUGGABLE uint32 GetTypeHash(const FVisionUnitHandle& Handle) { return HashCombineFast(::GetTypeHash(Handle.SlotIndex), ::GetTypeHash(Handle.Generation)); }
+
+private:
+	friend class AFogOfWar;
+
+	int32 SlotIndex = INDEX_NONE;
+
+	// the slot is reused after the unit is removed, so the generation tells the handles of the old and the new units apart
+	int32 Generation = 0;
+};